@@ -1,3 +1,3 @@
 @echo off
-gcc -Wall -g3 -o chatmacro.exe src\chatmacro.c
+gcc -Wall -g3 -o chatmacro.exe src\chatmacro.c src\sys_win32.c src\sys_record.c
 
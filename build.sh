@@ -0,0 +1,7 @@
+#!/bin/sh
+cc -Wall -g3 -o chatmacro src/chatmacro.c src/sys_posix.c src/sys_x11.c src/sys_evdev.c src/sys_record.c -lX11 -lXtst -lpthread
+
+case "$1" in
+test) ./chatmacro --backend record:in=test/record.txt,keys=test/record.out --keys test/hotkeys.txt test/macros.txt && diff -u test/record.keys test/record.out ;;
+x11) test/x11.sh ;;
+esac
@@ -7,16 +7,100 @@
  * This is honestly just built to facilitate chat macros while playing video games, but it could
  * probably have other uses too.
  *
- * Currently, only Win32 is supported as a platform; however, it wouldn't be too much effort to
- * swap out the Win32 calls with equivalent, or close to, Xorg calls, to make it available on Linux.
+ * Everything that talks to the OS goes through sys.h. On Windows, that's sys_win32.c, and on Linux
+ * it's sys_posix.c, and either the X11 backend (sys_x11.c), which also runs headless under Xvfb, or
+ * the evdev one (sys_evdev.c), which works underneath any display server. There's also a recording
+ * backend (sys_record.c) everywhere, that runs the whole program from a script, without a desktop.
  *
  * Virtual Keycodes:
  *   https://docs.microsoft.com/en-us/windows/win32/inputdev/virtual-key-codes
  *
  * USAGE
- *   chatmacro.exe <macrofile>
+ *   chatmacro [--backend <name>[:<options>]] [--hook] [--keys <hotkeyfile>] [--profile <name>]
+ *             [--paste <events>] [--ipc <name>] [--log <logfile>] [macrofile]
+ *   chatmacro [--backend <name>[:<options>]] --say <bank> <macro> [macrofile]
+ *   chatmacro [--ipc <name>] --send <command>
+ *   chatmacro --compile <macrofile> -o <packfile>
+ *   chatmacro [--backend <name>[:<options>]] --bench [macrofile]
+ *   chatmacro --stats [macrofile]
  *
- *   Currently, these keys are hardcoded in main, with these functions:
+ *   The macro file can either be the plain text format (see macros_parse), or a pack built with
+ *   --compile. A pack is the already parsed and compiled form of a macro file (see pack_load), so
+ *   it loads without any parsing at all. Packs are only good for the platform that built them.
+ *
+ *   A text macro file gets a cache next to it ("macros.txt" + CACHE_SUFFIX), written when the program
+ *   quits. It's a pack, with every bank that got used already compiled, so as long as the macro
+ *   file's size, modified time and contents haven't changed since, the next start just maps the
+ *   cache instead of parsing anything (see cache_load).
+ *
+ *   --bench times the parser with each of the newline scanners (see text_scan), on the given file,
+ *   or on BENCH_MB of generated macros if there isn't one. Loading the banks compiles them for the
+ *   backend's keyboard layout, so it needs a backend it can open ("--backend record" opens anywhere).
+ *
+ *   --stats compiles every bank, and says how many events the macros take, and how many they'd
+ *   take without shift being held across runs of shifted characters (see plan_compile).
+ *
+ *   --backend picks where hotkeys come from and keys go (see backends), the first one's the
+ *   default. What the options are is up to the backend, see the top of its file.
+ *
+ *   --hook has the backend hook the whole keyboard, and look the hotkeys up itself (see hook),
+ *   instead of having the OS bind each one. Turning the hotkeys on and off is then just a flag,
+ *   instead of binding and unbinding each of them. X11 can't, and just binds them.
+ *
+ *   --profile picks how fast macros get typed (see profiles), for games that drop keys when
+ *   they come in too fast. How many keys a second each profile actually managed, and how many
+ *   it dropped, is printed when the program quits.
+ *
+ *   --say types the one macro, bank and macro like the hotkeys' "say" takes them, and quits once
+ *   it's gone out (see command_run).
+ *
+ *   --send hands the command (anything the hotkey file can have a hotkey do, like "say TrashTalk
+ *   2", or "quit") to the chatmacro that's running, which runs it as if a hotkey had been pressed
+ *   (see ipc_read). They go over a socket on Linux, and a named pipe on Windows, called IPC_NAME,
+ *   or whatever --ipc says, and only the user that's running it can send it anything.
+ *
+ *   --log writes the log to the file instead of stderr, in big pieces, whenever the program's got
+ *   nothing else to do, instead of a line at a time.
+ *
+ *   --paste has macros that would take at least that many events to type get pasted through the
+ *   clipboard instead (see say_paste), for games that take Ctrl+V in their chat box. Whatever was
+ *   on the clipboard is put back afterwards. The "paste" profile does this for anything over 64.
+ *   The Win32 and X11 backends can paste, the others just type everything.
+ *
+ *   Loading a macro file only indexes it, finding each bank's name and where its text is. A bank's
+ *   lines only get parsed and compiled the first time it's swapped to, or said from (see
+ *   bank_load), so a big shared file only costs as much as the banks that actually get used.
+ *
+ *   The macro file is watched while the program runs, and gets reloaded whenever it changes. Banks
+ *   that were already loaded, and haven't changed, are kept as they are, and the current bank /
+ *   macro are kept.
+ *
+ *   All of it (the hotkeys, a hotkey's keys timing out, the macro file changing, commands coming
+ *   in, and the typing thread finishing up) is one loop, on the main thread, that waits on all of
+ *   them at once (see sys_loop_wait), so it's asleep whenever none of them have anything for it.
+ *
+ *   The hotkeys come from the hotkey file (--keys, or HOTKEY_FILE if it's there, see
+ *   hotkeys_load), one a line, the keys and then what they do:
+ *
+ *     numpad8         say
+ *     ctrl+shift+f1   say 3 2     # says bank 3's second macro, wherever we are
+ *     repeat+numpad5  macro +1    # keeps going while it's held
+ *     ctrl+space,g,g  say 2 1     # three keys, one after another
+ *     numpad7,digit,digit  say * *  # numpad7 3 2 says bank 3's second macro
+ *     ctrl+f2         say TrashTalk 2   # banks can go by their name too
+ *     ctrl+f3         goto Problems 14  # moves to the bank (and macro), without saying it
+ *
+ *   A hotkey can be a few keys, one after another, with at most KEYSEQ_TIMEOUT_MS between them.
+ *   'digit' is any of the numpad's digits, and each '*' in the arguments is the next one that was
+ *   typed. They're all compiled into one table (see keyseq_build), so each key's a single lookup,
+ *   however many hotkeys there are. Without --hook, only the keys the hotkeys use ever get to us,
+ *   so typing something else in the middle of one doesn't stop it, only the timeout does.
+ *
+ *   Bank names are looked up in a hash table that's built when the macro file's loaded (see
+ *   bank_index), so naming them costs nothing over numbering them, and they don't move when banks
+ *   get added above them.
+ *
+ *   Without one, these are the hotkeys (hotkeys_default):
  *     NUMPAD .    - quits program
  *     NUMPAD 0    - toggle hotkeys on / off (leaves running)
  *     NUMPAD 1    - swaps to the previous macro bank (-1)
@@ -24,18 +108,26 @@
  *     NUMPAD 4    - moves to the previous macro      (-1)
  *     NUMPAD 5    - moves to the next macro          (+1)
  *     NUMPAD 8    - "types" the macro through the keyboard
+ *     NUMPAD 9    - stops typing, and forgets any macros still waiting to be typed
+ *
+ *   The macro file's UTF-8. Characters the keyboard layout has a key for get typed with that key,
+ *   and anything else gets typed as unicode (KEY_UNICODE, see backend_t::send), so accents, CJK,
+ *   emoji and the like all come out right.
+ *
+ *   Plans are compiled for the keyboard layout of whatever window has focus. If that changes (the
+ *   player switches layouts mid-game), the next say notices, and every bank gets compiled again
+ *   for the new layout as it's used (see keymap_check).
  *
- *   Also, the macro file ("macros.txt") is also hardcoded. Some argument parsing or configuration
- *   would probably do this program well.
+ *   The macro file's whatever's last on the command line, or MACRO_FILE if there isn't one, the
+ *   same way the hotkey file's --keys, or HOTKEY_FILE.
  *
  * NOTE
  *
  * TODO
  * 1. Minimize to Tray (Not Console Application)
- * 2. Redirect stdout/stderr to a log file
- * 3. Overlay Window
- * 4. Shuffle Button
- * 5. Start Applications (Custom Run Dialog for Specially Hooked up Programs??)
+ * 2. Overlay Window
+ * 3. Shuffle Button
+ * 4. Start Applications (Custom Run Dialog for Specially Hooked up Programs??)
  */
 
 #include <stdio.h>
@@ -47,45 +139,470 @@
 #define COMMON_IMPLEMENTATION
 #include "common.h"
 
-#define WIN32_LEAN_AND_MEAN
-#include <windows.h>
+#include "sys.h"
+
+#if defined(__SSE2__)
+#define NLSCAN_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NLSCAN_AVX2
+#include <immintrin.h>
+#endif
 
 #define MACRO_FILE ("macros.txt")
+#define HOTKEY_FILE ("hotkeys.txt")
+
+#define WATCH_SETTLE_MS (100)
+
+#define IPC_NAME  ("chatmacro") // where commands come in (see ipc_read), without --ipc
+#define IPC_WORDS (8)           // the most words a command can be
+
+#define LOG_BUFFER (1 << 14) // how much of the log (see --log) can wait to be written out
+
+#define PARSE_THREADS_MIN (1 << 22) // anything smaller than this gets parsed on just the one thread
+#define PARSE_THREADS_MAX (32)
+
+#define BENCH_MB       (100) // how much text --bench makes up, when it isn't given a file
+#define BENCH_PARSE_MB (8)   // how much of that goes through the whole of macros_parse
+
+#define CMPACK_MAGIC   ("CMPK")
+#define CMPACK_VERSION (6)
+#define CMPACK_ALIGN   (16)
+
+#define CACHE_SUFFIX (".cache")
+
+#define SEND_RETRY_US (1000) // the least a partly sent chunk waits before it's tried again
 
+#define SAY_QUEUE (16) // how many says can be waiting to be typed, has to be a power of two
+
+#define PASTE_SETTLE_MS (150) // how long the game gets to read the clipboard, before it's put back
+
+#define HOTKEY_KEYS (1 << 12) // every (modifiers, virtual key) there is, see HOTKEY_KEY
+#define HOTKEY_KEY(mods, vk) ((((mods) & 0x0f) << 8) | ((vk) & 0xff))
+
+#define HOTKEY_SEQ    (8)     // the most keys a hotkey can be, one after another
+#define HOTKEY_DIGITS (4)     // the most 'digit's a hotkey can have, each is ten times the hotkeys
+#define HOTKEY_DIGIT  (0x100) // what hotkeys_key says 'digit' is, any of the numpad's digits
+
+#define KEYSEQ_TIMEOUT_MS (1500) // how long a hotkey's keys can be apart, before it's given up on
+#define KEYSEQ_HOTKEY(i) (-1 - (i)) // a transition to hotkey i, and back again (see keyseq)
+
+// NOTE (brian): a plan is the exact key stream for one macro line, built once when its bank is
+// loaded, so saying a macro is a single backend_t::send over a buffer that's already sitting there.
+// It's a range in state_t::events, so plans can be written to (and used straight out of) a pack.
+struct plan_t {
+	u32 first;
+	u32 count;
+};
+
+// NOTE (brian): a view into state_t::text, which is the macro file mapped into memory
+struct span_t {
+	u32 off;
+	u32 len;
+};
+
+// NOTE (brian): the layout of a compiled pack is:
+//
+//   pack_hdr_t | pack_bank_t[banks_len] | span_t[lines_len] | plan_t[lines_len] | key_t[events_len] | text
+//
+// with every section starting on a CMPACK_ALIGN boundary. Offsets are from the start of the file,
+// and everything is in the native byte order. The lines, plans and events are the state's, as
+// they are. Banks that weren't loaded when the pack was written aren't in those at all, and get
+// loaded from the pack's text when they're used, same as always.
+//
+// The src_* fields say which macro file the pack was built from, so it can be used as a cache. If
+// the pack was compiled for some other keyboard layout, its events get thrown away when a bank is
+// first used, and everything's compiled again from the pack's text.
+struct pack_hdr_t {
+	char magic[4];
+	u32 version;
+	u32 hdr_size;
+	u32 event_size; // sizeof(struct key_t) for whoever wrote the pack
+	u64 size;
+	u32 banks_off, banks_len;
+	u32 lines_off, lines_len;
+	u32 plans_off;
+	u32 events_off, events_len;
+	u32 text_off, text_len;
+	u64 src_size;
+	u64 src_mtime;
+	u64 src_hash;
+	u64 layout; // the keyboard layout the events were compiled for
+};
+
+struct pack_bank_t {
+	struct span_t name;
+	struct span_t src;
+	u32 first; // index of the bank's first line
+	u32 count;
+	u32 loaded;
+};
+
+// NOTE (brian): until a bank's loaded (see bank_load), only its name and src are filled in
 struct bank_t {
-	char *name;
-	char **lines;
-	size_t lines_len, lines_cap;
+	struct span_t name;
+	struct span_t src; // the bank's name and lines
+	u32 first; // the bank's lines are state_t::lines[first, first + count)
+	u32 count;
+	s32 loaded;
 	s32 curr;
+	s32 prev; // the bank with the same name in the state this was reloaded from, or -1
+	s32 same; // true if the text hasn't changed since 'prev'
 };
 
+// NOTE (brian): The macros are kept as a structure of arrays. The text is the one blob, every
+// line of every loaded bank is an (offset, length) in 'lines', and a bank is just a range of
+// those. Banks get added to the end of the arrays as they're loaded, so they grow with realloc.
+// When they're used straight out of a pack, their 'cap' is zero, and they get copied out of the
+// mapping the first time something's added (see macros_reserve). The banks live in 'arena'.
 struct state_t {
+	struct c_arena_t arena;
+	char *map; // the mapped macro file, or pack
+	size_t map_len;
+	char *text;
+	size_t text_len;
+	u64 src_size; // what the macro file looked like when we loaded it
+	u64 src_mtime;
+	u64 src_hash;
+	s32 cache; // whether to write this out to the cache when we're done with it
+	size_t cache_banks; // how many banks were loaded in the cache this came from
+	struct span_t *lines;
+	struct plan_t *plans; // plans[i] is the compiled form of lines[i]
+	size_t lines_len, lines_cap;
+	struct key_t *events;
+	size_t events_len, events_cap;
+	u64 layout; // the keyboard layout the loaded banks were compiled for
 	struct bank_t *banks;
-	size_t banks_len, banks_cap;
+	size_t banks_len;
+	s32 *names; // the banks, hashed on their names (see bank_find)
+	size_t names_mask;
 	s32 curr;
 	s32 s_bank;
 	s32 s_macro;
 	s32 quit;
 };
 
-// NOTE (brian): the first three parameters are passed directly to RegisterHotkey
+// NOTE (brian): what text_scan finds, before it's copied into the state's arena
+struct scan_t {
+	s32 index; // only look for the banks, skip over their lines
+	struct bank_t *banks;
+	size_t banks_len, banks_cap;
+	struct span_t *lines;
+	size_t lines_len, lines_cap;
+};
+
+// NOTE (brian): one thread's worth of parsing, a range of the text for work_scan, or a range of
+// the banks for work_count and work_fill. 'rc' has to stay first, for sys_parallel.
+struct work_t {
+	s32 rc;
+	struct state_t *state;
+	size_t start, end;
+	struct scan_t scan;
+	size_t lines_first;
+	size_t events_first, events_len;
+};
+
+// NOTE (brian): finds the newlines in text[*off, end), writes up to 'cap' of their offsets to
+// 'out', and moves *off past what it's looked at
+typedef size_t (*nlscan_func)(char *text, size_t *off, size_t end, u32 *out, size_t cap);
+
+static nlscan_func nlscan;
+static char *nlscan_name;
+
+// NOTE (brian): the keymap for the layout that's being compiled for (see sys.h). plan_compile
+// reads this from every thread, so it only ever gets rebuilt on the main thread, when nothing's
+// being compiled.
+static struct keymap_t keymap;
+
+// NOTE (brian): where hotkeys come from, and where keys go (see sys.h), picked with --backend
+static struct backend_t *backends[] = {
+#if defined(_WIN32)
+	&backend_win32,
+#else
+	&backend_x11,
+	&backend_evdev,
+#endif
+	&backend_record
+};
+
+static struct backend_t *backend;
+static char *backend_opts;
+
+// NOTE (brian): only ever turned off by --stats, to count what plans would be without it
+static s32 plan_coalesce = 1;
+
+// NOTE (brian): The macro file's directory is one of the things the main loop waits on, and
+// every change to it puts 'settle' off a little more. Once it's been quiet that long, and the file
+// looks any different, it's loaded again on 'thread' (see watch_work), which sets 'done' when
+// 'next' is ready, and the main loop swaps that in for the state we've got (state_swap). 'base' is
+// the state it's loading against, which can't go anywhere until 'next' replaces it.
+struct watch_t {
+	char *fname;
+	char dname[BUFLARGE];
+	u64 size; // what the file looked like the last time we loaded it
+	u64 mtime;
+	f64 settle; // when to look at the file, 0 if nothing's changed
+	struct sys_dirwatch_t *dir;
+	struct sys_thread_t *thread; // the reload that's running, NULL if there isn't one
+	struct sys_event_t *done;
+	struct state_t *base;
+	struct state_t *next; // what the reload loaded, NULL if it couldn't
+	s32 again; // the file settled again while the reload was running
+};
+
+// NOTE (brian): what the main loop's waiting on, besides the backend, as SYS_READY's id
+enum {
+	LOOP_WATCH,
+	LOOP_IPC,
+	LOOP_RELOAD
+};
+
+// NOTE (brian): A hotkey's keys are 'modifiers' and 'vk', and then the 'seq_len' in 'seq' (as
+// HOTKEY_KEYs), one after another. Most are just the one key.
 struct hotkey_t {
 	u32 modifiers;
 	u32 vk;
 	s8 on_always;
-	s8 on_now;
-	s8 arg1;
-	s8 arg2;
+	s32 arg1;
+	s32 arg2;
 	s32 (*func)(struct state_t *state, struct hotkey_t *hotkeys, s32 len, s32 idx);
+	char *bank; // the bank's name, when it's given one instead of a number in arg1 (see bank_pick)
+	s32 line; // where in the hotkey file it was, for saying what it clashes with
+	s32 seq_len;
+	u16 seq[HOTKEY_SEQ - 1];
+};
+
+// NOTE (brian): one of the keys the hotkeys are made of, the first two are passed to backend_t::bind
+struct hotkey_key_t {
+	u32 modifiers; // with MOD_NOREPEAT, unless it's a hotkey all by itself that repeats
+	u32 vk;
+	s32 bound; // whether it's bound right now, without --hook
+};
+
+// NOTE (brian): Every key the hotkeys use, hashed on (modifiers, virtual key) with a perfect hash
+// (see keytab_build), so finding a key is two hashes and two loads, however many there are. Each
+// key hashes to a bucket, and each bucket has the seed that puts its keys in slots nobody else's
+// are in.
+//
+// With --hook, the backend asks hook_filter about every key (see backend_t::hook), from whatever
+// thread it likes, instead of the OS having each key registered, and 'on' is whether the
+// hotkeys that aren't always on are, so toggling them is just flipping it. The filter's thread
+// reads it while the main thread flips it, so it's only ever touched with the __atomic builtins.
+static struct {
+	struct hotkey_key_t *keys;
+	s32 len;
+	u16 *seeds;
+	s16 *slots;
+	u32 seeds_bits;
+	u32 slots_bits;
+	s32 hooked;
+	s32 on;
+} keytab;
+
+// NOTE (brian): The hotkeys, compiled into a DFA over keytab's keys (see keyseq_build), so each key
+// that goes down is one transition, however many hotkeys there are, or however long they are. A
+// state's row has a transition for each key, to another state (> 0), to a hotkey (< 0, see
+// KEYSEQ_HOTKEY), or nowhere (0, back to the start). next[0] only has the ways to the hotkeys
+// that are always on, and it's what's used while the rest are toggled off.
+//
+// 'state' is how far into a hotkey the keys so far have got, and it's given up on at 'until'. With
+// --hook, it's only ever touched by the thread the filter's called on, and otherwise by the main
+// thread, which also unbinds the keys that went on from it, once it's given up on.
+static struct {
+	struct hotkey_t *hotkeys;
+	s32 *next[2];
+	s32 states;
+	s32 state;
+	f64 until;
+	s32 held; // the key that last went somewhere, and what its repeats do
+	s32 repeat;
+} keyseq;
+
+// NOTE (brian): How a game likes its keys. Some drop keys that come in faster than they can take
+// them, and some take a whole line at once, so plans go out 'chunk' events at a time, 'gap_us'
+// apart (see send_events). The rest is how it's gone so far, printed on the way out (send_report),
+// so a game can be given the fastest profile that doesn't drop anything.
+struct profile_t {
+	char *name;
+	u32 chunk; // events per backend_t::send, 0 for the whole plan at once
+	u32 gap_us; // from the start of one chunk to the start of the next
+	u32 retries; // how many times the rest of a chunk that didn't all go in is tried again
+	u32 chat_ms; // how long the chat box gets to open, before typing into it
+	u32 paste; // plans with at least this many events get pasted instead of typed, 0 for never
+	u64 says;
+	u64 events; // what we tried to send
+	u64 sent;
+	u64 dropped;
+	u64 cancelled;
+	u64 retried;
+	f64 secs; // spent in send_events
+};
+
+static struct profile_t profiles[] = {
+	  { "burst",  0,     0, 2,  50,  0 } // what it's always done, the whole line in one send
+	, { "fast",  16,   500, 4,  50,  0 }
+	, { "paced",  4,  4000, 4,  80,  0 }
+	, { "slow",   2, 16000, 8, 150,  0 }
+	, { "paste",  0,     0, 2,  50, 64 }
+};
+
+static struct profile_t *profile = profiles;
+
+// NOTE (brian): Says are typed on their own thread (say_thread), so the hotkey loop never waits on
+// the chat box, the backend, or a slow profile's pacing. hotkey_fn_say is the only thing that adds
+// to the ring, and say_thread the only thing that takes from it, so each side just publishes its
+// index once it's done with the item, and neither ever takes a lock. The events are copied in,
+// since a reload can free the state's before they're sent, and so are the keys they were compiled
+// with, since the layout could change before they're sent too.
+//
+// Cancelling bumps 'gen', and sets 'cancel' to cut short whatever the thread's waiting on. Any say
+// that was queued before the bump is thrown away, including the one being typed.
+struct say_t {
+	struct profile_t *profile;
+	struct key_t *events;
+	u32 count;
+	char *text; // the line, if it's to be pasted
+	u32 text_len;
+	struct keys_t keys;
+	u32 gen;
+};
+
+struct sayq_t {
+	struct say_t items[SAY_QUEUE];
+	volatile u32 head; // only say_thread moves this
+	volatile u32 tail; // only say_queue moves this
+	volatile u32 gen;
+	volatile s32 quit;
+	struct sys_event_t *wake; // set when something's added to the ring
+	struct sys_event_t *cancel;
+	struct sys_thread_t *thread;
 };
 
-/* sys_lasterror : handles errors that aren't propogated through win32 errno */
-static void sys_lasterror();
+static struct sayq_t sayq;
+
+/* sys_parallel : runs func on every one of the n items in args, on their own threads, and waits */
+static s32 sys_parallel(s32 (*func)(void *arg), void *args, size_t size, s32 n);
+
+/* macros_load : loads a macro file (text or pack) into the state, reusing what it can from base */
+s32 macros_load(struct state_t *state, char *fname, struct state_t *base);
+/* macros_parse : indexes the banks in the mapped text file */
+s32 macros_parse(struct state_t *state, struct state_t *base);
+/* macros_match : points every bank at the bank with the same name in base (bank_t::prev) */
+s32 macros_match(struct state_t *state, struct state_t *base);
+/* macros_loadall : loads every bank that isn't loaded yet */
+s32 macros_loadall(struct state_t *state);
+/* macros_reserve : makes room to add 'lines' lines and 'events' events to the state */
+s32 macros_reserve(struct state_t *state, size_t lines, size_t events);
+/* macros_unload : forgets every loaded bank, so they get loaded again when they're used */
+void macros_unload(struct state_t *state);
+
+/* bank_load : parses and compiles the bank's lines onto the end of the state's, if it isn't loaded yet */
+s32 bank_load(struct state_t *state, struct bank_t *lbank);
+/* bank_index : builds the index of the banks' names, returns -1 if it couldn't */
+s32 bank_index(struct state_t *state);
+/* bank_find : returns the bank with that name, -1 if there isn't one */
+s32 bank_find(struct state_t *state, char *name, size_t len);
+/* bank_adopt : copies the lines, plans and events of an unchanged bank over from the old state */
+s32 bank_adopt(struct state_t *state, struct bank_t *lbank, struct state_t *base, struct bank_t *pbank);
+
+/* work_split_text : cuts the text up at bank names for work_scan, returns how many pieces */
+s32 work_split_text(struct state_t *state, struct work_t *work);
+/* work_split_banks : splits the banks into runs with about the same amount of text each */
+s32 work_split_banks(struct state_t *state, struct work_t *work);
+/* work_scan : (worker) scans its piece of the text */
+s32 work_scan(void *arg);
+/* work_count : (worker) scans every bank in its run, and counts up their events */
+s32 work_count(void *arg);
+/* work_fill : (worker) compiles the events for every bank in its run */
+s32 work_fill(void *arg);
+/* macros_free : releases everything macros_load allocated */
+void macros_free(struct state_t *state);
 
-/* macros_parse : parse macros from the input file to the state */
-s32 macros_parse(struct state_t *state, char *fname);
+/* text_scan : finds every bank and macro line in text[off, end), in a single pass */
+s32 text_scan(char *text, size_t off, size_t end, struct scan_t *scan);
+/* text_nextbank : returns the offset of the first bank name at or after 'off' */
+size_t text_nextbank(char *text, size_t len, size_t off);
+/* scan_line : figures out what text[start, end) is, and adds it to the scan */
+s32 scan_line(struct scan_t *scan, char *text, size_t start, size_t end);
+/* scan_grow : doubles the array if it's full */
+s32 scan_grow(void **p, size_t *cap, size_t len, size_t size);
+/* scan_free : frees the scan's arrays */
+void scan_free(struct scan_t *scan);
+
+/* nlscan_init : picks the newline scanner, the best one the cpu has unless 'name' says otherwise */
+s32 nlscan_init(char *name);
+/* nlscan_memchr : finds newlines with memchr, a line at a time */
+size_t nlscan_memchr(char *text, size_t *off, size_t end, u32 *out, size_t cap);
+/* nlscan_scalar : finds newlines a byte at a time */
+size_t nlscan_scalar(char *text, size_t *off, size_t end, u32 *out, size_t cap);
+#if defined(NLSCAN_SSE2)
+/* nlscan_sse2 : finds newlines 16 bytes at a time */
+size_t nlscan_sse2(char *text, size_t *off, size_t end, u32 *out, size_t cap);
+#endif
+#if defined(NLSCAN_AVX2)
+/* nlscan_avx2 : finds newlines 32 bytes at a time */
+size_t nlscan_avx2(char *text, size_t *off, size_t end, u32 *out, size_t cap);
+#endif
+
+/* bench_parse : times text_scan with every newline scanner, over a file or some generated text */
+s32 bench_parse(char *fname, size_t mb);
 /* state_dump : dumps the state of the 'state' object */
 s32 state_dump(struct state_t *state);
+/* stats_dump : compiles every bank, and prints how many events they take, with and without coalescing */
+s32 stats_dump(struct state_t *state);
+/* state_swap : swaps in the newly loaded state, carrying over where we were in the old one */
+struct state_t *state_swap(struct state_t *state, struct state_t *next);
+
+/* bank_same : returns true if the bank's text hasn't changed since base */
+s32 bank_same(struct state_t *state, struct bank_t *lbank, struct state_t *base);
+
+/* watch_start : starts watching the macro file for changes, in the main loop */
+s32 watch_start(struct watch_t *watch, char *fname);
+/* watch_stop : stops watching the macro file */
+void watch_stop(struct watch_t *watch);
+/* watch_changed : reads the changes to the file's directory, and puts off looking at the file until they settle */
+void watch_changed(struct watch_t *watch);
+/* watch_reload : starts loading the macro file again, if it looks any different (see watch_adopt) */
+void watch_reload(struct watch_t *watch, struct state_t *state);
+/* watch_work : (worker) loads the macro file against watch->base, and sets watch->done */
+s32 watch_work(void *arg);
+/* watch_adopt : swaps in what the reload loaded, once it's done, returns the state to use */
+struct state_t *watch_adopt(struct watch_t *watch, struct state_t *state);
+
+/* pack_write : writes the loaded state out as a compiled pack */
+s32 pack_write(struct state_t *state, char *fname);
+/* pack_load : loads the state straight out of the mapped pack */
+s32 pack_load(struct state_t *state);
+
+/* cache_load : swaps the state over to the macro file's cache, if the cache is up to date */
+s32 cache_load(struct state_t *state, char *fname);
+/* cache_write : writes the state out to a new cache file, if it has anything the old one doesn't */
+s32 cache_write(struct state_t *state, char *fname);
+/* cache_commit : puts the cache file cache_write wrote in place of the old one */
+s32 cache_commit(char *fname);
+
+/* plan_compile : compiles a macro line into events, returns the event count (counts only if NULL) */
+size_t plan_compile(struct key_t *events, char *s, size_t slen);
+
+/* keymap_build : fills in the keymap for the given keyboard layout */
+void keymap_build(u64 layout);
+/* keymap_check : makes sure the state's compiled for the keymap, before anything else gets compiled */
+void keymap_check(struct state_t *state);
+/* plan_push : writes a key event at events[len] (if we have a buffer), returns the new length */
+static size_t plan_push(struct key_t *events, size_t len, u32 code, s32 key_up);
+/* plan_char : adds the events to type the code point, returns the new length */
+static size_t plan_char(struct key_t *events, size_t len, u32 cp, s32 *shift);
+/* plan_shift : presses or releases shift, if it isn't already, returns the new length */
+static size_t plan_shift(struct key_t *events, size_t len, s32 want, s32 *shift);
+/* plan_unicode : adds a KEY_UNICODE down / up for the code point, returns the new length */
+static size_t plan_unicode(struct key_t *events, size_t len, u32 cp);
+
+/* utf8_ascii : returns how many bytes at the start of s are ascii */
+size_t utf8_ascii(char *s, size_t len);
+/* utf8_decode : decodes the code point at the start of s, returns its length, or 0 if it isn't valid */
+size_t utf8_decode(u8 *s, size_t len, u32 *cp);
 
 /* hotkey_fn_toggle : toggles the availabliliy of the other hotkeys */
 s32 hotkey_fn_toggle(struct state_t *state, struct hotkey_t *hotkeys, s32 len, s32 idx);
@@ -97,308 +614,3144 @@ s32 hotkey_fn_swap(struct state_t *state, struct hotkey_t *hotkeys, s32 len, s32
 s32 hotkey_fn_macro(struct state_t *state, struct hotkey_t *hotkeys, s32 len, s32 idx);
 /* hotkey_fn_say : says the selected macro */
 s32 hotkey_fn_say(struct state_t *state, struct hotkey_t *hotkeys, s32 len, s32 idx);
+/* hotkey_fn_cancel : stops saying the macro being typed */
+s32 hotkey_fn_cancel(struct state_t *state, struct hotkey_t *hotkeys, s32 len, s32 idx);
+
+/* hotkey_fn_sayat : says the macro in the hotkey's arguments, without moving to it */
+s32 hotkey_fn_sayat(struct state_t *state, struct hotkey_t *hotkeys, s32 len, s32 idx);
+/* hotkey_fn_goto : moves straight to the bank (and macro) in the hotkey's arguments */
+s32 hotkey_fn_goto(struct state_t *state, struct hotkey_t *hotkeys, s32 len, s32 idx);
+
+/* bank_pick : returns the bank the hotkey's about, by name or by number, -1 if there isn't one */
+s32 bank_pick(struct state_t *state, struct hotkey_t *hotkey);
+
+/* hotkeys_load : reads the hotkey file into a new array, and builds keyseq, returns NULL if it couldn't */
+struct hotkey_t *hotkeys_load(char *fname, s32 *len);
+/* hotkeys_free : frees the hotkeys, and their banks' names */
+void hotkeys_free(struct hotkey_t *hotkeys);
+/* hotkeys_cmd : returns the hotkey_cmds entry with that name, that takes that many arguments, or -1 */
+s32 hotkeys_cmd(char *name, s32 args);
+/* hotkeys_key : parses keys like "ctrl+shift+f1", returns -1 if it can't */
+s32 hotkeys_key(char *s, u32 *mods, u32 *vk);
+
+/* keyseq_build : builds keytab and the DFA for the hotkeys, returns -1 if they clash */
+s32 keyseq_build(struct hotkey_t *hotkeys, s32 len, char *fname);
+/* keyseq_free : frees the DFA and keytab */
+void keyseq_free();
+/* keyseq_step : takes the key through the DFA, returns a hotkey, HOOK_PASS or HOOK_EAT (see hook_func) */
+s32 keyseq_step(s32 key, s32 repeat, f64 now);
+/* keyseq_bind : binds the keys that go somewhere from here, and unbinds the rest, or all if 'off' */
+s32 keyseq_bind(s32 off);
+
+/* keytab_build : builds the perfect hash of the keys, returns -1 if it couldn't */
+s32 keytab_build(struct hotkey_key_t *keys, s32 len);
+/* keytab_free : frees the hash */
+void keytab_free();
+/* keytab_find : returns the index of the key, -1 if it isn't one of the hotkeys' */
+s32 keytab_find(u32 mods, u32 vk);
+/* keytab_hash : mixes the key and the seed together (murmur3's finalizer) */
+static u32 keytab_hash(u32 key, u32 seed);
+/* hook_filter : says which hotkey the key is, if any (see hook_func) */
+static s32 hook_filter(u32 mods, u32 vk, s32 repeat);
+
+/* say_macro : says macro 'm' of bank 'b', or the bank's current macro if 'm' is -1 */
+s32 say_macro(struct state_t *state, s32 b, s32 m);
+
+/* command_run : runs one of hotkey_cmds, like "say TrashTalk 2", as if a hotkey had been pressed */
+s32 command_run(struct state_t *state, char **words, s32 n);
+
+/* ipc_read : runs every command that's come in (see command_run), one a line */
+void ipc_read(struct sys_ipc_t *ipc, struct state_t *state);
+/* ipc_send : sends the words, as one command, to whoever's listening at 'name' */
+s32 ipc_send(char *name, char **words, s32 n);
+
+/* loop_idle : flushes the log, and returns when the main loop has to wake up by itself, 0 if it doesn't */
+f64 loop_idle(struct watch_t *watch, s32 hooked);
+
+// NOTE (brian): the hotkeys there are without a hotkey file
+static struct hotkey_t hotkeys_default[] = {
+	  { 0x4000, VK_NUMPAD0, 1,  0,  0, hotkey_fn_toggle }
+	, { 0x4000, VK_DECIMAL, 1,  0,  0, hotkey_fn_quit }
+	, { 0x4000, VK_NUMPAD1, 0, -1,  0, hotkey_fn_swap } // bank  -1
+	, { 0x4000, VK_NUMPAD2, 0,  1,  0, hotkey_fn_swap } // bank  +1
+	, { 0x4000, VK_NUMPAD4, 0,  0, -1, hotkey_fn_swap } // macro -1
+	, { 0x4000, VK_NUMPAD5, 0,  0,  1, hotkey_fn_swap } // macro +1
+	, { 0x4000, VK_NUMPAD8, 0,  0,  0, hotkey_fn_say } // prints the macro
+	, { 0x4000, VK_NUMPAD9, 0,  0,  0, hotkey_fn_cancel }
+};
+
+// NOTE (brian): What the hotkey file can have a hotkey do. 'args' says where each of the numbers
+// after the command go, 'a' for arg1 and 'b' for arg2, and 'n' for a bank, which goes in arg1 if
+// it's a number, and 'bank' if it's a name. A command can be in here more than once, with
+// different numbers of them. 'always' is for the ones that stay on when the rest get toggled off,
+// or there'd be no turning them back on. It's also what command_run runs.
+static struct {
+	char *name;
+	char *args;
+	s32 always;
+	s32 (*func)(struct state_t *state, struct hotkey_t *hotkeys, s32 len, s32 idx);
+} hotkey_cmds[] = {
+	  { "quit", "", 1, hotkey_fn_quit }
+	, { "toggle", "", 1, hotkey_fn_toggle }
+	, { "bank", "a", 0, hotkey_fn_swap }
+	, { "macro", "b", 0, hotkey_fn_swap }
+	, { "say", "", 0, hotkey_fn_say }
+	, { "say", "nb", 0, hotkey_fn_sayat }
+	, { "goto", "n", 0, hotkey_fn_goto }
+	, { "goto", "nb", 0, hotkey_fn_goto }
+	, { "cancel", "", 0, hotkey_fn_cancel }
+};
+
+// NOTE (brian): where the hotkeys' banks' names are kept, so the digits' copies can all share one
+static struct c_arena_t hotkeys_arena;
+
+// NOTE (brian): the names the hotkey file can use for keys, besides letters, digits and f1 - f12,
+// and 'digit', which stands in for every one of the numpad's digits (see hotkeys_load)
+static struct {
+	char *name;
+	u32 vk;
+} hotkey_names[] = {
+	  { "backspace", VK_BACK }, { "tab", VK_TAB }, { "enter", VK_RETURN }, { "pause", VK_PAUSE }
+	, { "escape", VK_ESCAPE }, { "space", VK_SPACE }, { "pageup", VK_PRIOR }, { "pagedown", VK_NEXT }
+	, { "end", VK_END }, { "home", VK_HOME }, { "left", VK_LEFT }, { "up", VK_UP }
+	, { "right", VK_RIGHT }, { "down", VK_DOWN }, { "insert", VK_INSERT }, { "delete", VK_DELETE }
+	, { "numpad0", VK_NUMPAD0 }, { "numpad1", VK_NUMPAD1 }, { "numpad2", VK_NUMPAD2 }
+	, { "numpad3", VK_NUMPAD3 }, { "numpad4", VK_NUMPAD4 }, { "numpad5", VK_NUMPAD5 }
+	, { "numpad6", VK_NUMPAD6 }, { "numpad7", VK_NUMPAD7 }, { "numpad8", VK_NUMPAD8 }
+	, { "numpad9", VK_NUMPAD9 }, { "multiply", VK_MULTIPLY }, { "add", VK_ADD }
+	, { "subtract", VK_SUBTRACT }, { "decimal", VK_DECIMAL }, { "divide", VK_DIVIDE }
+	, { "digit", HOTKEY_DIGIT }
+};
+
+/* send_events : types the say's events, chunked and paced for its profile, returns how many went in */
+u32 send_events(struct say_t *say);
+/* send_release : lets go of every modifier the say might've been holding down */
+void send_release(struct say_t *say);
+/* send_report : prints how sending's gone, for every profile that's been used */
+void send_report();
 
-/* mk_kbdinput : helper function to fill in an INPUT structure for a keyboard */
-void mk_kbdinput(INPUT *input, s16 vk, s16 sk, s32 key_up);
-/* sendkey_single : sends a single key */
-s32 sendkey_single(s32 keycode);
+/* say_start : starts the thread that types says */
+s32 say_start();
+/* say_stop : stops the typing thread, once it's typed everything if 'finish', or throwing it away */
+void say_stop(s32 finish);
+/* say_queue : hands the events (or text, to be pasted) to the typing thread, to be said */
+s32 say_queue(struct profile_t *profile, struct key_t *events, u32 count, char *text, u32 text_len);
+/* say_cancel : stops the say being typed, and throws away any that are waiting */
+void say_cancel();
+/* say_thread : types the queued says, one after another */
+static s32 say_thread(void *arg);
+/* say_send : opens the chat box, and types the say into it */
+void say_send(struct say_t *say);
+/* say_paste : pastes the say's text into the chat box through the clipboard, returns -1 if it couldn't */
+s32 say_paste(struct say_t *say);
 
 int main(int argc, char **argv)
 {
-	struct state_t state;
-	s32 i, rc;
-	MSG msg;
-
-	struct hotkey_t hotkeys[] = {
-		  { 0x4000, VK_NUMPAD0, 1, 1,  0,  0, hotkey_fn_toggle }
-		, { 0x4000, VK_DECIMAL, 1, 1,  0,  0, hotkey_fn_quit }
-		, { 0x4000, VK_NUMPAD1, 0, 0, -1,  0, hotkey_fn_swap } // bank  -1
-		, { 0x4000, VK_NUMPAD2, 0, 0,  1,  0, hotkey_fn_swap } // bank  +1
-		, { 0x4000, VK_NUMPAD4, 0, 0,  0, -1, hotkey_fn_swap } // macro -1
-		, { 0x4000, VK_NUMPAD5, 0, 0,  0,  1, hotkey_fn_swap } // macro +1
-		, { 0x4000, VK_NUMPAD8, 0, 0,  0,  0, hotkey_fn_say } // prints the macro
-	};
+	static char logbuf[LOG_BUFFER];
+	struct state_t *state;
+	struct watch_t watch;
+	struct hotkey_t *hotkeys;
+	struct sys_ipc_t *ipc;
+	char *fname, *packname, *keyname, *ipcname, *logname, *s;
+	char *say[3];
+	s32 i, j, rc, id, compile, bench, stats, named, paste, hooked, hotkeys_len, send;
+	f64 now;
 
-	memset(&msg, 0, sizeof msg);
-	memset(&state, 0, sizeof state);
+	memset(&watch, 0, sizeof watch);
 
-	rc = macros_parse(&state, MACRO_FILE);
-	if (rc < 0) {
-		ERR("Couldn't parse macro file!\n");
-		exit(1);
-	}
+	fname = MACRO_FILE;
+	packname = keyname = logname = NULL;
+	ipcname = IPC_NAME;
+	compile = bench = stats = named = hooked = send = 0;
+	paste = -1;
+	say[0] = NULL;
+	backend = backends[0];
 
-	// turn on all of the hotkeys that are "always on"
-	for (i = 0; i < ARRSIZE(hotkeys); i++) {
-		if (hotkeys[i].on_always) {
-			rc = RegisterHotKey(NULL, i, hotkeys[i].modifiers, hotkeys[i].vk);
-			if (!rc) {
-				ERR("Couldn't Register Hotkey %d :(\n", i);
+	for (i = 1; i < argc; i++) {
+		if (streq(argv[i], "--compile") && i + 1 < argc) {
+			compile = 1;
+			fname = argv[++i];
+		} else if (streq(argv[i], "-o") && i + 1 < argc) {
+			packname = argv[++i];
+		} else if (streq(argv[i], "--bench")) {
+			bench = 1;
+		} else if (streq(argv[i], "--stats")) {
+			stats = 1;
+		} else if (streq(argv[i], "--hook")) {
+			hooked = 1;
+		} else if (streq(argv[i], "--keys") && i + 1 < argc) {
+			keyname = argv[++i];
+		} else if (streq(argv[i], "--say") && i + 2 < argc) {
+			say[0] = "say";
+			say[1] = argv[++i];
+			say[2] = argv[++i];
+		} else if (streq(argv[i], "--ipc") && i + 1 < argc) {
+			ipcname = argv[++i];
+		} else if (streq(argv[i], "--send") && i + 1 < argc) {
+			send = i + 1; // the rest of them are the command
+			break;
+		} else if (streq(argv[i], "--log") && i + 1 < argc) {
+			logname = argv[++i];
+		} else if (streq(argv[i], "--profile") && i + 1 < argc) {
+			for (profile = NULL, j = 0; j < ARRSIZE(profiles); j++) {
+				if (streq(argv[i + 1], profiles[j].name))
+					profile = profiles + j;
+			}
+			if (!profile) {
+				ERR("No profile '%s', there's:", argv[i + 1]);
+				for (j = 0; j < ARRSIZE(profiles); j++)
+					fprintf(stderr, " %s", profiles[j].name);
+				fprintf(stderr, "\n");
+				exit(1);
+			}
+			i++;
+		} else if (streq(argv[i], "--backend") && i + 1 < argc) {
+			s = strchr(argv[++i], ':');
+			if (s)
+				*s++ = 0;
+			backend_opts = s;
+			for (backend = NULL, j = 0; j < ARRSIZE(backends); j++) {
+				if (streq(argv[i], backends[j]->name))
+					backend = backends[j];
+			}
+			if (!backend) {
+				ERR("No backend '%s', there's:", argv[i]);
+				for (j = 0; j < ARRSIZE(backends); j++)
+					fprintf(stderr, " %s", backends[j]->name);
+				fprintf(stderr, "\n");
 				exit(1);
 			}
+		} else if (streq(argv[i], "--paste") && i + 1 < argc) {
+			paste = atoi(argv[++i]);
+		} else {
+			fname = argv[i];
+			named = 1;
 		}
 	}
 
-	while (!state.quit && GetMessage(&msg, NULL, 0, 0) != 0) {
-		switch (msg.message) {
-		case WM_HOTKEY:
-			hotkeys[msg.wParam].func(&state, hotkeys, ARRSIZE(hotkeys), msg.wParam);
-			break;
-		}
-	}
+	if (send)
+		return ipc_send(ipcname, argv + send, argc - send) < 0 ? 1 : 0;
 
-	// turn off all of the hotkeys
-	for (i = 0; i < ARRSIZE(hotkeys); i++) {
-		if (hotkeys[i].on_now) {
-			rc = UnregisterHotKey(NULL, i);
-			if (!rc) {
-				ERR("Couldn't Unregister Hotkey %d :(\n", i);
-				exit(1);
-			}
+	// NOTE (brian): The newline scanner's picked once, here, before there's any thread that could
+	// be scanning (the parse's workers, a reload, see watch_work), and only --bench changes it.
+	nlscan_init(NULL);
+
+	// NOTE (brian): The log file's written out in big pieces, whenever the main loop's got nothing
+	// else to do (see loop_idle), instead of a write for every line, like stderr gets.
+	if (logname) {
+		if (!freopen(logname, "a", stderr)) {
+			printf("Couldn't open the log '%s'\n", logname);
+			exit(1);
 		}
+		setvbuf(stderr, logbuf, _IOFBF, sizeof logbuf);
 	}
 
-	return 0;
-}
+	if (paste >= 0)
+		profile->paste = paste;
 
-/* hotkey_fn_toggle : toggles the availabliliy of the other hotkeys */
-s32 hotkey_fn_toggle(struct state_t *state, struct hotkey_t *hotkeys, s32 len, s32 idx)
-{
-	s32 i, rc;
+	if (compile && !packname) {
+		ERR("USAGE: %s --compile <macrofile> -o <packfile>\n", argv[0]);
+		exit(1);
+	}
 
-	// NOTE (brian): toggle all of the hotkeys that aren't supposed to be kept on
+	// NOTE (brian): Compiling needs the keyboard layout, so even --compile, --stats and --bench
+	// have to have a backend, to ask for it.
+	if (backend->open(backend_opts) < 0) {
+		ERR("Couldn't open the %s backend\n", backend->name);
+		exit(1);
+	}
 
-	for (i = 0; i < len; i++) {
-		if (i == idx)
-			continue;
+	if (bench) {
+		rc = bench_parse(named ? fname : NULL, BENCH_MB);
+		backend->close();
+		return rc < 0 ? 1 : 0;
+	}
 
-		if (hotkeys[i].on_always)
-			continue;
+	if (profile->paste && !backend->clip_swap)
+		WRN("The %s backend can't paste, macros will be typed\n", backend->name);
 
-		if (!hotkeys[i].on_now) {
-			rc = RegisterHotKey(NULL, i, hotkeys[i].modifiers, hotkeys[i].vk);
-		} else {
-			rc = UnregisterHotKey(NULL, i);
-		}
+	state = calloc(1, sizeof(*state));
+	if (!state) {
+		ERR("Couldn't allocate state!\n");
+		exit(1);
+	}
 
-		hotkeys[i].on_now = !hotkeys[i].on_now;
+	rc = macros_load(state, fname, NULL);
+	if (rc < 0) {
+		ERR("Couldn't parse macro file!\n");
+		exit(1);
+	}
 
-		if (!rc) {
-			sys_lasterror();
-			ERR("Couldn't Toggle Hotkey %d :(\n", i);
+	if (stats) {
+		rc = stats_dump(state);
+		macros_free(state);
+		free(state);
+		backend->close();
+		return rc < 0 ? 1 : 0;
+	}
+
+	if (compile) {
+		rc = macros_loadall(state);
+		if (rc == 0)
+			rc = pack_write(state, packname);
+		if (rc < 0) {
+			ERR("Couldn't write pack '%s'\n", packname);
 		}
+		macros_free(state);
+		free(state);
+		backend->close();
+		return rc < 0 ? 1 : 0;
 	}
 
-	return 0;
-}
+	// NOTE (brian): --say types the one macro and quits, once it's all gone out. It still leaves
+	// the bank in the cache, so doing it again doesn't have to parse anything.
+	if (say[0]) {
+		rc = say_start();
+		if (rc == 0)
+			rc = command_run(state, say, ARRSIZE(say));
+		say_stop(1);
+		send_report();
+		backend->close();
 
-/* hotkey_fn_quit : toggles the availabliliy of the other hotkeys */
-s32 hotkey_fn_quit(struct state_t *state, struct hotkey_t *hotkeys, s32 len, s32 idx)
-{
-	state->quit = 1;
-	return 0;
-}
+		if (cache_write(state, fname) == 0 && cache_commit(fname) < 0)
+			WRN("Couldn't update the cache for '%s'\n", fname);
 
-/* hotkey_fn_swap : swaps between banks */
-s32 hotkey_fn_swap(struct state_t *state, struct hotkey_t *hotkeys, s32 len, s32 idx)
-{
-	s32 b, m;
-	struct bank_t *lbank;
+		macros_free(state);
+		free(state);
+		return rc < 0 ? 1 : 0;
+	}
 
-	b = hotkeys[idx].arg1;
-	m = hotkeys[idx].arg2;
+	hotkeys = hotkeys_load(keyname, &hotkeys_len);
+	if (!hotkeys) {
+		ERR("Couldn't load the hotkeys\n");
+		exit(1);
+	}
 
-	// We attempt to apply both motions. Unless the values in the array are not quite what we
-	// expect, we'll end up adding zero and whatnot.
-	//
-	// At the very least, this gives the "swapping" function a very constant time.
+	// if these don't work out, we just don't get to reload, or take commands
+	if (watch_start(&watch, fname) < 0) {
+		WRN("Couldn't watch '%s' for changes\n", fname);
+	}
 
-	// Handle the Bank Swap First
-	state->curr += b;
-	if (state->curr < 0) {
-		state->curr = state->banks_len - 1;
+	ipc = sys_ipc(ipcname);
+	if (ipc && sys_loop_ipc(ipc, LOOP_IPC) < 0) {
+		sys_ipc_free(ipc);
+		ipc = NULL;
 	}
-	if (state->banks_len <= state->curr) {
-		state->curr = 0;
+	if (!ipc) {
+		WRN("Couldn't listen for commands at '%s'\n", ipcname);
 	}
 
-	// Then the Macro Clamping
-	lbank = state->banks + state->curr;
-	lbank->curr += m;
-	if (lbank->curr < 0) {
-		lbank->curr = lbank->lines_len - 1;
+	if (say_start() < 0) {
+		ERR("Couldn't start the typing thread\n");
+		exit(1);
 	}
-	if (lbank->lines_len <= lbank->curr) {
-		lbank->curr = 0;
+
+	if (hooked && !backend->hook) {
+		WRN("The %s backend can't hook the keyboard, the hotkeys get bound instead\n", backend->name);
+		hooked = 0;
 	}
 
-	return 0;
-}
+	if (hooked) {
+		if (backend->hook(hook_filter) < 0) {
+			ERR("Couldn't hook the keyboard\n");
+			exit(1);
+		}
+		keytab.hooked = 1;
+	}
 
-/* hotkey_fn_say : says the selected macro */
-s32 hotkey_fn_say(struct state_t *state, struct hotkey_t *hotkeys, s32 len, s32 idx)
-{
-	INPUT *inputs;
-	size_t inputs_len, inputs_cap;
-	char *s;
-	s32 i, slen;
-	u16 scan;
-	s8 vk, sk;
-	u32 rc;
+	// turn on all of the hotkeys that are "always on"
+	if (!hooked && keyseq_bind(0) < 0)
+		exit(1);
 
-	// NOTE (brian): We literally just send every possible keystroke into the
-	// keyboard input queue. Because of the way the KEYBDINPUT function works
-	// we need to
+	// NOTE (brian): The main loop. Everything that happens, happens here, on this thread, and
+	// besides the typing thread (and the hook's, on Windows), there's no other. What it waits on is
+	// all in the one wait (see sys_loop_wait), and the only timeouts it has are for things that
+	// are actually waiting on time (loop_idle), so when nothing's happening, it's asleep.
 	//
-	// https://docs.microsoft.com/en-us/windows/win32/api/winuser/ns-winuser-input
-	// https://docs.microsoft.com/en-us/windows/win32/api/winuser/ns-winuser-keybdinput
+	// Without --hook, what's bound are keys, and the hotkeys they're part of get worked out here,
+	// and a hotkey that's only partly pressed gets given up on when it times out. With it, the
+	// filter's already done all that, and what comes in is the hotkey.
 
-	s = state->banks[state->curr].lines[state->banks[state->curr].curr];
-	slen = strlen(s);
+	while (!state->quit && (rc = backend->next(&id, loop_idle(&watch, hooked))) != SYS_QUIT) {
+		switch (rc) {
+		case SYS_HOTKEY:
+			if (!hooked) {
+				id = keyseq_step(id, 0, sys_time());
+				keyseq_bind(0);
+			}
+			if (0 <= id)
+				hotkeys[id].func(state, hotkeys, hotkeys_len, id);
+			break;
 
-	inputs = NULL;
-	inputs_len = inputs_cap = 0;
+		case SYS_TIMEOUT:
+			now = sys_time();
+			if (!hooked && keyseq.state && keyseq.until <= now) {
+				keyseq.state = 0;
+				keyseq_bind(0);
+			}
+			if (watch.settle && watch.settle <= now)
+				watch_reload(&watch, state);
+			break;
 
-#if 1
-	sendkey_single('T');
-	// sendkey_single('Y');
-#else
-	sendkey_single(VK_RETURN);
-#endif
+		case SYS_READY:
+			if (id == LOOP_WATCH)
+				watch_changed(&watch);
+			if (id == LOOP_RELOAD)
+				state = watch_adopt(&watch, state);
+			if (id == LOOP_IPC)
+				ipc_read(ipc, state);
+			break;
 
-	// this 50 ms wait time lets chat boxes open and shit
-	Sleep(50);
+		case SYS_SAID:
+			// nothing to do but flush the log, on the way back around
+			break;
+		}
+	}
 
-	// TODO (brian): configurable way to change what this key is
-	C_RESIZE(&inputs);
+	sys_ipc_free(ipc);
+	watch_stop(&watch);
 
-	// We add an event for the KEYDOWN and KEYUP.
-	for (i = 0; i < slen; i++) {
-		// convert our ascii character into a virtual scancode
-		// NOTE (brian): i'm not entirely certain that the scancode part of this
-		// result is useful to us. There's some more research to be done there.
-		// I suppose it's the same in the mk_kbdinput function.
-		scan = VkKeyScanA(s[i]);
-		vk = scan;
-		sk = scan >> 8;
+	// the profiles' counts are only safe to read once the typing thread's gone
+	say_stop(0);
 
-		// This conversion function is also somewhat in-flux.
+	send_report();
 
-		if (sk & 0x01) { // if shift _should_ be pushed
-			C_RESIZE(&inputs);
-			mk_kbdinput(inputs + inputs_len, VK_LSHIFT, 0, 0);
-			inputs_len++;
-		}
+	// turn off all of the hotkeys, a hook comes off with the backend
+	if (!hooked && keyseq_bind(1) < 0)
+		exit(1);
 
-		// down
-		C_RESIZE(&inputs);
-		mk_kbdinput(inputs + inputs_len, vk, 0, 0);
-		inputs_len++;
+	backend->close();
 
-		// up
-		C_RESIZE(&inputs);
-		mk_kbdinput(inputs + inputs_len, vk, 0, 1);
-		inputs_len++;
+	keyseq_free();
+	hotkeys_free(hotkeys);
 
-		if (sk & 0x01) { // if shift _should_ be pushed
-			C_RESIZE(&inputs);
-			mk_kbdinput(inputs + inputs_len, VK_LSHIFT, 0, 1);
-			inputs_len++;
-		}
-	}
+	// the cache can't be replaced while it's still mapped, so it goes in after the state's gone
+	rc = cache_write(state, fname);
 
-	// add in an "ENTER" push
-	mk_kbdinput(inputs + inputs_len, VK_RETURN, sk, 0);
-	inputs_len++;
-	C_RESIZE(&inputs);
+	macros_free(state);
+	free(state);
 
-	rc = SendInput(inputs_len, inputs, sizeof(INPUT));
-	if (rc != inputs_len) {
-		ERR("Only put %d items on the keyboard queue\n", rc);
+	if (rc == 0 && cache_commit(fname) < 0) {
+		WRN("Couldn't update the cache for '%s'\n", fname);
 	}
 
-	free(inputs);
-
 	return 0;
 }
 
-/* sendkey_single : sends a single key */
-s32 sendkey_single(s32 keycode)
+/* hotkey_fn_toggle : toggles the availabliliy of the other hotkeys */
+s32 hotkey_fn_toggle(struct state_t *state, struct hotkey_t *hotkeys, s32 len, s32 idx)
 {
-	INPUT input;
-	mk_kbdinput(&input, keycode, 0, 0);
-	SendInput(1, &input, sizeof(INPUT));
+	// NOTE (brian): toggle all of the hotkeys that aren't supposed to be kept on, which is just
+	// switching which of keyseq's tables is used, and binding the keys that leaves to go anywhere
+
+	__atomic_xor_fetch(&keytab.on, 1, __ATOMIC_ACQ_REL);
+
+	if (!keytab.hooked)
+		return keyseq_bind(0);
+
 	return 0;
 }
 
-/* macros_parse : parse macros from the input file to the state */
-s32 macros_parse(struct state_t *state, char *fname)
+/* hotkeys_load : reads the hotkey file into a new array, and builds keyseq, returns NULL if it couldn't */
+struct hotkey_t *hotkeys_load(char *fname, s32 *len)
 {
+	struct hotkey_t *hotkeys, *hotkey;
 	FILE *fp;
-	struct bank_t *lbank;
-	char *s;
 	char buf[BUFLARGE];
+	char *s, *keys, *cmd, *arg, *end, *bank;
+	u32 mods[HOTKEY_SEQ], vks[HOTKEY_SEQ];
+	s32 nums[2], widths[2];
+	s32 line, cap, args, stars, digits, count, keys_len, n, d, v, i, j, k;
 
-	// NOTE (brian):
-	//
-	// The macro file format is as follows:
-	//
-	// Example:
-	//
-	// BankFoo
-	//     You're trash.
-	//     I'd say you were cancer, but cancer wins sometimes.
-	//
-	// BankBar
-	//     glhf
-	//     Good Luck Having Fun
-	//
-	// That gets parsed into two banks, with two macros a piece
+	// NOTE (brian): without a file named, HOTKEY_FILE is used if it's there, and if it isn't,
+	// the defaults are
 
-	memset(state, 0, sizeof(*state));
+	fp = fopen(fname ? fname : HOTKEY_FILE, "r");
+	if (!fp && fname) {
+		ERR("Couldn't open the hotkey file '%s'\n", fname);
+		return NULL;
+	}
 
-	fp = fopen(fname, "r");
-	if (!fp)
-		return -1;
+	if (!fp) {
+		hotkeys = malloc(sizeof hotkeys_default);
+		if (!hotkeys)
+			return NULL;
+		memcpy(hotkeys, hotkeys_default, sizeof hotkeys_default);
+		*len = ARRSIZE(hotkeys_default);
+		if (keyseq_build(hotkeys, *len, "defaults") < 0) {
+			free(hotkeys);
+			return NULL;
+		}
+		return hotkeys;
+	}
+
+	fname = fname ? fname : HOTKEY_FILE;
+
+	hotkeys = NULL;
+	*len = cap = 0;
+
+	for (line = 1; fgets(buf, sizeof buf, fp); line++) {
+		s = strchr(buf, '#');
+		if (s)
+			*s = 0;
+
+		keys = strtok(buf, " \t\r\n");
+		if (!keys)
+			continue;
+
+		cmd = strtok(NULL, " \t\r\n");
+		if (!cmd) {
+			ERR("%s:%d : '%s' isn't bound to anything\n", fname, line, keys);
+			goto fail;
+		}
+
+		// the keys are pressed one after another, "numpad7,numpad3,numpad2"
+		for (keys_len = digits = 0, s = keys; s; keys_len++, s = end) {
+			end = strchr(s, ',');
+			if (end)
+				*end++ = 0;
+
+			if (keys_len == HOTKEY_SEQ) {
+				ERR("%s:%d : a hotkey can only be %d keys long\n", fname, line, HOTKEY_SEQ);
+				goto fail;
+			}
+
+			if (hotkeys_key(s, mods + keys_len, vks + keys_len) < 0) {
+				ERR("%s:%d : '%s' isn't a key\n", fname, line, s);
+				goto fail;
+			}
+
+			digits += vks[keys_len] == HOTKEY_DIGIT;
+		}
+
+		// an argument's either a number, or a '*' for each digit it takes, in the order they're
+		// typed, and the first can be a bank's name
+		nums[0] = nums[1] = widths[0] = widths[1] = 0;
+		bank = NULL;
+		for (args = stars = 0, arg = strtok(NULL, " \t\r\n"); arg; args++, arg = strtok(NULL, " \t\r\n")) {
+			if (args < 2) {
+				widths[args] = strspn(arg, "*");
+				nums[args] = strtol(arg, &end, 10);
+			}
+			if (args == 0 && !widths[0] && *end != 0) {
+				bank = arg;
+			} else if (args == 2 || (widths[args] ? arg[widths[args]] != 0 : *end != 0)) {
+				ERR("%s:%d : '%s' isn't an argument '%s' takes\n", fname, line, arg, cmd);
+				goto fail;
+			}
+			stars += widths[args];
+		}
+
+		i = hotkeys_cmd(cmd, args);
+		if (i < 0) {
+			ERR("%s:%d : there's no '%s' with %d arguments\n", fname, line, cmd, args);
+			goto fail;
+		}
+
+		if (bank && hotkey_cmds[i].args[0] != 'n') {
+			ERR("%s:%d : '%s' isn't an argument '%s' takes\n", fname, line, bank, cmd);
+			goto fail;
+		}
+
+		if (bank && !(bank = c_arena_strdup(&hotkeys_arena, bank))) {
+			ERR("Couldn't allocate the hotkeys\n");
+			goto fail;
+		}
+
+		if (HOTKEY_DIGITS < digits || stars != digits) {
+			ERR("%s:%d : the keys have %d digits, and the arguments take %d (at most %d)\n",
+				fname, line, digits, stars, HOTKEY_DIGITS);
+			goto fail;
+		}
+
+		// a macro counts from 1, and a 0 would be "the bank's current one" to say_macro
+		if (!strcmp(hotkey_cmds[i].args, "nb") && !widths[1] && nums[1] < 1) {
+			ERR("%s:%d : there's no macro %d, they count from 1\n", fname, line, nums[1]);
+			goto fail;
+		}
+
+		// NOTE (brian): A line with digits is a hotkey for each of the digits there could be, so
+		// "numpad7,digit,digit say * *" is ninety of them (there's no macro 0), and numpad7 then
+		// numpad3 then numpad2 is the one that says bank 3's second macro. It's keyseq_build's DFA
+		// that keeps that to one transition a key.
+
+		for (count = 1, j = 0; j < digits; j++)
+			count *= 10;
+
+		for (v = 0; v < count; v++) {
+			if (*len == cap) {
+				cap = cap ? cap * 2 : 32;
+				hotkey = realloc(hotkeys, cap * sizeof(*hotkeys));
+				if (!hotkey) {
+					ERR("Couldn't allocate the hotkeys\n");
+					goto fail;
+				}
+				hotkeys = hotkey;
+			}
+
+			hotkey = hotkeys + (*len)++;
+			memset(hotkey, 0, sizeof(*hotkey));
+
+			// the digits of 'v' go into the keys, most significant first
+			for (j = 0, d = count; j < keys_len; j++) {
+				n = vks[j];
+				if (n == HOTKEY_DIGIT) {
+					d /= 10;
+					n = VK_NUMPAD0 + v / d % 10;
+				}
+
+				if (j == 0) {
+					hotkey->modifiers = mods[j];
+					hotkey->vk = n;
+				} else {
+					hotkey->seq[j - 1] = HOTKEY_KEY(mods[j], n);
+				}
+			}
+
+			hotkey->seq_len = keys_len - 1;
+
+			// and then the same digits go into the arguments, in the same order
+			for (j = 0, d = count; j < args; j++) {
+				if (!widths[j])
+					continue;
+				for (n = 1, k = 0; k < widths[j]; k++)
+					n *= 10;
+				d /= n;
+				nums[j] = v / d % n;
+			}
+
+			// and a macro digit of 0 isn't a macro, so that one isn't a hotkey
+			if (!strcmp(hotkey_cmds[i].args, "nb") && nums[1] < 1) {
+				(*len)--;
+				continue;
+			}
+
+			hotkey->arg1 = nums[0];
+			hotkey->arg2 = nums[1];
+
+			// everything was read into arg1 then arg2, and the command says which they really are
+			if (hotkey_cmds[i].args[0] == 'b') {
+				hotkey->arg2 = hotkey->arg1;
+				hotkey->arg1 = 0;
+			}
+
+			hotkey->func = hotkey_cmds[i].func;
+			hotkey->on_always = hotkey_cmds[i].always;
+			hotkey->bank = bank;
+			hotkey->line = line;
+		}
+	}
+
+	// with nothing that's always on, there'd be no turning the rest on
+	for (i = j = 0; i < *len; i++)
+		j += hotkeys[i].on_always;
+	if (*len && !j)
+		WRN("Nothing in '%s' is a quit or a toggle, the hotkeys can never be turned on\n", fname);
+
+	fclose(fp);
+
+	if (!hotkeys)
+		hotkeys = calloc(1, sizeof(*hotkeys));
+
+	if (!hotkeys || keyseq_build(hotkeys, *len, fname) < 0) {
+		hotkeys_free(hotkeys);
+		return NULL;
+	}
+
+	return hotkeys;
+
+fail:
+	hotkeys_free(hotkeys);
+	fclose(fp);
+
+	return NULL;
+}
+
+/* hotkeys_free : frees the hotkeys, and their banks' names */
+void hotkeys_free(struct hotkey_t *hotkeys)
+{
+	c_arena_free(&hotkeys_arena);
+	free(hotkeys);
+}
+
+/* hotkeys_cmd : returns the hotkey_cmds entry with that name, that takes that many arguments, or -1 */
+s32 hotkeys_cmd(char *name, s32 args)
+{
+	s32 i;
+
+	for (i = 0; i < ARRSIZE(hotkey_cmds); i++) {
+		if (streq(name, hotkey_cmds[i].name) && strlen(hotkey_cmds[i].args) == args)
+			return i;
+	}
+
+	return -1;
+}
+
+/* hotkeys_key : parses keys like "ctrl+shift+f1", returns -1 if it can't */
+s32 hotkeys_key(char *s, u32 *mods, u32 *vk)
+{
+	char name[BUFSMALL];
+	char *end;
+	size_t len;
+	s32 i;
+
+	// NOTE (brian): Every hotkey's MOD_NOREPEAT, unless it says "repeat", so holding one down
+	// doesn't do it over and over. The last part's the key, everything before it's a modifier.
+
+	*mods = MOD_NOREPEAT;
+	*vk = 0;
+
+	for (;;) {
+		for (len = 0; s[len] && s[len] != '+' && len < sizeof(name) - 1; len++)
+			name[len] = tolower(s[len]);
+		name[len] = 0;
+
+		if (!len)
+			return -1;
+
+		if (s[len] != '+')
+			break;
+
+		if (streq(name, "ctrl") || streq(name, "control")) {
+			*mods |= MOD_CONTROL;
+		} else if (streq(name, "alt")) {
+			*mods |= MOD_ALT;
+		} else if (streq(name, "shift")) {
+			*mods |= MOD_SHIFT;
+		} else if (streq(name, "win")) {
+			*mods |= MOD_WIN;
+		} else if (streq(name, "repeat")) {
+			*mods &= ~MOD_NOREPEAT;
+		} else {
+			return -1;
+		}
+
+		s += len + 1;
+	}
+
+	if (s[len])
+		return -1;
+
+	if (len == 1 && (isalpha(name[0]) || isdigit(name[0]))) {
+		*vk = toupper(name[0]);
+	} else if (name[0] == 'f' && isdigit(name[1]) && 1 <= atoi(name + 1) && atoi(name + 1) <= 12) {
+		*vk = VK_F1 + atoi(name + 1) - 1;
+	} else if (name[0] == '0' && name[1] == 'x') {
+		*vk = strtoul(name, &end, 16);
+		if (*end || !*vk || 0xff < *vk)
+			return -1;
+	} else {
+		for (i = 0; i < ARRSIZE(hotkey_names) && !streq(name, hotkey_names[i].name); i++)
+			;
+		if (i == ARRSIZE(hotkey_names))
+			return -1;
+		*vk = hotkey_names[i].vk;
+	}
+
+	return 0;
+}
+
+/* keyseq_build : builds keytab and the DFA for the hotkeys, returns -1 if they clash */
+s32 keyseq_build(struct hotkey_t *hotkeys, s32 len, char *fname)
+{
+	struct hotkey_key_t *key;
+	u16 seq[HOTKEY_SEQ];
+	s16 *index;
+	s32 *owner, *next, *grown;
+	s8 *always;
+	s32 keys_len, cap, i, j, k, n, s, t;
+
+	// NOTE (brian): The hotkeys' keys go into a trie, which is already a DFA, since every key
+	// only goes one place. A hotkey that's the start of another one clashes with it, there'd be no
+	// telling whether to go off or wait for the rest, so each key's either on the way to more keys,
+	// or it's the end of a hotkey. 'owner' is a hotkey each state's on the way to, for saying which.
+
+	keyseq_free();
+
+	keyseq.hotkeys = hotkeys;
+
+	index = calloc(HOTKEY_KEYS, sizeof(*index));
+	key = calloc(HOTKEY_KEYS, sizeof(*key));
+	if (!index || !key) {
+		ERR("Couldn't allocate the hotkey table\n");
+		free(index), free(key);
+		return -1;
+	}
+
+	// every key any of the hotkeys use, in the order they're first used
+	for (i = keys_len = 0; i < len; i++) {
+		seq[0] = HOTKEY_KEY(hotkeys[i].modifiers, hotkeys[i].vk);
+		memcpy(seq + 1, hotkeys[i].seq, hotkeys[i].seq_len * sizeof(*seq));
+		n = 1 + hotkeys[i].seq_len;
+
+		for (j = 0; j < n; j++) {
+			if (index[seq[j]])
+				continue;
+			index[seq[j]] = ++keys_len;
+			key[keys_len - 1].modifiers = ((seq[j] >> 8) & 0x0f) | MOD_NOREPEAT;
+			key[keys_len - 1].vk = seq[j] & 0xff;
+		}
+
+		// a hotkey that's just the one key, that repeats, has its key bound like it does
+		if (n == 1 && !(hotkeys[i].modifiers & MOD_NOREPEAT))
+			key[index[seq[0]] - 1].modifiers &= ~MOD_NOREPEAT;
+	}
+
+	if (keytab_build(key, keys_len) < 0) {
+		free(index);
+		keyseq_free();
+		return -1;
+	}
+
+	cap = 16;
+	keyseq.states = 1;
+	next = calloc(cap * keys_len + 1, sizeof(*next));
+	owner = calloc(cap, sizeof(*owner));
+
+	for (i = 0; next && owner && i < len; i++) {
+		seq[0] = HOTKEY_KEY(hotkeys[i].modifiers, hotkeys[i].vk);
+		memcpy(seq + 1, hotkeys[i].seq, hotkeys[i].seq_len * sizeof(*seq));
+		n = 1 + hotkeys[i].seq_len;
+
+		for (s = j = 0; j < n; j++, s = t) {
+			k = index[seq[j]] - 1;
+			t = next[s * keys_len + k];
+
+			if (t < 0 && j == n - 1) {
+				ERR("%s:%d : the keys are already bound, on line %d\n", fname, hotkeys[i].line,
+					hotkeys[KEYSEQ_HOTKEY(t)].line);
+				goto fail;
+			}
+
+			if (t < 0 || (0 < t && j == n - 1)) {
+				ERR("%s:%d : the keys clash with line %d's, one's the start of the other\n", fname,
+					hotkeys[i].line, t < 0 ? hotkeys[KEYSEQ_HOTKEY(t)].line : hotkeys[owner[t]].line);
+				goto fail;
+			}
+
+			if (j == n - 1) {
+				next[s * keys_len + k] = KEYSEQ_HOTKEY(i);
+				break;
+			}
+
+			if (t)
+				continue;
+
+			if (keyseq.states == cap) {
+				cap *= 2;
+				grown = realloc(next, cap * keys_len * sizeof(*next) + sizeof(*next));
+				if (!grown)
+					break;
+				next = grown;
+				memset(next + keyseq.states * keys_len, 0, (cap - keyseq.states) * keys_len * sizeof(*next));
+				grown = realloc(owner, cap * sizeof(*owner));
+				if (!grown)
+					break;
+				owner = grown;
+			}
+
+			t = keyseq.states++;
+			owner[t] = i;
+			next[s * keys_len + k] = t;
+		}
+
+		if (j < n - 1)
+			break;
+	}
+
+	keyseq.next[1] = next;
+	keyseq.next[0] = calloc(keyseq.states * keys_len + 1, sizeof(*next));
+	always = calloc(keyseq.states, sizeof(*always));
+
+	if (!next || !owner || i < len || !keyseq.next[0] || !always) {
+		ERR("Couldn't allocate the hotkey table\n");
+		free(always);
+		goto fail;
+	}
+
+	// NOTE (brian): The table for when the hotkeys are toggled off is the same, but with only the
+	// ways to the hotkeys that are always on. A state's always after the one that leads to it, so
+	// going backwards, whether a state leads anywhere that's always on is already known.
+
+	for (s = keyseq.states - 1; 0 <= s; s--) {
+		for (k = 0; k < keys_len; k++) {
+			t = next[s * keys_len + k];
+			if (0 < t ? always[t] : t < 0 && hotkeys[KEYSEQ_HOTKEY(t)].on_always) {
+				keyseq.next[0][s * keys_len + k] = t;
+				always[s] = 1;
+			}
+		}
+	}
+
+	free(always);
+	free(owner);
+	free(index);
+
+	keyseq.state = 0;
+	keyseq.held = -1;
+
+	return 0;
+
+fail:
+	keyseq.next[1] = next;
+	keyseq_free();
+	free(owner);
+	free(index);
+
+	return -1;
+}
+
+/* keyseq_free : frees the DFA and keytab */
+void keyseq_free()
+{
+	keytab_free();
+	free(keytab.keys);
+	free(keyseq.next[0]);
+	free(keyseq.next[1]);
+	keytab.keys = NULL;
+	keytab.len = 0;
+	keyseq.next[0] = keyseq.next[1] = NULL;
+	keyseq.states = 0;
+}
+
+/* keyseq_step : takes the key through the DFA, returns a hotkey, HOOK_PASS or HOOK_EAT (see hook_func) */
+s32 keyseq_step(s32 key, s32 repeat, f64 now)
+{
+	s32 *next;
+	s32 t, i;
+
+	if (!keyseq.states)
+		return HOOK_PASS;
+
+	// anything else being typed is the end of whatever hotkey was being pressed
+	if (key < 0) {
+		keyseq.state = 0;
+		keyseq.held = -1;
+		return HOOK_PASS;
+	}
+
+	// NOTE (brian): A key that's held down only goes off again if it's a hotkey all by itself,
+	// that repeats. Otherwise, its repeats get eaten, so holding it doesn't walk through anything.
+	if (repeat)
+		return key == keyseq.held ? keyseq.repeat : HOOK_PASS;
+
+	next = keyseq.next[__atomic_load_n(&keytab.on, __ATOMIC_ACQUIRE) != 0];
+
+	if (keyseq.state && keyseq.until <= now)
+		keyseq.state = 0;
+
+	t = next[keyseq.state * keytab.len + key];
+
+	// a key that doesn't go on from here might still be the start of something else
+	if (!t && keyseq.state) {
+		keyseq.state = 0;
+		t = next[key];
+	}
+
+	keyseq.held = t ? key : -1;
+
+	if (!t)
+		return HOOK_PASS;
+
+	if (0 < t) {
+		keyseq.state = t;
+		keyseq.until = now + KEYSEQ_TIMEOUT_MS / 1000.0;
+		keyseq.repeat = HOOK_EAT;
+		return HOOK_EAT;
+	}
+
+	i = KEYSEQ_HOTKEY(t);
+
+	keyseq.repeat = !keyseq.state && !(keyseq.hotkeys[i].modifiers & MOD_NOREPEAT) ? i : HOOK_EAT;
+	keyseq.state = 0;
+
+	return i;
+}
+
+/* keyseq_bind : binds the keys that go somewhere from here, and unbinds the rest, or all if 'off' */
+s32 keyseq_bind(s32 off)
+{
+	struct hotkey_key_t *key;
+	s32 *next;
+	s32 want, rc, k;
+
+	// NOTE (brian): Without --hook, the OS only hands us the keys we've bound, and a bound key
+	// doesn't get to anyone else. So what's bound is the keys that start a hotkey, and the ones
+	// that go on from where we're at, and a key like numpad3 in "numpad7,numpad3" is only taken
+	// while numpad7's been pressed.
+
+	next = keyseq.next[__atomic_load_n(&keytab.on, __ATOMIC_ACQUIRE) != 0];
+
+	for (rc = k = 0; k < keytab.len; k++) {
+		key = keytab.keys + k;
+
+		want = !off && (next[k] || next[keyseq.state * keytab.len + k]);
+		if (want == key->bound)
+			continue;
+
+		if (backend->bind(k, key->modifiers, key->vk, want) < 0) {
+			ERR("Couldn't %s Hotkey %d :(\n", want ? "Register" : "Unregister", k);
+			rc = -1;
+			continue;
+		}
+
+		key->bound = want;
+	}
+
+	return rc;
+}
+
+/* keytab_build : builds the perfect hash of the keys, returns -1 if it couldn't */
+s32 keytab_build(struct hotkey_key_t *keys, s32 len)
+{
+	s32 *buckets, *order, *members, *start;
+	u32 key, seed, slot, b, i, j, k, n, size, most;
+
+	// NOTE (brian): Hash and displace. There's twice as many slots as keys, and a bucket for
+	// every two of them. The buckets get their seeds biggest first, while there's the most room,
+	// and each one's seed is just the first that puts all of its keys in empty slots. The keys
+	// have to all be different (keyseq_build makes sure), or there's no seed that'd work.
+
+	keytab_free();
+
+	keytab.keys = keys;
+	keytab.len = len;
+
+	for (keytab.slots_bits = 4; (1u << keytab.slots_bits) < 2 * (u32)len; keytab.slots_bits++)
+		;
+	for (keytab.seeds_bits = 1; (1u << keytab.seeds_bits) < (u32)len / 2; keytab.seeds_bits++)
+		;
+
+again:
+	keytab.seeds = calloc(1u << keytab.seeds_bits, sizeof(*keytab.seeds));
+	keytab.slots = malloc((1u << keytab.slots_bits) * sizeof(*keytab.slots));
+	buckets = calloc(len + 1, sizeof(*buckets));
+	members = calloc(len + 1, sizeof(*members));
+	start = calloc((1u << keytab.seeds_bits) + 1, sizeof(*start));
+	order = calloc((1u << keytab.seeds_bits) + 1, sizeof(*order));
+
+	if (!keytab.seeds || !keytab.slots || !buckets || !members || !start || !order) {
+		ERR("Couldn't allocate the hotkey table\n");
+		free(buckets), free(members), free(start), free(order);
+		keytab_free();
+		return -1;
+	}
+
+	for (i = 0; i < (1u << keytab.slots_bits); i++)
+		keytab.slots[i] = -1;
+
+	// which bucket each key's in, and each bucket's keys, all together in 'members'
+	for (i = 0; i < len; i++) {
+		key = HOTKEY_KEY(keys[i].modifiers, keys[i].vk);
+		buckets[i] = keytab_hash(key, 0) >> (32 - keytab.seeds_bits);
+		start[buckets[i] + 1]++;
+	}
+
+	for (b = 0, most = 0; b < (1u << keytab.seeds_bits); b++) {
+		most = most < start[b + 1] ? start[b + 1] : most;
+		start[b + 1] += start[b];
+	}
+
+	for (i = 0; i < len; i++)
+		members[start[buckets[i]] + order[buckets[i]]++] = i;
+
+	// the buckets, biggest first
+	for (size = most, n = 0; 0 < size; size--) {
+		for (b = 0; b < (1u << keytab.seeds_bits); b++) {
+			if (start[b + 1] - start[b] == size)
+				order[n++] = b;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		b = order[i];
+
+		for (seed = 0; seed < 0xffff; seed++) {
+			for (j = start[b]; j < start[b + 1]; j++) {
+				k = members[j];
+				slot = keytab_hash(HOTKEY_KEY(keys[k].modifiers, keys[k].vk), seed + 1);
+				slot &= (1u << keytab.slots_bits) - 1;
+				if (keytab.slots[slot] >= 0)
+					break;
+				keytab.slots[slot] = k;
+			}
+
+			if (j == start[b + 1])
+				break;
+
+			// take back the ones that did fit, and try the next seed
+			for (k = start[b]; k < j; k++) {
+				slot = keytab_hash(HOTKEY_KEY(keys[members[k]].modifiers, keys[members[k]].vk), seed + 1);
+				keytab.slots[slot & ((1u << keytab.slots_bits) - 1)] = -1;
+			}
+		}
+
+		keytab.seeds[b] = seed;
+
+		if (seed == 0xffff)
+			break;
+	}
+
+	free(buckets), free(members), free(start), free(order);
+
+	// it never comes to this, but with more room, it'd work
+	if (i < n) {
+		free(keytab.seeds), free(keytab.slots);
+		keytab.slots_bits++;
+		goto again;
+	}
+
+	return 0;
+}
+
+/* keytab_free : frees the hash */
+void keytab_free()
+{
+	free(keytab.seeds);
+	free(keytab.slots);
+	keytab.seeds = NULL;
+	keytab.slots = NULL;
+}
+
+/* keytab_find : returns the index of the key, -1 if it isn't one of the hotkeys' */
+s32 keytab_find(u32 mods, u32 vk)
+{
+	struct hotkey_key_t *found;
+	u32 key, b, slot;
+	s32 i;
+
+	if (!keytab.slots)
+		return -1;
+
+	key = HOTKEY_KEY(mods, vk);
+
+	b = keytab_hash(key, 0) >> (32 - keytab.seeds_bits);
+	slot = keytab_hash(key, keytab.seeds[b] + 1) & ((1u << keytab.slots_bits) - 1);
+
+	// keys that aren't the hotkeys' land somewhere too, so it has to be checked
+	i = keytab.slots[slot];
+	if (i < 0)
+		return -1;
+
+	found = keytab.keys + i;
+
+	return HOTKEY_KEY(found->modifiers, found->vk) == key ? i : -1;
+}
+
+/* keytab_hash : mixes the key and the seed together (murmur3's finalizer) */
+static u32 keytab_hash(u32 key, u32 seed)
+{
+	u32 h;
+
+	h = key ^ (seed * 0x9e3779b9);
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+
+	return h;
+}
+
+/* hook_filter : says which hotkey the key is, if any (see hook_func) */
+static s32 hook_filter(u32 mods, u32 vk, s32 repeat)
+{
+	return keyseq_step(keytab_find(mods, vk), repeat, sys_time());
+}
+
+/* hotkey_fn_quit : toggles the availabliliy of the other hotkeys */
+s32 hotkey_fn_quit(struct state_t *state, struct hotkey_t *hotkeys, s32 len, s32 idx)
+{
+	state->quit = 1;
+	return 0;
+}
+
+/* hotkey_fn_swap : swaps between banks */
+s32 hotkey_fn_swap(struct state_t *state, struct hotkey_t *hotkeys, s32 len, s32 idx)
+{
+	s32 b, m;
+	struct bank_t *lbank;
+
+	b = hotkeys[idx].arg1;
+	m = hotkeys[idx].arg2;
+
+	if (state->banks_len == 0)
+		return 0;
+
+	// We attempt to apply both motions. Unless the values in the array are not quite what we
+	// expect, we'll end up adding zero and whatnot.
+	//
+	// At the very least, this gives the "swapping" function a very constant time.
+
+	// Handle the Bank Swap First
+	state->curr += b;
+	if (state->curr < 0) {
+		state->curr = state->banks_len - 1;
+	}
+	if (state->banks_len <= state->curr) {
+		state->curr = 0;
+	}
+
+	// Then the Macro Clamping, once the bank we landed on has its lines
+	lbank = state->banks + state->curr;
+	if (bank_load(state, lbank) < 0)
+		ERR("Couldn't load bank %d\n", state->curr);
+
+	lbank->curr += m;
+	if (lbank->curr < 0) {
+		lbank->curr = lbank->count - 1;
+	}
+	if (lbank->count <= lbank->curr) {
+		lbank->curr = 0;
+	}
+
+	return 0;
+}
+
+/* hotkey_fn_say : says the selected macro */
+s32 hotkey_fn_say(struct state_t *state, struct hotkey_t *hotkeys, s32 len, s32 idx)
+{
+	if (state->banks_len == 0)
+		return 0;
+
+	return say_macro(state, state->curr, -1);
+}
+
+/* hotkey_fn_sayat : says the macro in the hotkey's arguments, without moving to it */
+s32 hotkey_fn_sayat(struct state_t *state, struct hotkey_t *hotkeys, s32 len, s32 idx)
+{
+	s32 b;
+
+	b = bank_pick(state, hotkeys + idx);
+	if (b < 0)
+		return -1;
+
+	// the hotkey file counts from 1
+	return say_macro(state, b, hotkeys[idx].arg2 - 1);
+}
+
+/* hotkey_fn_goto : moves straight to the bank (and macro) in the hotkey's arguments */
+s32 hotkey_fn_goto(struct state_t *state, struct hotkey_t *hotkeys, s32 len, s32 idx)
+{
+	struct bank_t *lbank;
+	s32 b, m;
+
+	b = bank_pick(state, hotkeys + idx);
+	if (b < 0)
+		return -1;
+
+	state->curr = b;
+
+	lbank = state->banks + b;
+	if (bank_load(state, lbank) < 0) {
+		ERR("Couldn't load bank %d\n", b);
+		return -1;
+	}
+
+	// without a macro, it's wherever the bank was left
+	m = hotkeys[idx].arg2 - 1;
+	if (m == -1)
+		return 0;
+
+	if (m < 0 || lbank->count <= m) {
+		WRN("Bank %d hasn't got a macro %d\n", b + 1, m + 1);
+		return -1;
+	}
+
+	lbank->curr = m;
+
+	return 0;
+}
+
+/* bank_pick : returns the bank the hotkey's about, by name or by number, -1 if there isn't one */
+s32 bank_pick(struct state_t *state, struct hotkey_t *hotkey)
+{
+	s32 b;
+
+	if (hotkey->bank) {
+		b = bank_find(state, hotkey->bank, strlen(hotkey->bank));
+		if (b < 0)
+			WRN("There's no bank '%s'\n", hotkey->bank);
+		return b;
+	}
+
+	// the hotkey file counts from 1
+	b = hotkey->arg1 - 1;
+
+	if (b < 0 || state->banks_len <= b) {
+		WRN("There's no bank %d\n", hotkey->arg1);
+		return -1;
+	}
+
+	return b;
+}
+
+/* say_macro : says macro 'm' of bank 'b', or the bank's current macro if 'm' is -1 */
+s32 say_macro(struct state_t *state, s32 b, s32 m)
+{
+	struct bank_t *lbank;
+	struct plan_t *plan;
+	struct span_t *line;
+	u64 layout;
+
+	// NOTE (brian): The plan was already compiled when the bank was loaded (which swapping to it
+	// does), so all that's left to do here is hand it to the typing thread, which opens the chat
+	// box and puts the whole thing into the keyboard input queue (see say_send).
+
+	// if the player's switched layouts since we last looked, bank_load compiles this bank again
+	layout = backend->layout();
+	if (!keymap.built || keymap.layout != layout)
+		keymap_build(layout);
+
+	lbank = state->banks + b;
+	if (bank_load(state, lbank) < 0) {
+		ERR("Couldn't load bank %d\n", b);
+		return -1;
+	}
+
+	if (m == -1)
+		m = lbank->curr;
+
+	if (m < 0 || lbank->count <= m) {
+		if (lbank->count)
+			WRN("Bank %d hasn't got a macro %d\n", b + 1, m + 1);
+		return 0;
+	}
+
+	plan = state->plans + lbank->first + m;
+	line = state->lines + lbank->first + m;
+
+	if (profile->paste && profile->paste <= plan->count)
+		return say_queue(profile, state->events + plan->first, plan->count, state->text + line->off, line->len);
+
+	return say_queue(profile, state->events + plan->first, plan->count, NULL, 0);
+}
+
+/* command_run : runs one of hotkey_cmds, like "say TrashTalk 2", as if a hotkey had been pressed */
+s32 command_run(struct state_t *state, char **words, s32 n)
+{
+	struct hotkey_t hotkey;
+	char *end;
+	s32 i, j, num;
+
+	// NOTE (brian): The same commands the hotkey file has, without the digits, for when they come
+	// from somewhere other than a key, like --say. It's just a hotkey that's made up on the spot.
+
+	i = n < 1 ? -1 : hotkeys_cmd(words[0], n - 1);
+	if (i < 0) {
+		ERR("There's no '%s' with %d arguments\n", n < 1 ? "" : words[0], n - 1);
+		return -1;
+	}
+
+	memset(&hotkey, 0, sizeof hotkey);
+
+	for (j = 1; j < n; j++) {
+		num = strtol(words[j], &end, 10);
+
+		if (j == 1 && *end && hotkey_cmds[i].args[0] == 'n') {
+			hotkey.bank = words[j];
+		} else if (*end || !*words[j]) {
+			ERR("'%s' isn't an argument '%s' takes\n", words[j], words[0]);
+			return -1;
+		} else if (j == 1) {
+			hotkey.arg1 = num;
+		} else {
+			hotkey.arg2 = num;
+		}
+	}
+
+	if (hotkey_cmds[i].args[0] == 'b') {
+		hotkey.arg2 = hotkey.arg1;
+		hotkey.arg1 = 0;
+	}
+
+	if (!strcmp(hotkey_cmds[i].args, "nb") && hotkey.arg2 < 1) {
+		ERR("There's no macro %d, they count from 1\n", hotkey.arg2);
+		return -1;
+	}
+
+	hotkey.func = hotkey_cmds[i].func;
+
+	return hotkey.func(state, &hotkey, 1, 0);
+}
+
+/* ipc_read : runs every command that's come in (see command_run), one a line */
+void ipc_read(struct sys_ipc_t *ipc, struct state_t *state)
+{
+	char buf[BUFLARGE];
+	char *words[IPC_WORDS];
+	char *line, *next, *s;
+	s32 len, n;
+
+	// NOTE (brian): They're the same commands as the hotkey file has, and they get run right
+	// here, on the main loop, just like a hotkey. Each message can have a few, one a line.
+
+	while ((len = sys_ipc_read(ipc, buf, sizeof buf - 1)) > 0) {
+		buf[len] = 0;
+
+		for (line = buf; line < buf + len; line = next) {
+			s = strchr(line, '\n');
+			if (s)
+				*s = 0;
+			next = line + strlen(line) + 1;
+
+			s = strchr(line, '#');
+			if (s)
+				*s = 0;
+
+			for (n = 0, s = strtok(line, " \t\r"); s && n < IPC_WORDS; s = strtok(NULL, " \t\r"))
+				words[n++] = s;
+
+			if (s) {
+				ERR("'%s' has more than %d words\n", words[0], IPC_WORDS);
+				continue;
+			}
+
+			if (n)
+				command_run(state, words, n);
+		}
+	}
+}
+
+/* ipc_send : sends the words, as one command, to whoever's listening at 'name' */
+s32 ipc_send(char *name, char **words, s32 n)
+{
+	char buf[BUFLARGE];
+	s32 len, i, rc;
+
+	for (i = 0, len = 0; i < n; i++) {
+		rc = snprintf(buf + len, sizeof buf - len, "%s%s", i ? " " : "", words[i]);
+		if (rc < 0 || sizeof buf - len <= (size_t)rc) {
+			ERR("The command's too long\n");
+			return -1;
+		}
+		len += rc;
+	}
+
+	return sys_ipc_send(name, buf, len);
+}
+
+/* loop_idle : flushes the log, and returns when the main loop has to wake up by itself, 0 if it doesn't */
+f64 loop_idle(struct watch_t *watch, s32 hooked)
+{
+	f64 until;
+
+	// NOTE (brian): The log's only ever written out here, when the loop's about to sleep, so
+	// nothing that's in a hurry waits on the disk (see --log). The typing thread posts a SYS_SAID
+	// whenever it's caught up, so whatever it's logged gets written out then.
+	fflush(stderr);
+
+	// with --hook, the filter gives up on a partly pressed hotkey by itself
+	until = !hooked && keyseq.state ? keyseq.until : 0;
+
+	if (watch->settle && (!until || watch->settle < until))
+		until = watch->settle;
+
+	return until;
+}
+
+/* hotkey_fn_cancel : stops saying the macro being typed */
+s32 hotkey_fn_cancel(struct state_t *state, struct hotkey_t *hotkeys, s32 len, s32 idx)
+{
+	say_cancel();
+	return 0;
+}
+
+/* say_start : starts the thread that types says */
+s32 say_start()
+{
+	sayq.wake = sys_event(0);
+	sayq.cancel = sys_event(1);
+	if (!sayq.wake || !sayq.cancel)
+		return -1;
+
+	sayq.thread = sys_thread(say_thread, NULL);
+	if (!sayq.thread)
+		return -1;
+
+	return 0;
+}
+
+/* say_stop : stops the typing thread, once it's typed everything if 'finish', or throwing it away */
+void say_stop(s32 finish)
+{
+	struct say_t *say;
+
+	if (sayq.thread) {
+		__atomic_store_n(&sayq.quit, finish ? 2 : 1, __ATOMIC_SEQ_CST);
+		if (!finish)
+			say_cancel();
+		sys_event_set(sayq.wake);
+
+		sys_join(sayq.thread);
+		sayq.thread = NULL;
+	}
+
+	for (; sayq.head != sayq.tail; sayq.head++) {
+		say = sayq.items + sayq.head % SAY_QUEUE;
+		free(say->events);
+		free(say->text);
+		say->events = NULL;
+		say->text = NULL;
+	}
+
+	sys_event_free(sayq.wake);
+	sys_event_free(sayq.cancel);
+	sayq.wake = sayq.cancel = NULL;
+}
+
+/* say_queue : hands the events (or text, to be pasted) to the typing thread, to be said */
+s32 say_queue(struct profile_t *profile, struct key_t *events, u32 count, char *text, u32 text_len)
+{
+	struct say_t *say;
+	u32 tail;
+
+	tail = sayq.tail;
+
+	// the thread's done with this slot once it's moved 'head' past it, so acquire what it did
+	if (tail - __atomic_load_n(&sayq.head, __ATOMIC_ACQUIRE) == SAY_QUEUE) {
+		ERR("Already %d says waiting, dropping this one\n", SAY_QUEUE);
+		return -1;
+	}
+
+	say = sayq.items + tail % SAY_QUEUE;
+
+	say->events = malloc(count * sizeof(*say->events));
+	if (!say->events) {
+		ERR("Couldn't allocate %d events\n", count);
+		return -1;
+	}
+
+	memcpy(say->events, events, count * sizeof(*say->events));
+	say->count = count;
+	say->profile = profile;
+	say->keys = keymap.named;
+	say->gen = sayq.gen;
+
+	// the events are still kept, to be typed if pasting doesn't work out
+	say->text = NULL;
+	say->text_len = 0;
+
+	if (text) {
+		say->text = malloc(text_len);
+		if (say->text) {
+			memcpy(say->text, text, text_len);
+			say->text_len = text_len;
+		}
+	}
+
+	// publishes the say, the release makes sure it's all there before 'tail' moves
+	__atomic_store_n(&sayq.tail, tail + 1, __ATOMIC_RELEASE);
+	sys_event_set(sayq.wake);
+
+	return 0;
+}
+
+/* say_cancel : stops the say being typed, and throws away any that are waiting */
+void say_cancel()
+{
+	__atomic_add_fetch(&sayq.gen, 1, __ATOMIC_SEQ_CST);
+	sys_event_set(sayq.cancel);
+}
+
+/* say_thread : types the queued says, one after another */
+static s32 say_thread(void *arg)
+{
+	struct say_t *say;
+	u32 head;
+
+	// NOTE (brian): quit's 1 to stop right away, and 2 to stop once everything's been typed
+	while (sayq.quit != 1) {
+		head = sayq.head;
+
+		// the say was written before 'tail' moved, so acquire it, and don't read any of it early
+		if (head == __atomic_load_n(&sayq.tail, __ATOMIC_ACQUIRE)) {
+			if (sayq.quit)
+				break;
+			sys_event_wait(sayq.wake, 0);
+			continue;
+		}
+
+		say = sayq.items + head % SAY_QUEUE;
+
+		// a cancel from before this point has already bumped 'gen', so this can't lose one
+		sys_event_reset(sayq.cancel);
+
+		if (say->gen == sayq.gen)
+			say_send(say);
+
+		free(say->events);
+		free(say->text);
+		say->events = NULL;
+		say->text = NULL;
+
+		__atomic_store_n(&sayq.head, head + 1, __ATOMIC_RELEASE);
+
+		// caught up, the main loop gets woken for it (see loop_idle)
+		if (head + 1 == __atomic_load_n(&sayq.tail, __ATOMIC_ACQUIRE))
+			backend->post(SYS_SAID);
+	}
+
+	return 0;
+}
+
+/* say_send : opens the chat box, and types the say into it */
+void say_send(struct say_t *say)
+{
+	struct key_t chat[2];
+	u32 rc;
+
+#if 1
+	chat[0].code = say->keys.chat;
+#else
+	chat[0].code = say->keys.enter;
+#endif
+	chat[0].flags = 0;
+	chat[1].code = chat[0].code;
+	chat[1].flags = KEY_UP;
+
+	backend->send(chat, ARRSIZE(chat));
+
+	// the chat box takes a moment to open
+	if (sys_event_wait(sayq.cancel, sys_time() + say->profile->chat_ms / 1e3))
+		return;
+
+	if (say->text && say_paste(say) == 0)
+		return;
+
+	rc = send_events(say);
+	if (rc != say->count && say->gen == sayq.gen) {
+		ERR("Only put %d items on the keyboard queue\n", rc);
+	}
+}
+
+/* say_paste : pastes the say's text into the chat box through the clipboard, returns -1 if it couldn't */
+s32 say_paste(struct say_t *say)
+{
+	struct say_t keys;
+	struct key_t events[6];
+	void *saved;
+
+	// NOTE (brian): A long line is a lot of events to type, and some games take a while to chew
+	// through them, so instead it goes on the clipboard, and Ctrl+V, ENTER puts it in the chat box
+	// all at once. The clipboard's put back once the game's had time to read it.
+
+	if (!backend->clip_swap)
+		return -1;
+
+	saved = backend->clip_swap(say->text, say->text_len);
+	if (!saved)
+		return -1;
+
+	plan_push(events, 0, say->keys.control, 0);
+	plan_push(events, 1, say->keys.paste, 0);
+	plan_push(events, 2, say->keys.paste, 1);
+	plan_push(events, 3, say->keys.control, 1);
+	plan_push(events, 4, say->keys.enter, 0);
+	plan_push(events, 5, say->keys.enter, 1);
+
+	keys = *say;
+	keys.events = events;
+	keys.count = ARRSIZE(events);
+
+	send_events(&keys);
+
+	// even if we're cancelled, the clipboard still has to go back
+	sys_event_wait(sayq.cancel, sys_time() + PASTE_SETTLE_MS / 1e3);
+
+	backend->clip_restore(saved);
+
+	return 0;
+}
+
+/* send_events : types the say's events, chunked and paced for its profile, returns how many went in */
+u32 send_events(struct say_t *say)
+{
+	struct profile_t *profile;
+	struct key_t *events;
+	u32 count, off, end, rc, tries;
+	f64 start, next, now;
+
+	// NOTE (brian): Chunks are paced from when the last one was due, not from when it finished,
+	// so the time sending takes doesn't add up over a long line. If we fell behind anyway, the
+	// next chunk just goes now, instead of bursting to catch up.
+	//
+	// When a chunk only partly goes in (the input was blocked, or something else was typing at
+	// the same time), the rest of it is tried again a little later, instead of being lost. If it
+	// still won't go, or the say's cancelled, the rest of the plan is dropped, and the modifiers
+	// are let go of, since the plan could've been partway through holding one down.
+
+	profile = say->profile;
+	events = say->events;
+	count = say->count;
+
+	start = next = sys_time();
+
+	for (off = end = tries = 0; off < count && say->gen == sayq.gen;) {
+		if (off == end) {
+			end = profile->chunk && profile->chunk < count - off ? off + profile->chunk : count;
+			tries = 0;
+		}
+
+		rc = backend->send(events + off, end - off);
+		off += rc;
+
+		now = sys_time();
+
+		if (off < end) {
+			if (profile->retries <= tries++)
+				break;
+			profile->retried++;
+			next = now + (profile->gap_us < SEND_RETRY_US ? SEND_RETRY_US : profile->gap_us) / 1e6;
+		} else {
+			next += profile->gap_us / 1e6;
+			if (next < now)
+				next = now;
+		}
+
+		if (off < count && sys_event_wait(sayq.cancel, next))
+			break;
+	}
+
+	if (off < count)
+		send_release(say);
+
+	profile->says++;
+	profile->events += count;
+	profile->sent += off;
+	if (say->gen == sayq.gen) {
+		profile->dropped += count - off;
+	} else {
+		profile->cancelled += count - off;
+	}
+	profile->secs += sys_time() - start;
+
+	return off;
+}
+
+/* send_release : lets go of every modifier the say might've been holding down */
+void send_release(struct say_t *say)
+{
+	struct key_t release[2];
+
+	// shift's the only one plan_compile ever holds, and say_paste holds control
+	plan_push(release, 0, say->keys.shift, 1);
+	plan_push(release, 1, say->keys.control, 1);
+
+	backend->send(release, ARRSIZE(release));
+}
+
+/* send_report : prints how sending's gone, for every profile that's been used */
+void send_report()
+{
+	struct profile_t *p;
+	s32 i;
+
+	for (i = 0; i < ARRSIZE(profiles); i++) {
+		p = profiles + i;
+		if (!p->says)
+			continue;
+
+		// every key's a down and an up
+		MSG("%-6s : %llu says, %.0f keys/s, %llu / %llu events sent, %llu dropped, %llu cancelled, %llu retried\n",
+				p->name, p->says, p->secs > 0 ? p->sent / 2 / p->secs : 0.0,
+				p->sent, p->events, p->dropped, p->cancelled, p->retried);
+	}
+}
+
+/* plan_compile : compiles a macro line into events, returns the event count (counts only if NULL) */
+size_t plan_compile(struct key_t *events, char *s, size_t slen)
+{
+	size_t len, i, n;
+	s32 shift;
+	u32 cp;
+
+	// NOTE (brian): Callers run this twice. The first time with a NULL buffer, to count, so the
+	// second time can write into a buffer that's exactly the right size. The line's UTF-8, and
+	// every character in it gets typed by plan_char, then the whole thing is finished off with an
+	// ENTER.
+	//
+	// Shift is only pressed when a character needs it and it isn't down already, and only let go
+	// of when a character needs it up (or at the end), so a run of shifted characters is one
+	// shift down / up, instead of one for every character. Since that's decided as the events
+	// are made, instead of by going back over them, counting gives the same answer as filling.
+	//
+	// Almost every macro's all ascii, so runs of that get found 16 bytes at a time (utf8_ascii),
+	// and don't need decoding at all. Anything else gets decoded (and checked) by utf8_decode, and
+	// bytes that aren't valid UTF-8 get skipped, so a bad line doesn't turn into garbage.
+
+	len = 0;
+	shift = 0;
+
+	for (i = 0; i < slen;) {
+		for (n = i + utf8_ascii(s + i, slen - i); i < n; i++)
+			len = plan_char(events, len, (u8)s[i], &shift);
+
+		if (i == slen)
+			break;
+
+		n = utf8_decode((u8 *)s + i, slen - i, &cp);
+		if (!n) {
+			if (!events)
+				WRN("Invalid UTF-8 (0x%02x), skipping\n", (u8)s[i]);
+			i++;
+			continue;
+		}
+
+		len = plan_char(events, len, cp, &shift);
+		i += n;
+	}
+
+	// shift+enter is a new line in some chat boxes, instead of sending it
+	len = plan_shift(events, len, 0, &shift);
+
+	// add in an "ENTER" push
+	len = plan_push(events, len, keymap.named.enter, 0);
+	len = plan_push(events, len, keymap.named.enter, 1);
+
+	return len;
+}
+
+/* plan_char : adds the events to type the code point, returns the new length */
+static size_t plan_char(struct key_t *events, size_t len, u32 cp, s32 *shift)
+{
+	s16 scan;
+	u8 vk, sk;
+
+	// NOTE (brian): If the layout has a key for it, that's what gets pressed, with shift down
+	// when the layout says shift is needed (and up when it isn't). Games tend to read actual keys, so that's
+	// the way to go whenever we can. Anything that needs ctrl or alt (AltGr) too, or that the
+	// layout doesn't have at all, gets typed as unicode instead.
+
+	scan = cp < ARRSIZE(keymap.keys) ? keymap.keys[cp] : -1;
+
+	if (scan != -1 && !((scan >> 8) & 0x06)) {
+		vk = scan & 0xff;
+		sk = (scan >> 8) & 0xff;
+
+		len = plan_shift(events, len, sk & 0x01, shift);
+
+		len = plan_push(events, len, vk, 0);
+		len = plan_push(events, len, vk, 1);
+
+		if (!plan_coalesce)
+			len = plan_shift(events, len, 0, shift);
+
+		return len;
+	}
+
+	// unicode doesn't care about shift, but whatever's reading it might
+	len = plan_shift(events, len, 0, shift);
+
+	// control characters don't mean anything in a chat box
+	if (cp < 0x20 || cp == 0x7f) {
+		if (!events)
+			WRN("Can't type 0x%02x, skipping\n", cp);
+		return len;
+	}
+
+	return plan_unicode(events, len, cp);
+}
+
+/* plan_shift : presses or releases shift, if it isn't already, returns the new length */
+static size_t plan_shift(struct key_t *events, size_t len, s32 want, s32 *shift)
+{
+	if (!*shift == !want)
+		return len;
+
+	*shift = want;
+
+	return plan_push(events, len, keymap.named.shift, !want);
+}
+
+/* plan_unicode : adds a KEY_UNICODE down / up for the code point, returns the new length */
+static size_t plan_unicode(struct key_t *events, size_t len, u32 cp)
+{
+	// how it gets typed (surrogate pairs, borrowed keys, and so on) is up to the backend
+	len = plan_push(events, len, cp, 0);
+	len = plan_push(events, len, cp, 1);
+
+	if (events) {
+		events[len - 2].flags |= KEY_UNICODE;
+		events[len - 1].flags |= KEY_UNICODE;
+	}
+
+	return len;
+}
+
+/* utf8_ascii : returns how many bytes at the start of s are ascii */
+size_t utf8_ascii(char *s, size_t len)
+{
+	size_t i;
+#if defined(NLSCAN_SSE2)
+	u32 mask;
+
+	// the high bit's set in every byte of a multi byte sequence, and never in ascii
+	for (i = 0; i + 16 <= len; i += 16) {
+		mask = _mm_movemask_epi8(_mm_loadu_si128((__m128i *)(s + i)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#else
+	i = 0;
+#endif
+
+	for (; i < len && !(s[i] & 0x80); i++)
+		;
+
+	return i;
+}
+
+/* utf8_decode : decodes the code point at the start of s, returns its length, or 0 if it isn't valid */
+size_t utf8_decode(u8 *s, size_t len, u32 *cp)
+{
+	size_t n, i;
+	u32 min;
+
+	// NOTE (brian): Strict, like the spec says. No overlong encodings, no surrogates, and nothing
+	// past U+10FFFF, since none of those can be turned into UTF-16 that means anything.
+
+	if (s[0] < 0x80) {
+		*cp = s[0];
+		return 1;
+	} else if ((s[0] & 0xe0) == 0xc0) {
+		n = 2, *cp = s[0] & 0x1f, min = 0x80;
+	} else if ((s[0] & 0xf0) == 0xe0) {
+		n = 3, *cp = s[0] & 0x0f, min = 0x800;
+	} else if ((s[0] & 0xf8) == 0xf0) {
+		n = 4, *cp = s[0] & 0x07, min = 0x10000;
+	} else {
+		return 0;
+	}
+
+	if (len < n)
+		return 0;
+
+	for (i = 1; i < n; i++) {
+		if ((s[i] & 0xc0) != 0x80)
+			return 0;
+		*cp = (*cp << 6) | (s[i] & 0x3f);
+	}
+
+	if (*cp < min || 0x10ffff < *cp || (0xd800 <= *cp && *cp <= 0xdfff))
+		return 0;
+
+	return n;
+}
+
+/* keymap_build : fills in the keymap for the given keyboard layout */
+void keymap_build(u64 layout)
+{
+	// NOTE (brian): Asking the backend is a trip through the OS for every char, and plan_compile
+	// wants one for every char of every line, so it gets asked about each of the 256 once instead.
+	// Anything past those gets typed as unicode (see plan_char).
+
+	backend->keymap(layout, &keymap);
+
+	keymap.layout = layout;
+	keymap.built = 1;
+}
+
+/* keymap_check : makes sure the state's compiled for the keymap, before anything else gets compiled */
+void keymap_check(struct state_t *state)
+{
+	if (!keymap.built)
+		keymap_build(backend->layout());
+
+	if (state->layout == keymap.layout)
+		return;
+
+	// anything already compiled is for some other layout
+	if (state->lines_len)
+		WRN("Keyboard layout changed, compiling the macros again\n");
+
+	macros_unload(state);
+	state->layout = keymap.layout;
+}
+
+/* plan_push : writes a key event at events[len] (if we have a buffer), returns the new length */
+static size_t plan_push(struct key_t *events, size_t len, u32 code, s32 key_up)
+{
+	if (events) {
+		events[len].code = code;
+		events[len].flags = key_up ? KEY_UP : 0;
+	}
+	return len + 1;
+}
+
+/* macros_load : loads a macro file (text or pack) into the state, reusing what it can from base */
+s32 macros_load(struct state_t *state, char *fname, struct state_t *base)
+{
+	u64 size, mtime;
+
+	memset(state, 0, sizeof(*state));
+
+	// get this before mapping, so if the file changes in between, the cache just looks stale
+	if (sys_filestat(fname, &size, &mtime) < 0)
+		size = mtime = 0;
+
+	state->map = sys_mapfile(fname, &state->map_len);
+	if (!state->map)
+		return -1;
+
+	// a pack's banks come already compiled, so none get adopted from base, but they're still
+	// matched with its by name, so a reload keeps where we were (see state_swap)
+	if (sizeof(struct pack_hdr_t) <= state->map_len && memcmp(state->map, CMPACK_MAGIC, 4) == 0) {
+		if (pack_load(state) < 0 || bank_index(state) < 0)
+			return -1;
+		return base ? macros_match(state, base) : 0;
+	}
+
+	state->text = state->map;
+	state->text_len = state->map_len;
+	state->src_size = size;
+	state->src_mtime = mtime;
+	state->src_hash = c_hashblk(state->text, state->text_len);
+	state->cache = 1;
+
+	// a reload's already got everything that hasn't changed in base, and the cache is stale anyway
+	if (!base && cache_load(state, fname) == 0)
+		return bank_index(state);
+
+	return macros_parse(state, base) < 0 ? -1 : bank_index(state);
+}
+
+/* macros_parse : indexes the banks in the mapped text file */
+s32 macros_parse(struct state_t *state, struct state_t *base)
+{
+	struct work_t work[PARSE_THREADS_MAX];
+	struct bank_t *lbank;
+	size_t banks_len, i;
+	s32 n, rc;
+
+	// NOTE (brian):
+	//
+	// The macro file format is as follows:
+	//
+	// Example:
+	//
+	// BankFoo
+	//     You're trash.
+	//     I'd say you were cancer, but cancer wins sometimes.
+	//
+	// BankBar
+	//     glhf
+	//     Good Luck Having Fun
+	//
+	// That gets parsed into two banks, with two macros a piece
+	//
+	// The file's already mapped in, and every name and line is just an (offset, length) view
+	// into the mapping, so nothing's copied and there's no limit on how long a line can be.
+	//
+	// This only builds the index: text_scan goes over the text once, and hands back every bank's
+	// name and src, skipping right past the macro lines. The lines and plans for a bank get built
+	// by bank_load, the first time the bank's used. When we're reloading, each bank is matched up
+	// with the one of the same name in 'base', and marked if its text is byte for byte the same,
+	// so state_swap can keep what was already loaded for it.
+	//
+	// Big files get cut up at bank names (see text_nextbank), and each piece gets scanned on its
+	// own thread. Since a bank never straddles two pieces, sticking the pieces back together in
+	// order gives exactly what scanning the whole thing at once would've.
+
+	memset(work, 0, sizeof work);
+
+	n = work_split_text(state, work);
+
+	for (i = 0; i < n; i++)
+		work[i].scan.index = 1;
+
+	rc = sys_parallel(work_scan, work, sizeof(*work), n);
+
+	for (i = 0, banks_len = 0; i < n; i++)
+		banks_len += work[i].scan.banks_len;
+
+	state->banks = c_arena_alloc(&state->arena, banks_len * sizeof(*state->banks));
+	if (!state->banks)
+		rc = -1;
+
+	for (i = 0; i < n; i++) {
+		if (rc == 0) {
+			memcpy(state->banks + state->banks_len, work[i].scan.banks, work[i].scan.banks_len * sizeof(*state->banks));
+			state->banks_len += work[i].scan.banks_len;
+		}
+		scan_free(&work[i].scan);
+	}
+
+	if (rc < 0) {
+		macros_free(state);
+		return -1;
+	}
+
+	for (i = 0; i < state->banks_len; i++)
+		state->banks[i].prev = -1;
+
+	if (base && macros_match(state, base) < 0) {
+		macros_free(state);
+		return -1;
+	}
+
+	for (i = 0; i < state->banks_len; i++) {
+		lbank = state->banks + i;
+		lbank->same = base && bank_same(state, lbank, base);
+	}
+
+	// reset curr to the first bank, like we expect
+	state->curr = 0;
+
+	return 0;
+}
+
+/* macros_match : points every bank at the bank with the same name in base (bank_t::prev) */
+s32 macros_match(struct state_t *state, struct state_t *base)
+{
+	struct bank_t *lbank;
+	size_t i;
+
+	// base came through macros_load, so it's already got its names indexed
+
+	for (i = 0; i < state->banks_len; i++) {
+		lbank = state->banks + i;
+		lbank->prev = bank_find(base, state->text + lbank->name.off, lbank->name.len);
+	}
+
+	return 0;
+}
+
+/* bank_index : builds the index of the banks' names, returns -1 if it couldn't */
+s32 bank_index(struct state_t *state)
+{
+	struct bank_t *lbank;
+	size_t size, i, j;
+
+	// NOTE (brian): A little open addressing table, keyed on the name, that lives in the state's
+	// arena, and goes when it does. If two banks have the same name, the first one's found, it's
+	// always ahead of the other in the probing.
+
+	for (size = 16; size < state->banks_len * 2; size *= 2)
+		;
+
+	state->names = c_arena_alloc(&state->arena, size * sizeof(*state->names));
+	if (!state->names) {
+		macros_free(state);
+		return -1;
+	}
+
+	state->names_mask = size - 1;
+
+	for (i = 0; i < size; i++)
+		state->names[i] = -1;
+
+	for (i = 0; i < state->banks_len; i++) {
+		lbank = state->banks + i;
+		j = c_hash(state->text + lbank->name.off, lbank->name.len) & state->names_mask;
+		for (; state->names[j] != -1; j = (j + 1) & state->names_mask)
+			;
+		state->names[j] = i;
+	}
+
+	return 0;
+}
+
+/* bank_find : returns the bank with that name, -1 if there isn't one */
+s32 bank_find(struct state_t *state, char *name, size_t len)
+{
+	struct bank_t *lbank;
+	size_t j;
+
+	if (!state->names)
+		return -1;
+
+	j = c_hash(name, len) & state->names_mask;
+
+	for (; state->names[j] != -1; j = (j + 1) & state->names_mask) {
+		lbank = state->banks + state->names[j];
+		if (lbank->name.len == len && memcmp(state->text + lbank->name.off, name, len) == 0)
+			return state->names[j];
+	}
+
+	return -1;
+}
+
+/* bank_same : returns true if the bank's text hasn't changed since base */
+s32 bank_same(struct state_t *state, struct bank_t *lbank, struct state_t *base)
+{
+	struct bank_t *pbank;
+
+	if (lbank->prev < 0)
+		return 0;
+
+	pbank = base->banks + lbank->prev;
+
+	return pbank->src.len == lbank->src.len &&
+		memcmp(base->text + pbank->src.off, state->text + lbank->src.off, lbank->src.len) == 0;
+}
+
+/* macros_loadall : loads every bank that isn't loaded yet */
+s32 macros_loadall(struct state_t *state)
+{
+	struct work_t work[PARSE_THREADS_MAX];
+	size_t lines, events;
+	s32 i, n, rc;
+
+	// NOTE (brian): For when we need all of it (writing a pack, say). The banks get split up over
+	// every core, and each thread scans its banks and counts up their events. Then every thread
+	// gets its own stretch on the end of the arrays, in bank order, and goes back to fill it in.
+
+	memset(work, 0, sizeof work);
+
+	// make sure the keymap's built before any threads go looking (main's already picked nlscan)
+	keymap_check(state);
+
+	n = work_split_banks(state, work);
+
+	rc = sys_parallel(work_count, work, sizeof(*work), n);
+
+	for (i = 0, lines = events = 0; rc == 0 && i < n; i++) {
+		work[i].lines_first = state->lines_len + lines;
+		work[i].events_first = state->events_len + events;
+		lines += work[i].scan.lines_len;
+		events += work[i].events_len;
+	}
+
+	if (rc == 0)
+		rc = macros_reserve(state, lines, events);
+
+	if (rc == 0)
+		rc = sys_parallel(work_fill, work, sizeof(*work), n);
+
+	if (rc == 0) {
+		state->lines_len += lines;
+		state->events_len += events;
+	}
+
+	for (i = 0; i < n; i++)
+		scan_free(&work[i].scan);
+
+	return rc;
+}
+
+/* macros_reserve : makes room to add 'lines' lines and 'events' events to the state */
+s32 macros_reserve(struct state_t *state, size_t lines, size_t events)
+{
+	struct span_t *l;
+	struct plan_t *p;
+	struct key_t *e;
+	size_t cap;
+
+	// NOTE (brian): These double whenever they fill up. A cap of zero means the arrays are still
+	// sitting in a mapped pack, so they get copied out instead of realloc'd.
+
+	if (state->lines_cap < state->lines_len + lines) {
+		for (cap = state->lines_cap ? state->lines_cap : BUFSMALL; cap < state->lines_len + lines; cap *= 2)
+			;
+
+		l = malloc(cap * sizeof(*l));
+		p = malloc(cap * sizeof(*p));
+		if (!l || !p) {
+			free(l);
+			free(p);
+			return -1;
+		}
+
+		if (state->lines_len) {
+			memcpy(l, state->lines, state->lines_len * sizeof(*l));
+			memcpy(p, state->plans, state->lines_len * sizeof(*p));
+		}
+
+		if (state->lines_cap) {
+			free(state->lines);
+			free(state->plans);
+		}
+
+		state->lines = l;
+		state->plans = p;
+		state->lines_cap = cap;
+	}
+
+	if (state->events_cap < state->events_len + events) {
+		for (cap = state->events_cap ? state->events_cap : BUFSMALL; cap < state->events_len + events; cap *= 2)
+			;
+
+		e = malloc(cap * sizeof(*e));
+		if (!e)
+			return -1;
+
+		if (state->events_len)
+			memcpy(e, state->events, state->events_len * sizeof(*e));
+
+		if (state->events_cap)
+			free(state->events);
+
+		state->events = e;
+		state->events_cap = cap;
+	}
+
+	return 0;
+}
+
+/* macros_unload : forgets every loaded bank, so they get loaded again when they're used */
+void macros_unload(struct state_t *state)
+{
+	size_t i;
+
+	// NOTE (brian): The arrays just get emptied, they keep their room. If they're still in a pack,
+	// the next macros_reserve copies nothing out of it. Whatever's loaded after this is new as far
+	// as the cache is concerned.
+
+	for (i = 0; i < state->banks_len; i++)
+		state->banks[i].loaded = 0;
+
+	state->lines_len = 0;
+	state->events_len = 0;
+	state->cache_banks = 0;
+}
+
+/* bank_load : parses and compiles the bank's lines onto the end of the state's, if it isn't loaded yet */
+s32 bank_load(struct state_t *state, struct bank_t *lbank)
+{
+	struct scan_t scan;
+	struct span_t *line;
+	struct plan_t *plan;
+	size_t first, len, i, n;
+
+	// NOTE (brian): The bank's src is its name followed by its lines, so scanning just that gives
+	// back the one bank and all of its lines. Those go on the end of the state's lines, then it's
+	// the same count, reserve, fill as always for the events.
+
+	keymap_check(state);
+
+	if (lbank->loaded)
+		return 0;
+
+	memset(&scan, 0, sizeof scan);
+
+	if (text_scan(state->text, lbank->src.off, lbank->src.off + lbank->src.len, &scan) < 0 ||
+			macros_reserve(state, scan.lines_len, 0) < 0) {
+		scan_free(&scan);
+		return -1;
+	}
+
+	first = state->lines_len;
+	len = scan.lines_len;
+
+	for (i = 0, n = 0; i < len; i++) {
+		line = state->lines + first + i;
+		plan = state->plans + first + i;
+		*line = scan.lines[i];
+		plan->first = state->events_len + n;
+		plan->count = plan_compile(NULL, state->text + line->off, line->len);
+		n += plan->count;
+	}
+
+	scan_free(&scan);
+
+	if (macros_reserve(state, 0, n) < 0)
+		return -1;
+
+	for (i = first; i < first + len; i++)
+		plan_compile(state->events + state->plans[i].first, state->text + state->lines[i].off, state->lines[i].len);
+
+	state->lines_len += len;
+	state->events_len += n;
+
+	lbank->first = first;
+	lbank->count = len;
+	lbank->loaded = 1;
+
+	if (lbank->curr < 0 || lbank->count <= lbank->curr)
+		lbank->curr = 0;
+
+	return 0;
+}
+
+/* bank_adopt : copies the lines, plans and events of an unchanged bank over from the old state */
+s32 bank_adopt(struct state_t *state, struct bank_t *lbank, struct state_t *base, struct bank_t *pbank)
+{
+	struct span_t *line;
+	struct plan_t *plan, *pplan;
+	size_t i, n;
+
+	// NOTE (brian): The text's the same, it just might've moved in the file, so the lines get
+	// shifted over by however far the bank did, and the plans over to wherever their events land.
+
+	for (i = 0, n = 0; i < pbank->count; i++)
+		n += base->plans[pbank->first + i].count;
+
+	if (macros_reserve(state, pbank->count, n) < 0)
+		return -1;
+
+	for (i = 0, n = state->events_len; i < pbank->count; i++) {
+		line = state->lines + state->lines_len + i;
+		line->off = base->lines[pbank->first + i].off - pbank->src.off + lbank->src.off;
+		line->len = base->lines[pbank->first + i].len;
+
+		pplan = base->plans + pbank->first + i;
+		plan = state->plans + state->lines_len + i;
+		plan->first = n;
+		plan->count = pplan->count;
+		memcpy(state->events + n, base->events + pplan->first, plan->count * sizeof(*state->events));
+		n += plan->count;
+	}
+
+	lbank->first = state->lines_len;
+	lbank->count = pbank->count;
+	lbank->loaded = 1;
+
+	state->lines_len += pbank->count;
+	state->events_len = n;
+
+	return 0;
+}
+
+/* state_swap : swaps in the newly loaded state, carrying over where we were in the old one */
+struct state_t *state_swap(struct state_t *state, struct state_t *next)
+{
+	struct bank_t *lbank, *pbank;
+	size_t i;
+
+	// NOTE (brian): Carry over where we were. bank_t::prev was filled in (by name) against this
+	// state, so this is just a walk over the new banks, nothing gets searched for. Banks we'd
+	// already loaded that haven't changed get copied over, so they don't have to be loaded again
+	// the next time they're used. That's only ever the handful of banks that have been used.
+	//
+	// A pack comes with its banks already compiled, for the layout it says, and that has to stay
+	// what it says, or keymap_check won't know to compile them again. Banks only get copied over
+	// when both states are for the same layout, so one never has events for two.
+
+	next->curr = state->curr < next->banks_len ? state->curr : 0;
+	if (!next->lines_len)
+		next->layout = state->layout; // for the banks that get kept
+	next->s_bank = state->s_bank;
+	next->s_macro = state->s_macro;
+	next->quit = state->quit;
+
+	for (i = 0; i < next->banks_len; i++) {
+		lbank = next->banks + i;
+		if (lbank->prev < 0)
+			continue;
+
+		// bank_load makes sure this is still in the bank, but a pack's banks are already loaded
+		pbank = state->banks + lbank->prev;
+		lbank->curr = pbank->curr;
+		if (lbank->loaded && lbank->count <= lbank->curr)
+			lbank->curr = 0;
+
+		if (lbank->same && pbank->loaded && next->layout == state->layout &&
+				bank_adopt(next, lbank, state, pbank) < 0)
+			WRN("Couldn't keep bank %zu, it'll get loaded again\n", i);
+
+		if (lbank->prev == state->curr)
+			next->curr = i;
+	}
+
+	macros_free(state);
+	free(state);
+
+	return next;
+}
+
+/* watch_start : starts watching the macro file for changes, in the main loop */
+s32 watch_start(struct watch_t *watch, char *fname)
+{
+	char *s;
+
+	memset(watch, 0, sizeof(*watch));
+
+	watch->fname = fname;
+
+	// we're watching the directory the file lives in, so chop the file name off
+	strncpy(watch->dname, fname, sizeof(watch->dname) - 1);
+	s = strrchr(watch->dname, '\\');
+	if (!s)
+		s = strrchr(watch->dname, '/');
+	if (s) {
+		s[1] = 0;
+	} else {
+		strcpy(watch->dname, ".");
+	}
+
+	sys_filestat(fname, &watch->size, &watch->mtime);
+
+	watch->dir = sys_dirwatch(watch->dname);
+	if (!watch->dir)
+		return -1;
+
+	watch->done = sys_event(0);
+
+	if (!watch->done || sys_loop_dirwatch(watch->dir, LOOP_WATCH) < 0 ||
+			sys_loop_event(watch->done, LOOP_RELOAD) < 0) {
+		watch_stop(watch);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* watch_stop : stops watching the macro file */
+void watch_stop(struct watch_t *watch)
+{
+	// a reload that's still going has to finish, it's reading the state that's about to be freed
+	if (watch->thread) {
+		sys_join(watch->thread);
+		watch->thread = NULL;
+	}
+
+	if (watch->next) {
+		macros_free(watch->next);
+		free(watch->next);
+		watch->next = NULL;
+	}
+
+	sys_event_free(watch->done);
+	watch->done = NULL;
+
+	sys_dirwatch_free(watch->dir);
+	watch->dir = NULL;
+}
+
+/* watch_changed : reads the changes to the file's directory, and puts off looking at the file until they settle */
+void watch_changed(struct watch_t *watch)
+{
+	// NOTE (brian): Editors tend to write a file in a few goes (or write a temp file and rename it
+	// over the top), so every change puts off looking at it a little more, until they're done.
+	if (sys_dirwatch_read(watch->dir) > 0)
+		watch->settle = sys_time() + WATCH_SETTLE_MS / 1e3;
+}
+
+/* watch_reload : starts loading the macro file again, if it looks any different (see watch_adopt) */
+void watch_reload(struct watch_t *watch, struct state_t *state)
+{
+	u64 size, mtime;
+
+	// NOTE (brian): Rather than figuring out which of the notifications were about our file, we
+	// just see if it looks any different. Loading it maps and indexes the whole file, which is
+	// the disk, so it's done on a thread of its own, and the loop only ever swaps in what it
+	// loaded. One that settles while a reload's still running gets looked at once it's done.
+
+	watch->settle = 0;
+
+	if (watch->thread) {
+		watch->again = 1;
+		return;
+	}
+
+	if (sys_filestat(watch->fname, &size, &mtime) < 0)
+		return;
+
+	if (size == watch->size && mtime == watch->mtime)
+		return;
+
+	watch->base = state;
+	watch->next = NULL;
+
+	watch->thread = sys_thread(watch_work, watch);
+	if (!watch->thread) {
+		ERR("Couldn't start reloading '%s'\n", watch->fname);
+		return;
+	}
+
+	watch->size = size;
+	watch->mtime = mtime;
+}
+
+/* watch_work : (worker) loads the macro file against watch->base, and sets watch->done */
+s32 watch_work(void *arg)
+{
+	struct watch_t *watch;
+	struct state_t *next;
+
+	// NOTE (brian): macros_load only reads base's names and text, which never change while it's
+	// around, and it's around until the main loop swaps in what we hand back.
+
+	watch = arg;
+
+	next = calloc(1, sizeof(*next));
+	if (next && macros_load(next, watch->fname, watch->base) < 0) {
+		ERR("Couldn't reload '%s', keeping the old macros\n", watch->fname);
+		free(next);
+		next = NULL;
+	}
+
+	watch->next = next;
+
+	sys_event_set(watch->done);
+
+	return 0;
+}
+
+/* watch_adopt : swaps in what the reload loaded, once it's done, returns the state to use */
+struct state_t *watch_adopt(struct watch_t *watch, struct state_t *state)
+{
+	struct state_t *next;
+
+	if (!watch->thread)
+		return state;
+
+	sys_join(watch->thread);
+	watch->thread = NULL;
+
+	next = watch->next;
+	watch->next = NULL;
+
+	// it changed again while we were loading it, so it gets looked at again right away
+	if (watch->again) {
+		watch->again = 0;
+		watch->settle = sys_time();
+	}
+
+	if (!next)
+		return state;
+
+	MSG("Reloaded %s, %zu banks\n", watch->fname, next->banks_len);
+
+	return state_swap(state, next);
+}
+
+/* work_split_text : cuts the text up at bank names for work_scan, returns how many pieces */
+s32 work_split_text(struct state_t *state, struct work_t *work)
+{
+	size_t start, end;
+	s32 i, n;
+
+	n = state->text_len < PARSE_THREADS_MIN ? 1 : sys_cores();
+	if (PARSE_THREADS_MAX < n)
+		n = PARSE_THREADS_MAX;
+
+	for (i = 0, start = 0; i < n && start < state->text_len; i++) {
+		end = i == n - 1 ? state->text_len : text_nextbank(state->text, state->text_len, (state->text_len / n) * (i + 1));
+		if (end < start)
+			end = start;
+
+		work[i].state = state;
+		work[i].start = start;
+		work[i].end = end;
+
+		start = end;
+	}
+
+	return i ? i : 1;
+}
+
+/* work_split_banks : splits the banks into runs with about the same amount of text each */
+s32 work_split_banks(struct state_t *state, struct work_t *work)
+{
+	size_t start, end, bytes, target;
+	s32 i, n;
+
+	n = state->text_len < PARSE_THREADS_MIN ? 1 : sys_cores();
+	if (PARSE_THREADS_MAX < n)
+		n = PARSE_THREADS_MAX;
+
+	target = state->text_len / n + 1;
+
+	for (i = 0, start = 0; i < n && (start < state->banks_len || i == 0); i++) {
+		for (end = start, bytes = 0; end < state->banks_len && (bytes < target || i == n - 1); end++)
+			bytes += state->banks[end].src.len;
+
+		work[i].state = state;
+		work[i].start = start;
+		work[i].end = end;
+
+		start = end;
+	}
+
+	return i;
+}
+
+/* work_scan : (worker) scans its piece of the text */
+s32 work_scan(void *arg)
+{
+	struct work_t *work;
+
+	work = arg;
+	work->rc = text_scan(work->state->text, work->start, work->end, &work->scan);
+
+	return 0;
+}
+
+/* work_count : (worker) scans every bank in its run, and counts up their events */
+s32 work_count(void *arg)
+{
+	struct work_t *work;
+	struct state_t *state;
+	struct bank_t *lbank;
+	struct span_t *line;
+	size_t start, i, j;
+
+	work = arg;
+	state = work->state;
+
+	for (i = work->start; i < work->end; i++) {
+		lbank = state->banks + i;
+		if (lbank->loaded)
+			continue;
+
+		start = work->scan.lines_len;
+
+		if (text_scan(state->text, lbank->src.off, lbank->src.off + lbank->src.len, &work->scan) < 0) {
+			work->rc = -1;
+			return 0;
+		}
+
+		lbank->count = work->scan.lines_len - start;
+
+		for (j = start; j < work->scan.lines_len; j++) {
+			line = work->scan.lines + j;
+			work->events_len += plan_compile(NULL, state->text + line->off, line->len);
+		}
+	}
+
+	work->rc = 0;
+
+	return 0;
+}
+
+/* work_fill : (worker) compiles the events for every bank in its run */
+s32 work_fill(void *arg)
+{
+	struct work_t *work;
+	struct state_t *state;
+	struct bank_t *lbank;
+	struct span_t *line;
+	struct plan_t *plan;
+	size_t i, j, k, l, n;
+
+	work = arg;
+	state = work->state;
+
+	// 'k' walks the lines work_count scanned, 'l' and 'n' are where they go in the state's arrays
+	for (i = work->start, k = 0, l = work->lines_first, n = work->events_first; i < work->end; i++) {
+		lbank = state->banks + i;
+		if (lbank->loaded)
+			continue;
+
+		lbank->first = l;
+
+		for (j = 0; j < lbank->count; j++, k++, l++) {
+			line = state->lines + l;
+			plan = state->plans + l;
+			*line = work->scan.lines[k];
+			plan->first = n;
+			plan->count = plan_compile(state->events + n, state->text + line->off, line->len);
+			n += plan->count;
+		}
+
+		lbank->loaded = 1;
+
+		if (lbank->curr < 0 || lbank->count <= lbank->curr)
+			lbank->curr = 0;
+	}
+
+	work->rc = 0;
+
+	return 0;
+}
+
+/* macros_free : releases everything macros_load allocated */
+void macros_free(struct state_t *state)
+{
+	// these only belong to us once they've been copied out of the pack
+	if (state->lines_cap) {
+		free(state->lines);
+		free(state->plans);
+	}
+	if (state->events_cap)
+		free(state->events);
+
+	c_arena_free(&state->arena);
+	sys_unmapfile(state->map, state->map_len);
+	memset(state, 0, sizeof(*state));
+}
+
+/* text_scan : finds every bank and macro line in text[off, end), in a single pass */
+s32 text_scan(char *text, size_t off, size_t end, struct scan_t *scan)
+{
+	u32 nls[BUFLARGE];
+	size_t pos, start, n, i;
+
+	// NOTE (brian): The newlines come out of nlscan (see nlscan_init) a buffer full at a time,
+	// then every line between them gets looked at exactly once by scan_line. Deciding what a line
+	// is only ever needs its first byte, and trimming only ever looks at the couple of bytes at
+	// either end of it, so the vector code's just there to find the line breaks.
+
+	assert(nlscan);
+
+	if (UINT32_MAX < end)
+		return -1;
+
+	for (pos = off, start = off; pos < end;) {
+		n = nlscan(text, &pos, end, nls, ARRSIZE(nls));
 
-	while (buf == fgets(buf, sizeof buf, fp)) {
-		s = rtrim(buf);
+		for (i = 0; i < n; i++) {
+			if (scan_line(scan, text, start, nls[i]) < 0)
+				return -1;
+			start = nls[i] + 1;
+		}
+	}
 
-		switch (s[0]) {
-			case '\0':
-			case '#':
-				continue;
+	// the last line doesn't have to end in a newline
+	if (start < end && scan_line(scan, text, start, end) < 0)
+		return -1;
 
-			default: // new bank
-				C_RESIZE(&state->banks);
-				state->banks[state->banks_len].name = strdup(s);
-				state->banks[state->banks_len].curr = 0;
-				state->banks[state->banks_len].lines_len = 0;
-				state->banks[state->banks_len].lines_cap = 0;
-				state->banks_len++;
-				state->curr = state->banks_len - 1; // use curr in the next case
-				break;
+	if (scan->banks_len)
+		scan->banks[scan->banks_len - 1].src.len = end - scan->banks[scan->banks_len - 1].src.off;
 
-			case '\t': // new macro in the bank
-				s = ltrim(buf);
-				C_RESIZE(&state->banks[state->curr].lines);
-				lbank = state->banks + state->curr;
-				lbank->lines[lbank->lines_len++] = strdup(s);
-				break;
+	return 0;
+}
+
+/* text_nextbank : returns the offset of the first bank name at or after 'off' */
+size_t text_nextbank(char *text, size_t len, size_t off)
+{
+	char *nl;
+	size_t i;
+
+	// back up to the start of the line we landed in the middle of
+	while (0 < off && text[off - 1] != '\n')
+		off--;
+
+	for (; off < len; off = nl - text + 1) {
+		// same rules as scan_line: not indented, not a comment, and not all whitespace
+		if (text[off] != '\t' && text[off] != '#') {
+			for (i = off; i < len && text[i] != '\n' && isspace(text[i]); i++)
+				;
+			if (i < len && text[i] != '\n')
+				return off;
 		}
+
+		nl = memchr(text + off, '\n', len - off);
+		if (!nl)
+			break;
 	}
 
-	// reset curr to the first bank, like we expect
-	state->curr = 0;
+	return len;
+}
 
-	fclose(fp);
+/* scan_line : figures out what text[start, end) is, and adds it to the scan */
+s32 scan_line(struct scan_t *scan, char *text, size_t start, size_t end)
+{
+	struct bank_t *lbank;
+	size_t s, e;
+
+	// the index only wants the bank names, so a macro line's done with as soon as we see its tab
+	if (scan->index && start < end && text[start] == '\t')
+		return 0;
+
+	// rtrim, without writing to the (read only) mapping
+	for (e = end; start < e && isspace(text[e - 1]); e--)
+		;
+
+	if (start == e)
+		return 0;
+
+	switch (text[start]) {
+		case '#':
+			return 0;
+
+		default: // new bank
+			if (scan->banks_len)
+				scan->banks[scan->banks_len - 1].src.len = start - scan->banks[scan->banks_len - 1].src.off;
+
+			if (scan_grow((void **)&scan->banks, &scan->banks_cap, scan->banks_len, sizeof(*scan->banks)) < 0)
+				return -1;
+
+			lbank = scan->banks + scan->banks_len++;
+			memset(lbank, 0, sizeof(*lbank));
+			lbank->name.off = start;
+			lbank->name.len = e - start;
+			lbank->src.off = start;
+			break;
+
+		case '\t': // new macro in the bank
+			if (!scan->banks_len) // lines before the first bank don't belong to anything
+				return 0;
+
+			for (s = start; s < e && isspace(text[s]); s++)
+				;
+
+			if (scan_grow((void **)&scan->lines, &scan->lines_cap, scan->lines_len, sizeof(*scan->lines)) < 0)
+				return -1;
+
+			scan->lines[scan->lines_len].off = s;
+			scan->lines[scan->lines_len].len = e - s;
+			scan->lines_len++;
+
+			scan->banks[scan->banks_len - 1].count++;
+			break;
+	}
+
+	return 0;
+}
+
+/* scan_grow : doubles the array if it's full */
+s32 scan_grow(void **p, size_t *cap, size_t len, size_t size)
+{
+	void *q;
+	size_t n;
+
+	// NOTE (brian): c_resize only grows by BUFLARGE elements once it's past BUFLARGE, and that's
+	// way too slow for the million or so lines a big generated file has
+
+	if (len < *cap)
+		return 0;
+
+	n = *cap ? *cap * 2 : BUFSMALL;
+
+	q = realloc(*p, n * size);
+	if (!q)
+		return -1;
+
+	*p = q;
+	*cap = n;
 
 	return 0;
 }
 
+/* scan_free : frees the scan's arrays */
+void scan_free(struct scan_t *scan)
+{
+	free(scan->banks);
+	free(scan->lines);
+	memset(scan, 0, sizeof(*scan));
+}
+
+/* nlscan_init : picks the newline scanner, the best one the cpu has unless 'name' says otherwise */
+s32 nlscan_init(char *name)
+{
+	s32 i;
+
+	struct {
+		char *name;
+		nlscan_func func;
+		s32 supported;
+	} impls[] = {
+#if defined(NLSCAN_AVX2)
+		  { "avx2", nlscan_avx2, __builtin_cpu_supports("avx2") }
+		,
+#endif
+#if defined(NLSCAN_SSE2)
+		  { "sse2", nlscan_sse2, 1 }
+		,
+#endif
+		  { "scalar", nlscan_scalar, 1 }
+		, { "memchr", nlscan_memchr, 1 }
+	};
+
+	for (i = 0; i < ARRSIZE(impls); i++) {
+		if (!impls[i].supported)
+			continue;
+		if (name && !streq(name, impls[i].name))
+			continue;
+
+		nlscan = impls[i].func;
+		nlscan_name = impls[i].name;
+		return 0;
+	}
+
+	return -1;
+}
+
+/* nlscan_memchr : finds newlines with memchr, a line at a time */
+size_t nlscan_memchr(char *text, size_t *off, size_t end, u32 *out, size_t cap)
+{
+	char *nl;
+	size_t n;
+
+	for (n = 0; n < cap && *off < end; n++) {
+		nl = memchr(text + *off, '\n', end - *off);
+		if (!nl) {
+			*off = end;
+			break;
+		}
+		out[n] = nl - text;
+		*off = out[n] + 1;
+	}
+
+	return n;
+}
+
+/* nlscan_scalar : finds newlines a byte at a time */
+size_t nlscan_scalar(char *text, size_t *off, size_t end, u32 *out, size_t cap)
+{
+	size_t n, i;
+
+	for (n = 0, i = *off; n < cap && i < end; i++) {
+		if (text[i] == '\n')
+			out[n++] = i;
+	}
+
+	*off = i;
+
+	return n;
+}
+
+#if defined(NLSCAN_SSE2)
+/* nlscan_sse2 : finds newlines 16 bytes at a time */
+size_t nlscan_sse2(char *text, size_t *off, size_t end, u32 *out, size_t cap)
+{
+	__m128i nl, v;
+	size_t n, i;
+	u32 mask;
+
+	nl = _mm_set1_epi8('\n');
+
+	// a whole block's worth of newlines always has to fit in 'out'
+	for (n = 0, i = *off; i + 16 <= end && n + 16 <= cap; i += 16) {
+		v = _mm_loadu_si128((__m128i *)(text + i));
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+
+		for (; mask; mask &= mask - 1)
+			out[n++] = i + __builtin_ctz(mask);
+	}
+
+	*off = i;
+
+	// the tail's less than a block, if there's room for it
+	if (end - i < 16 && end - i <= cap - n)
+		n += nlscan_scalar(text, off, end, out + n, cap - n);
+
+	return n;
+}
+#endif
+
+#if defined(NLSCAN_AVX2)
+/* nlscan_avx2 : finds newlines 32 bytes at a time */
+__attribute__((target("avx2")))
+size_t nlscan_avx2(char *text, size_t *off, size_t end, u32 *out, size_t cap)
+{
+	__m256i nl, v;
+	size_t n, i;
+	u32 mask;
+
+	nl = _mm256_set1_epi8('\n');
+
+	for (n = 0, i = *off; i + 32 <= end && n + 32 <= cap; i += 32) {
+		v = _mm256_loadu_si256((__m256i *)(text + i));
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+
+		for (; mask; mask &= mask - 1)
+			out[n++] = i + __builtin_ctz(mask);
+	}
+
+	*off = i;
+
+	if (end - i < 32 && end - i <= cap - n)
+		n += nlscan_scalar(text, off, end, out + n, cap - n);
+
+	return n;
+}
+#endif
+
+/* bench_parse : times text_scan with every newline scanner, over a file or some generated text */
+s32 bench_parse(char *fname, size_t mb)
+{
+	struct state_t state;
+	struct scan_t scan;
+	char *text, *names[] = { "memchr", "scalar", "sse2", "avx2" };
+	size_t len, cap, i;
+	f64 start, secs;
+	u64 h;
+	s32 rc, j;
+
+	memset(&state, 0, sizeof state);
+
+	if (fname) {
+		text = sys_mapfile(fname, &len);
+		if (!text)
+			return -1;
+	} else {
+		// NOTE (brian): something shaped like a real macro file, a bank every few dozen lines,
+		// with CRLF line endings and lines of all sorts of lengths
+		cap = mb << 20;
+		text = malloc(cap + BUFSMALL);
+		if (!text)
+			return -1;
+
+		srand(1);
+
+		for (len = 0, i = 0; len < cap; i++) {
+			if (i % 40 == 0)
+				len += sprintf(text + len, "%sBank%zu\r\n", i ? "\r\n" : "", i / 40);
+			else if (i % 97 == 0)
+				len += sprintf(text + len, "# comment %zu\r\n", i);
+			else
+				len += sprintf(text + len, "\tProblem Count : %0*d\r\n", 1 + rand() % 80, rand());
+		}
+	}
+
+	MSG("%zu bytes of text\n", len);
+
+	for (j = 0; j < ARRSIZE(names); j++) {
+		if (nlscan_init(names[j]) < 0)
+			continue;
+
+		memset(&scan, 0, sizeof scan);
+
+		start = sys_time();
+		rc = text_scan(text, 0, len, &scan);
+		secs = sys_time() - start;
+
+		MSG("%-6s : %8.1f MB/s (%zu banks, %zu lines)%s\n", names[j], len / secs / (1 << 20),
+				scan.banks_len, scan.lines_len, rc < 0 ? " FAILED" : "");
+
+		scan_free(&scan);
+	}
+
+	// NOTE (brian): Then what startup actually does, which is hashing the file to check the cache,
+	// and then (if the cache was stale) the index, over all of it
+	start = sys_time();
+	h = c_hashblk(text, len);
+	secs = sys_time() - start;
+
+	MSG("c_hashblk : %8.1f MB/s (%016llx)\n", len / secs / (1 << 20), (unsigned long long)h);
+
+	nlscan_init(NULL);
+
+	state.text = text;
+	state.text_len = len;
+
+	start = sys_time();
+	rc = macros_parse(&state, NULL);
+	secs = sys_time() - start;
+
+	MSG("macros_parse (%s) : %8.1f MB/s over %zu bytes, %zu banks%s\n", nlscan_name, len / secs / (1 << 20),
+			len, state.banks_len, rc < 0 ? " FAILED" : "");
+
+	macros_free(&state);
+
+	// NOTE (brian): And loading every bank, plans and all. The compiled events are a good 20 times
+	// bigger than the text, so this only gets the first BENCH_PARSE_MB of it, cut off at the end
+	// of a line.
+	state.text = text;
+	state.text_len = len < (BENCH_PARSE_MB << 20) ? len : (BENCH_PARSE_MB << 20);
+	while (state.text_len < len && 0 < state.text_len && text[state.text_len - 1] != '\n')
+		state.text_len--;
+
+	if (rc == 0)
+		rc = macros_parse(&state, NULL);
+
+	start = sys_time();
+	if (rc == 0)
+		rc = macros_loadall(&state);
+	secs = sys_time() - start;
+
+	MSG("macros_loadall : %8.1f MB/s over %zu bytes%s\n", state.text_len / secs / (1 << 20),
+			state.text_len, rc < 0 ? " FAILED" : "");
+
+	macros_free(&state);
+
+	if (fname) {
+		sys_unmapfile(text, len);
+	} else {
+		free(text);
+	}
+
+	return rc;
+}
+
 /* state_dump : dumps the state of the 'state' object */
 s32 state_dump(struct state_t *state)
 {
+	struct bank_t *lbank;
 	s32 i, j;
 
 	if (!state) {
@@ -411,42 +3764,371 @@ s32 state_dump(struct state_t *state)
 	printf("state.quit    : %d\n", state->quit);
 
 	for (i = 0; i < state->banks_len; i++) {
-		printf("%s\n", state->banks[i].name);
-		for (j = 0; j < state->banks[i].lines_len; j++) {
-			printf("\t%s\n", state->banks[i].lines[j]);
+		lbank = state->banks + i;
+		printf("%.*s\n", (int)lbank->name.len, state->text + lbank->name.off);
+		if (bank_load(state, lbank) < 0)
+			printf("\t(couldn't load)\n");
+		for (j = lbank->first; j < lbank->first + lbank->count; j++) {
+			printf("\t%.*s\n", (int)state->lines[j].len, state->text + state->lines[j].off);
 		}
 	}
 
 	return 0;
 }
 
-/* sys_lasterror : handles errors that aren't propogated through win32 errno */
-static void sys_lasterror()
+/* stats_dump : compiles every bank, and prints how many events they take, with and without coalescing */
+s32 stats_dump(struct state_t *state)
 {
-	DWORD error;
-	char *errmsg;
+	struct span_t *line;
+	struct key_t *event;
+	size_t before, shifts, i;
+
+	if (macros_loadall(state) < 0)
+		return -1;
 
-	error = GetLastError();
+	// the state's plans are the coalesced ones, and counting them again without is cheap enough
+	plan_coalesce = 0;
 
-	FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER|FORMAT_MESSAGE_FROM_SYSTEM|FORMAT_MESSAGE_IGNORE_INSERTS,
-			NULL, error, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR)&errmsg, 0, NULL);
+	for (i = 0, before = 0; i < state->lines_len; i++) {
+		line = state->lines + i;
+		before += plan_compile(NULL, state->text + line->off, line->len);
+	}
+
+	plan_coalesce = 1;
+
+	for (i = 0, shifts = 0; i < state->events_len; i++) {
+		event = state->events + i;
+		shifts += !(event->flags & KEY_UNICODE) && event->code == keymap.named.shift;
+	}
 
-	ERR("%s", errmsg);
+	printf("banks        : %zu\n", state->banks_len);
+	printf("lines        : %zu\n", state->lines_len);
+	printf("events       : %zu (%.1f a line)\n", state->events_len, state->lines_len ? (f64)state->events_len / state->lines_len : 0.0);
+	printf("shift events : %zu\n", shifts);
+	printf("uncoalesced  : %zu (%zu more, %.1f%%)\n", before, before - state->events_len,
+			before ? 100.0 * (before - state->events_len) / before : 0.0);
 
-	LocalFree(errmsg);
+	return 0;
 }
 
-/* mk_kbdinput : helper function to fill in an INPUT structure for a keyboard */
-void mk_kbdinput(INPUT *input, s16 vk, s16 sk, s32 key_up)
+/* pack_write : writes the loaded state out as a compiled pack */
+s32 pack_write(struct state_t *state, char *fname)
 {
-	if (!input)
-		return;
+	FILE *fp;
+	struct pack_hdr_t hdr;
+	struct pack_bank_t pbank;
+	struct bank_t *lbank;
+	size_t off, i;
+	char pad[CMPACK_ALIGN];
+
+	memset(&hdr, 0, sizeof hdr);
+	memset(pad, 0, sizeof pad);
+
+	// NOTE (brian): Only the banks that are loaded have any lines, plans and events, the rest only
+	// have their name and src. Call macros_loadall first for a pack with everything.
+
+	// lay the sections out first, so the header can go out before everything else
+	off = sizeof hdr;
+
+#define PACK_SECTION(o, n) ( \
+		off = (off + CMPACK_ALIGN - 1) & ~(size_t)(CMPACK_ALIGN - 1), \
+		(o) = off, \
+		off += (n))
+
+	PACK_SECTION(hdr.banks_off, state->banks_len * sizeof(struct pack_bank_t));
+	PACK_SECTION(hdr.lines_off, state->lines_len * sizeof(*state->lines));
+	PACK_SECTION(hdr.plans_off, state->lines_len * sizeof(*state->plans));
+	PACK_SECTION(hdr.events_off, state->events_len * sizeof(*state->events));
+	PACK_SECTION(hdr.text_off, state->text_len);
+
+#undef PACK_SECTION
+
+	if (UINT32_MAX < off) {
+		ERR("Pack would be too big (%zu bytes)\n", off);
+		return -1;
+	}
+
+	memcpy(hdr.magic, CMPACK_MAGIC, sizeof hdr.magic);
+	hdr.version = CMPACK_VERSION;
+	hdr.hdr_size = sizeof hdr;
+	hdr.event_size = sizeof(*state->events);
+	hdr.size = off;
+	hdr.banks_len = state->banks_len;
+	hdr.lines_len = state->lines_len;
+	hdr.events_len = state->events_len;
+	hdr.text_len = state->text_len;
+	hdr.src_size = state->src_size;
+	hdr.src_mtime = state->src_mtime;
+	hdr.src_hash = state->src_hash;
+	hdr.layout = state->layout;
+
+	fp = fopen(fname, "wb");
+	if (!fp)
+		return -1;
+
+	fwrite(&hdr, sizeof hdr, 1, fp);
+
+	// NOTE (brian): pad out to where the next section's supposed to start
+#define PACK_SEEK(o) (fwrite(pad, 1, (o) - ftell(fp), fp))
+
+	PACK_SEEK(hdr.banks_off);
+	for (i = 0; i < state->banks_len; i++) {
+		lbank = state->banks + i;
+		memset(&pbank, 0, sizeof pbank);
+		pbank.name = lbank->name;
+		pbank.src = lbank->src;
+		pbank.first = lbank->first;
+		pbank.count = lbank->count;
+		pbank.loaded = lbank->loaded;
+		fwrite(&pbank, sizeof pbank, 1, fp);
+	}
+
+	PACK_SEEK(hdr.lines_off);
+	fwrite(state->lines, sizeof(*state->lines), state->lines_len, fp);
+
+	PACK_SEEK(hdr.plans_off);
+	fwrite(state->plans, sizeof(*state->plans), state->lines_len, fp);
+
+	PACK_SEEK(hdr.events_off);
+	fwrite(state->events, sizeof(*state->events), state->events_len, fp);
+
+	PACK_SEEK(hdr.text_off);
+	fwrite(state->text, 1, state->text_len, fp);
+
+#undef PACK_SEEK
+
+	if (ferror(fp) || ftell(fp) != hdr.size) {
+		fclose(fp);
+		return -1;
+	}
+
+	fclose(fp);
+
+	return 0;
+}
+
+/* pack_load : loads the state straight out of the mapped pack */
+s32 pack_load(struct state_t *state)
+{
+	struct pack_hdr_t *hdr;
+	struct pack_bank_t *pbanks;
+	struct bank_t *lbank;
+	struct span_t *span;
+	struct plan_t *plan;
+	size_t i;
+
+	// NOTE (brian): The lines, plans, events and text are used right where they sit in the
+	// mapping, so the banks that were loaded when the pack was written are already loaded. The
+	// only thing we build is the (small) bank array, since the mapping's read only, and a bank_t
+	// has the current macro and the reload's bookkeeping on top of the pack's [first, count).
+	// Before trusting any of it though, we check that every offset in the pack stays inside the
+	// pack, so a truncated or corrupted file gets rejected instead of crashing us later.
+
+	hdr = (struct pack_hdr_t *)state->map;
+
+#define PACK_CHECK(cond) do { \
+		if (!(cond)) { \
+			ERR("Invalid pack, failed check '%s'\n", #cond); \
+			macros_free(state); \
+			return -1; \
+		} \
+	} while (0)
+
+#define PACK_INSIDE(off, n, size) ((off) <= state->map_len && (u64)(n) * (size) <= state->map_len - (off))
+
+	PACK_CHECK(hdr->version == CMPACK_VERSION);
+	PACK_CHECK(hdr->hdr_size == sizeof(*hdr));
+	PACK_CHECK(hdr->event_size == sizeof(*state->events));
+	PACK_CHECK(hdr->size == state->map_len);
+	PACK_CHECK(PACK_INSIDE(hdr->banks_off, hdr->banks_len, sizeof(*pbanks)));
+	PACK_CHECK(PACK_INSIDE(hdr->lines_off, hdr->lines_len, sizeof(*state->lines)));
+	PACK_CHECK(PACK_INSIDE(hdr->plans_off, hdr->lines_len, sizeof(*state->plans)));
+	PACK_CHECK(PACK_INSIDE(hdr->events_off, hdr->events_len, sizeof(*state->events)));
+	PACK_CHECK(PACK_INSIDE(hdr->text_off, hdr->text_len, 1));
+	PACK_CHECK(hdr->banks_off % CMPACK_ALIGN == 0 && hdr->lines_off % CMPACK_ALIGN == 0);
+	PACK_CHECK(hdr->plans_off % CMPACK_ALIGN == 0 && hdr->events_off % CMPACK_ALIGN == 0);
+
+	pbanks = (struct pack_bank_t *)(state->map + hdr->banks_off);
+
+	// cap stays zero, these aren't ours to free (or realloc)
+	state->lines = (struct span_t *)(state->map + hdr->lines_off);
+	state->plans = (struct plan_t *)(state->map + hdr->plans_off);
+	state->lines_len = hdr->lines_len;
+	state->events = (struct key_t *)(state->map + hdr->events_off);
+	state->events_len = hdr->events_len;
+	state->text = state->map + hdr->text_off;
+	state->text_len = hdr->text_len;
+	state->layout = hdr->layout;
+
+	for (i = 0; i < state->lines_len; i++) {
+		span = state->lines + i;
+		plan = state->plans + i;
+		PACK_CHECK(span->off <= state->text_len && span->len <= state->text_len - span->off);
+		PACK_CHECK(plan->first <= state->events_len && plan->count <= state->events_len - plan->first);
+	}
+
+	state->banks = c_arena_alloc(&state->arena, hdr->banks_len * sizeof(*state->banks));
+	PACK_CHECK(state->banks != NULL);
+
+	state->banks_len = hdr->banks_len;
+
+	for (i = 0; i < state->banks_len; i++) {
+		span = &pbanks[i].name;
+		PACK_CHECK(span->off <= state->text_len && span->len <= state->text_len - span->off);
+		span = &pbanks[i].src;
+		PACK_CHECK(span->off <= state->text_len && span->len <= state->text_len - span->off);
+
+		lbank = state->banks + i;
+		lbank->name = pbanks[i].name;
+		lbank->src = pbanks[i].src;
+		lbank->prev = -1;
 
-	input->type = INPUT_KEYBOARD;
-	input->ki.wVk = vk;
-	input->ki.wScan = sk;
-	input->ki.dwFlags = key_up ? KEYEVENTF_KEYUP : 0;
-	input->ki.time = 0;
-	input->ki.dwExtraInfo = 0;
+		if (!pbanks[i].loaded)
+			continue;
+
+		PACK_CHECK(pbanks[i].first <= state->lines_len);
+		PACK_CHECK(pbanks[i].count <= state->lines_len - pbanks[i].first);
+
+		lbank->first = pbanks[i].first;
+		lbank->count = pbanks[i].count;
+		lbank->loaded = 1;
+	}
+
+#undef PACK_INSIDE
+#undef PACK_CHECK
+
+	return 0;
+}
+
+/* cache_load : swaps the state over to the macro file's cache, if the cache is up to date */
+s32 cache_load(struct state_t *state, char *fname)
+{
+	struct state_t cache;
+	struct pack_hdr_t *hdr;
+	char path[BUFLARGE];
+	u64 size, mtime;
+	size_t i;
+
+	// NOTE (brian): The state's already got the macro file mapped, and its size, time and hash
+	// filled in. The cache is only any good if it was built from exactly that, which the cache's
+	// header says. Not having a cache (or having a stale one) is normal, so none of that's an
+	// error, we just go and parse the text like we would've anyway.
+
+	snprintf(path, sizeof path, "%s%s", fname, CACHE_SUFFIX);
+
+	if (sys_filestat(path, &size, &mtime) < 0 || size < sizeof(*hdr))
+		return -1;
+
+	memset(&cache, 0, sizeof cache);
+
+	cache.map = sys_mapfile(path, &cache.map_len);
+	if (!cache.map)
+		return -1;
+
+	hdr = (struct pack_hdr_t *)cache.map;
+
+	if (cache.map_len < sizeof(*hdr) || memcmp(hdr->magic, CMPACK_MAGIC, 4) != 0 || hdr->version != CMPACK_VERSION ||
+			hdr->src_size != state->src_size || hdr->src_mtime != state->src_mtime ||
+			hdr->src_hash != state->src_hash || hdr->text_len != state->text_len) {
+		macros_free(&cache);
+		return -1;
+	}
+
+	// pack_load cleans up after itself when it fails
+	if (pack_load(&cache) < 0)
+		return -1;
+
+	cache.src_size = state->src_size;
+	cache.src_mtime = state->src_mtime;
+	cache.src_hash = state->src_hash;
+	cache.cache = 1;
+
+	for (i = 0; i < cache.banks_len; i++)
+		cache.cache_banks += cache.banks[i].loaded;
+
+	// the cache has its own copy of the text, so we're done with the macro file
+	macros_free(state);
+	*state = cache;
+
+	return 0;
+}
+
+/* cache_write : writes the state out to a new cache file, if it has anything the old one doesn't */
+s32 cache_write(struct state_t *state, char *fname)
+{
+	char path[BUFLARGE];
+	size_t i, n;
+
+	// NOTE (brian): Banks only ever get loaded, except when the layout changes, and then every
+	// bank's unloaded and cache_banks goes back to zero (see macros_unload). So if there are more
+	// loaded than cache_banks, there's something new to save, whether that's more banks, or the
+	// same ones compiled for the new layout. A state that was parsed from the text didn't come
+	// from a cache at all, so that always gets saved. This goes to a temporary file, for
+	// cache_commit to move over the real one.
+
+	if (!state->cache)
+		return -1;
+
+	for (i = 0, n = 0; i < state->banks_len; i++)
+		n += state->banks[i].loaded;
+
+	if (state->text != state->map && n <= state->cache_banks)
+		return -1;
+
+	snprintf(path, sizeof path, "%s%s.tmp", fname, CACHE_SUFFIX);
+
+	if (pack_write(state, path) < 0) {
+		WRN("Couldn't write the cache '%s'\n", path);
+		remove(path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* cache_commit : puts the cache file cache_write wrote in place of the old one */
+s32 cache_commit(char *fname)
+{
+	char path[BUFLARGE], tmp[BUFLARGE];
+
+	snprintf(path, sizeof path, "%s%s", fname, CACHE_SUFFIX);
+	snprintf(tmp, sizeof tmp, "%s%s.tmp", fname, CACHE_SUFFIX);
+
+	if (sys_replace(tmp, path) < 0) {
+		remove(tmp);
+		return -1;
+	}
+
+	return 0;
 }
 
+/* sys_parallel : runs func on every one of the n items in args, on their own threads, and waits */
+static s32 sys_parallel(s32 (*func)(void *arg), void *args, size_t size, s32 n)
+{
+	struct sys_thread_t *threads[PARSE_THREADS_MAX];
+	s32 i, rc;
+
+	// NOTE (brian): The first item runs on the calling thread, so a single item never makes a
+	// thread at all. If a thread can't be made, that item just runs here too. Every item's
+	// expected to start with an s32 'rc'.
+
+	assert(n <= PARSE_THREADS_MAX);
+
+	for (i = 1; i < n; i++) {
+		threads[i] = sys_thread(func, (u8 *)args + i * size);
+		if (!threads[i])
+			func((u8 *)args + i * size);
+	}
+
+	func(args);
+
+	for (i = 1; i < n; i++)
+		sys_join(threads[i]);
+
+	for (i = 0, rc = 0; i < n; i++) {
+		if (*(s32 *)((u8 *)args + i * size) < 0)
+			rc = -1;
+	}
+
+	return rc;
+}
@@ -78,6 +78,33 @@ void c_resize(void *ptr, size_t *len, size_t *cap, size_t bytes);
 // #define C_RESIZE(x,y,z) (c_resize((x),y##_len,y##_cap,z))
 #define C_RESIZE(x) (c_resize((x),x##_len,x##_cap,sizeof(**x)))
 
+// NOTE (brian): a bump allocator. Allocations are never freed individually, the whole thing goes
+// at once with c_arena_free. Memory handed out is always zeroed.
+struct c_arenablk_t {
+	struct c_arenablk_t *next;
+	size_t used, cap;
+};
+
+struct c_arena_t {
+	struct c_arenablk_t *head;
+	size_t blksize; // defaults to C_ARENA_BLKSIZE if zero
+};
+
+#define C_ARENA_BLKSIZE (1 << 16)
+#define C_ARENA_ALIGN   (16)
+
+/* c_arena_alloc : returns 'bytes' of zeroed memory from the arena */
+void *c_arena_alloc(struct c_arena_t *arena, size_t bytes);
+/* c_arena_strdup : duplicates the string into the arena */
+char *c_arena_strdup(struct c_arena_t *arena, char *s);
+/* c_arena_free : releases everything the arena's ever handed out */
+void c_arena_free(struct c_arena_t *arena);
+
+/* c_hash : 64 bit FNV-1a hash of the buffer */
+u64 c_hash(void *p, size_t len);
+/* c_hashblk : fast 64 bit hash, for big buffers */
+u64 c_hashblk(void *p, size_t len);
+
 /* sql_fmtstr : formats an input string into the dst, sql ready */
 int sql_fmtstr(char *dst, char *src, size_t dstlen);
 
@@ -187,6 +214,151 @@ void c_resize(void *ptr, size_t *len, size_t *cap, size_t bytes)
 	}
 }
 
+/* c_arena_alloc : returns 'bytes' of zeroed memory from the arena */
+void *c_arena_alloc(struct c_arena_t *arena, size_t bytes)
+{
+	struct c_arenablk_t *blk;
+	size_t hdr, cap;
+	void *p;
+
+	hdr = (sizeof(*blk) + C_ARENA_ALIGN - 1) & ~(size_t)(C_ARENA_ALIGN - 1);
+	bytes = (bytes + C_ARENA_ALIGN - 1) & ~(size_t)(C_ARENA_ALIGN - 1);
+
+	blk = arena->head;
+
+	if (!blk || blk->cap - blk->used < bytes) {
+		cap = arena->blksize ? arena->blksize : C_ARENA_BLKSIZE;
+		if (cap < bytes)
+			cap = bytes;
+
+		// calloc, so everything we hand out is zeroed, just like c_resize
+		blk = calloc(1, hdr + cap);
+		if (!blk)
+			return NULL;
+
+		blk->cap = cap;
+
+		// NOTE (brian): if an oversized allocation gets its own block, slot it in behind the
+		// current head, so we don't throw away the rest of the head's space
+		if (arena->head && arena->head->cap - arena->head->used >= cap - bytes) {
+			blk->next = arena->head->next;
+			arena->head->next = blk;
+		} else {
+			blk->next = arena->head;
+			arena->head = blk;
+		}
+	}
+
+	p = (u8 *)blk + hdr + blk->used;
+	blk->used += bytes;
+
+	return p;
+}
+
+/* c_arena_strdup : duplicates the string into the arena */
+char *c_arena_strdup(struct c_arena_t *arena, char *s)
+{
+	size_t len;
+	char *t;
+
+	len = strlen(s);
+
+	t = c_arena_alloc(arena, len + 1);
+	if (t)
+		memcpy(t, s, len);
+
+	return t;
+}
+
+/* c_arena_free : releases everything the arena's ever handed out */
+void c_arena_free(struct c_arena_t *arena)
+{
+	struct c_arenablk_t *blk, *next;
+
+	for (blk = arena->head; blk; blk = next) {
+		next = blk->next;
+		free(blk);
+	}
+
+	arena->head = NULL;
+}
+
+/* c_hash : 64 bit FNV-1a hash of the buffer */
+u64 c_hash(void *p, size_t len)
+{
+	u8 *s;
+	u64 h;
+	size_t i;
+
+	s = p;
+	h = 0xcbf29ce484222325ULL;
+
+	for (i = 0; i < len; i++) {
+		h ^= s[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+/* c_hashblk : fast 64 bit hash, for big buffers */
+u64 c_hashblk(void *p, size_t len)
+{
+	u64 v[4], h, k;
+	size_t n, i;
+	u8 *s;
+
+	// NOTE (brian): FNV-1a goes a byte at a time, which is fine for names, but way too slow for
+	// hashing a whole macro file. This is the same shape as xxHash64: four independent lanes
+	// eating 8 bytes each, so the multiplies overlap, then the tail and a final mix.
+
+#define C_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+#define C_P1 (0x9e3779b185ebca87ULL)
+#define C_P2 (0xc2b2ae3d27d4eb4fULL)
+#define C_P3 (0x165667b19e3779f9ULL)
+
+	s = p;
+	n = len;
+
+	v[0] = C_P1 + C_P2;
+	v[1] = C_P2;
+	v[2] = 0;
+	v[3] = -C_P1;
+
+	for (; 32 <= n; s += 32, n -= 32) {
+		for (i = 0; i < 4; i++) {
+			memcpy(&k, s + i * 8, sizeof k);
+			v[i] = C_ROTL(v[i] + k * C_P2, 31) * C_P1;
+		}
+	}
+
+	h = C_ROTL(v[0], 1) + C_ROTL(v[1], 7) + C_ROTL(v[2], 12) + C_ROTL(v[3], 18) + len;
+
+	for (; 8 <= n; s += 8, n -= 8) {
+		memcpy(&k, s, sizeof k);
+		h ^= C_ROTL(k * C_P2, 31) * C_P1;
+		h = C_ROTL(h, 27) * C_P1 + C_P3;
+	}
+
+	for (; n; s++, n--) {
+		h ^= *s * C_P3;
+		h = C_ROTL(h, 11) * C_P1;
+	}
+
+	h ^= h >> 33;
+	h *= C_P2;
+	h ^= h >> 29;
+	h *= C_P3;
+	h ^= h >> 32;
+
+#undef C_P3
+#undef C_P2
+#undef C_P1
+#undef C_ROTL
+
+	return h;
+}
+
 /* sql_fmtstr : formats an input string into the dst, sql ready */
 int sql_fmtstr(char *dst, char *src, size_t dstlen)
 {
@@ -0,0 +1,236 @@
+#if !defined(SYS_H)
+#define SYS_H
+
+/*
+ * Platform Layer for chatmacro
+ *
+ * Everything chatmacro.c wants from the OS goes through here. There's two halves to it:
+ *
+ *   The sys_* functions, which are the boring parts (mapping files, threads, events, watching a
+ *   directory, taking commands from other processes, the main loop's wait, the time). There's one
+ *   set of those for each OS, sys_win32.c and sys_posix.c.
+ *
+ *   The backends (backend_t), which are how hotkeys come in, and how keys go out. Windows has the
+ *   one (sys_win32.c, RegisterHotKey and SendInput). Linux has X11 (sys_x11.c, XGrabKey and XTest),
+ *   which works just as well under Xvfb as it does on a desktop, and evdev (sys_evdev.c, the
+ *   keyboards' devices and a uinput keyboard), which works under anything, Wayland included.
+ *   Everyone has the recording one (sys_record.c), which presses hotkeys from a script, and writes
+ *   down what it's sent, for timing things and for diffing what got typed against a golden file.
+ *
+ * Hotkeys are written in Win32's virtual keys and hotkey modifiers, on every platform, and each
+ * backend turns those into whatever it actually grabs.
+ */
+
+#include "common.h"
+
+// NOTE (brian): One key going down or up, what a plan's made of. What 'code' is is up to the
+// backend that built the keymap (a virtual key on Win32, a keycode on X11, one of the kernel's
+// KEY_* on evdev). With KEY_UNICODE, it's a code point instead, and the backend types that
+// however it can, without a key for it. Win32 has KEYEVENTF_UNICODE, X11 borrows a spare keycode,
+// and evdev types ctrl+shift+u and the code point in hex, which is what GTK, Qt and IBus take, and
+// doesn't need a clipboard (which evdev hasn't got, so pasting isn't a way around it).
+struct key_t {
+	u32 code;
+	u32 flags;
+};
+
+#define KEY_UP      (0x01)
+#define KEY_UNICODE (0x02)
+
+// NOTE (brian): the keys we press ourselves, besides what's in a macro
+struct keys_t {
+	u16 shift;
+	u16 control;
+	u16 enter;
+	u16 chat;  // opens the chat box
+	u16 paste; // pastes, with control
+};
+
+// NOTE (brian): What the layout says for the first 256 code points (ascii and Latin-1), the same
+// way VkKeyScan says it: the key's code in the low byte, and the modifiers it needs in the high one
+// (0x01 shift, 0x02 ctrl, 0x04 alt), or -1 if the layout hasn't got it.
+//
+// 'layout' is the backend's id for the layout, and no two backends ever hand out the same ones,
+// so anything compiled for one never gets mistaken for another's.
+struct keymap_t {
+	u64 layout;
+	s32 built;
+	s16 keys[256];
+	struct keys_t named;
+};
+
+// what backend_t::next hands back
+enum {
+	SYS_QUIT,
+	SYS_HOTKEY,
+	SYS_SAID,
+	SYS_TIMEOUT,
+	SYS_READY
+};
+
+// NOTE (brian): What a hook (see backend_t::hook) asks about every key that goes down, with the
+// modifiers that are down with it, as hotkey modifiers. It says HOOK_PASS for keys that aren't a
+// hotkey, and they go on to everyone else. Anything else gets eaten, and if it's a hotkey's id,
+// next hands that back as a SYS_HOTKEY. HOOK_EAT is for hotkeys that shouldn't go off, like a
+// MOD_NOREPEAT one repeating. A key that gets eaten going down gets eaten coming up too.
+typedef s32 (*hook_func)(u32 mods, u32 vk, s32 repeat);
+
+enum {
+	HOOK_PASS = -1,
+	HOOK_EAT = -2
+};
+
+// NOTE (brian): Where hotkeys come from, and where keys go. The main thread opens it, binds the
+// hotkeys, and sits in 'next', everything but 'send' and the clip functions happen on that thread.
+// 'post' can be called from anywhere, and wakes up 'next'. 'next' gives up with SYS_TIMEOUT once
+// sys_time() gets to 'until', or never if it's 0. It waits in sys_loop_wait, so anything that's
+// been added to the loop wakes it too, and it hands back SYS_READY, with the tag as the 'id'.
+// 'clip_swap' and 'clip_restore' can be NULL, if the backend can't paste. 'opts' is whatever came
+// after the backend's name in --backend, or NULL, and what it means is up to the backend.
+//
+// Hotkeys either get bound one at a time, or the backend hooks the whole keyboard, and asks
+// 'filter' about every key instead (from any thread), and then 'bind' isn't used at all. 'hook' is
+// NULL if the backend can't, and the hook comes off when it's closed.
+struct backend_t {
+	char *name;
+	s32 (*open)(char *opts);
+	void (*close)();
+	s32 (*bind)(s32 id, u32 mods, u32 vk, s32 on);
+	s32 (*hook)(hook_func filter);
+	s32 (*next)(s32 *id, f64 until);
+	void (*post)(s32 msg);
+	u64 (*layout)();
+	void (*keymap)(u64 layout, struct keymap_t *keymap);
+	u32 (*send)(struct key_t *keys, u32 n);
+	void *(*clip_swap)(char *text, size_t len);
+	void (*clip_restore)(void *saved);
+};
+
+#if defined(_WIN32)
+extern struct backend_t backend_win32;
+#else
+extern struct backend_t backend_x11;
+extern struct backend_t backend_evdev;
+#endif
+extern struct backend_t backend_record;
+
+// NOTE (brian): Win32's hotkey modifiers, and the virtual keys hotkeys can be on (see
+// backend_t::bind). These are the same as windows.h has, for everyone that doesn't include it.
+#if !defined(VK_NUMPAD0)
+#define MOD_ALT      (0x0001)
+#define MOD_CONTROL  (0x0002)
+#define MOD_SHIFT    (0x0004)
+#define MOD_WIN      (0x0008)
+#define MOD_NOREPEAT (0x4000)
+
+#define VK_BACK      (0x08)
+#define VK_TAB       (0x09)
+#define VK_RETURN    (0x0D)
+#define VK_PAUSE     (0x13)
+#define VK_ESCAPE    (0x1B)
+#define VK_SPACE     (0x20)
+#define VK_PRIOR     (0x21)
+#define VK_NEXT      (0x22)
+#define VK_END       (0x23)
+#define VK_HOME      (0x24)
+#define VK_LEFT      (0x25)
+#define VK_UP        (0x26)
+#define VK_RIGHT     (0x27)
+#define VK_DOWN      (0x28)
+#define VK_INSERT    (0x2D)
+#define VK_DELETE    (0x2E)
+#define VK_NUMPAD0   (0x60)
+#define VK_NUMPAD1   (0x61)
+#define VK_NUMPAD2   (0x62)
+#define VK_NUMPAD3   (0x63)
+#define VK_NUMPAD4   (0x64)
+#define VK_NUMPAD5   (0x65)
+#define VK_NUMPAD6   (0x66)
+#define VK_NUMPAD7   (0x67)
+#define VK_NUMPAD8   (0x68)
+#define VK_NUMPAD9   (0x69)
+#define VK_MULTIPLY  (0x6A)
+#define VK_ADD       (0x6B)
+#define VK_SUBTRACT  (0x6D)
+#define VK_DECIMAL   (0x6E)
+#define VK_DIVIDE    (0x6F)
+#define VK_F1        (0x70) // through VK_F12
+#define VK_F12       (0x7B)
+#endif
+
+/* sys_lasterror : prints the last error the OS had for us */
+void sys_lasterror();
+/* sys_mapfile : maps an entire file into memory, read only */
+char *sys_mapfile(char *path, size_t *len);
+/* sys_unmapfile : unmaps a file mapped with sys_mapfile */
+void sys_unmapfile(char *p, size_t len);
+/* sys_filestat : gets the file's size and last modified time, returns -1 if it isn't there */
+s32 sys_filestat(char *path, u64 *size, u64 *mtime);
+/* sys_replace : moves 'from' over the top of 'to', returns -1 if it couldn't */
+s32 sys_replace(char *from, char *to);
+/* sys_time : seconds since some point in the past, for timing things */
+f64 sys_time();
+/* sys_cores : returns how many cores we've got to work with */
+s32 sys_cores();
+
+/* sys_thread : runs func(arg) on a new thread, returns NULL if it couldn't */
+struct sys_thread_t *sys_thread(s32 (*func)(void *arg), void *arg);
+/* sys_join : waits for the thread to finish, and frees it */
+void sys_join(struct sys_thread_t *thread);
+
+/* sys_event : makes an event, that stays set until it's reset if 'manual', or until it's waited on */
+struct sys_event_t *sys_event(s32 manual);
+/* sys_event_free : frees an event */
+void sys_event_free(struct sys_event_t *event);
+/* sys_event_set : sets the event */
+void sys_event_set(struct sys_event_t *event);
+/* sys_event_reset : resets the event */
+void sys_event_reset(struct sys_event_t *event);
+/* sys_event_wait : waits for the event until sys_time() gets to 'until' (0 forever), returns 1 if it was set */
+s32 sys_event_wait(struct sys_event_t *event, f64 until);
+
+/* sys_dirwatch : starts watching the directory for changes to the files in it */
+struct sys_dirwatch_t *sys_dirwatch(char *dname);
+/* sys_dirwatch_read : returns 1 if the directory's changed since it was last read, without waiting, -1 on errors */
+s32 sys_dirwatch_read(struct sys_dirwatch_t *watch);
+/* sys_dirwatch_free : stops watching the directory */
+void sys_dirwatch_free(struct sys_dirwatch_t *watch);
+
+/* sys_ipc : listens for commands at 'name' (see sys_ipc_read), returns NULL if it couldn't */
+struct sys_ipc_t *sys_ipc(char *name);
+/* sys_ipc_read : reads the next command that's come in, without waiting, returns its length, 0 if there isn't one */
+s32 sys_ipc_read(struct sys_ipc_t *ipc, char *buf, s32 len);
+/* sys_ipc_send : sends the command to whoever's listening at 'name', returns -1 if it couldn't */
+s32 sys_ipc_send(char *name, char *buf, s32 len);
+/* sys_ipc_free : stops listening */
+void sys_ipc_free(struct sys_ipc_t *ipc);
+
+// NOTE (brian): The main thread's one wait, that backend_t::next does for it. Everything the
+// program waits on is in here, the backend's own (its keyboards, its display, or the thread's
+// message queue on Windows), and whatever's been added with sys_loop_*, so nothing else needs a
+// thread of its own just to sit and wait. It's an epoll on Linux, and MsgWaitForMultipleObjectsEx
+// on Windows.
+//
+// The backends' tags are negative, and everyone else's are 0 and up. An event that isn't manual
+// gets reset when the loop sees it. Freeing anything that's in the loop takes it out.
+#define SYS_LOOP_MAX (32)
+
+/* sys_loop_event : has the loop wake up with 'tag' when the event's set */
+s32 sys_loop_event(struct sys_event_t *event, s32 tag);
+/* sys_loop_dirwatch : has the loop wake up with 'tag' when the directory changes (see sys_dirwatch_read) */
+s32 sys_loop_dirwatch(struct sys_dirwatch_t *watch, s32 tag);
+/* sys_loop_ipc : has the loop wake up with 'tag' when a command comes in (see sys_ipc_read) */
+s32 sys_loop_ipc(struct sys_ipc_t *ipc, s32 tag);
+/* sys_loop_wait : waits for something in the loop until sys_time() gets to 'until' (0 forever), returns 1 and its tag, 0 if it's 'until', -1 on errors */
+s32 sys_loop_wait(f64 until, s32 *tag);
+#if defined(_WIN32)
+#define SYS_LOOP_MESSAGES (-1) // the tag the thread's message queue wakes the loop with
+#else
+/* sys_loop_fd : has the loop wake up with 'tag' when the file's readable, for the backends, returns -1 for plain files, which can't be waited on */
+s32 sys_loop_fd(s32 fd, s32 tag);
+/* sys_loop_drop : takes the file out of the loop, before it's closed */
+void sys_loop_drop(s32 fd);
+#endif
+
+#endif // SYS_H
+
@@ -0,0 +1,816 @@
+/*
+ * evdev / uinput Backend
+ *
+ * Keys go out through a virtual keyboard made with /dev/uinput, and hotkeys come in straight from
+ * the keyboards' /dev/input/event* devices. All of that's underneath the display server, so it
+ * works the same on X11, on any Wayland compositor, and on a bare console, and there's nothing the
+ * compositor gets a say in. It needs to be able to read /dev/input, and write /dev/uinput (the
+ * "input" group, or a udev rule).
+ *
+ *   chatmacro --backend evdev macros.txt
+ *   chatmacro --backend evdev:grab macros.txt
+ *
+ * Without "grab", everyone else sees the hotkeys too, the same as they do with the other backends.
+ * With it, the keyboards are ours alone (EVIOCGRAB), and every key that isn't a hotkey gets passed
+ * on through the virtual keyboard, so the game never sees the hotkeys at all. We see every key
+ * either way, so hooking (see backend_t::hook) is just asking the filter instead of the binds.
+ *
+ * Past opening the devices, all this does is read and write struct input_event, so the devices are
+ * behind evdev_dev_t, and "in=<path>,out=<path>" swaps them for a pair of files or FIFOs (see
+ * evdev_pipe). That's how this gets run without root, or a kernel with uinput:
+ *
+ *   mkfifo keys.in; chatmacro --backend evdev:in=keys.in,out=keys.out macros.txt
+ *
+ * The kernel has no idea about keyboard layouts, the compositor does, so the keymap's always US,
+ * and anything that hasn't got gets typed as ctrl+shift+u and its hex code (see evdev_put).
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+// NOTE (brian): the kernel's KEY_UP is the arrow key, and ours (sys.h) is a key going up
+enum { EVDEV_KEY_UP = KEY_UP };
+#undef KEY_UP
+
+#include "sys.h"
+
+#define EVDEV_LAYOUT    (0x455644ULL << 32) // "EVD", or'd into the layout ids, so they're never anyone else's
+#define EVDEV_NAME      ("chatmacro")
+#define EVDEV_BINDS     (1024)
+#define EVDEV_DEVICES   (16) // how many keyboards we'll read hotkeys from
+#define EVDEV_SCAN      (64) // looks at /dev/input/event0 up to this
+#define EVDEV_SETTLE_MS (1000) // how long a grab waits for the keys held at startup to come up
+#define SEND_STACK      (256)
+
+// the loop's tags (see sys_loop_wait) for the wake pipe, and for each of the keyboards
+#define EVDEV_TAG_WAKE   (-1)
+#define EVDEV_TAG_IN(i)  (-2 - (i))
+
+// NOTE (brian): The devices, either the real ones, or a pair of files. 'open' fills in evdev.in
+// and evdev.out, and everything else only ever reads and writes input_events on those.
+struct evdev_dev_t {
+	char *name;
+	s32 (*open)();
+	void (*close)();
+};
+
+struct evdev_bind_t {
+	s32 id;
+	u16 code;
+	u32 mods; // Win32's, without MOD_NOREPEAT
+	s32 norepeat;
+};
+
+// NOTE (brian): The keys a US layout has, without and with shift. Also where the letters and digits
+// of the virtual keys come from.
+static struct {
+	u16 code;
+	char lo, hi;
+} evdev_us[] = {
+	  { KEY_1, '1', '!' }, { KEY_2, '2', '@' }, { KEY_3, '3', '#' }, { KEY_4, '4', '$' }
+	, { KEY_5, '5', '%' }, { KEY_6, '6', '^' }, { KEY_7, '7', '&' }, { KEY_8, '8', '*' }
+	, { KEY_9, '9', '(' }, { KEY_0, '0', ')' }, { KEY_MINUS, '-', '_' }, { KEY_EQUAL, '=', '+' }
+	, { KEY_Q, 'q', 'Q' }, { KEY_W, 'w', 'W' }, { KEY_E, 'e', 'E' }, { KEY_R, 'r', 'R' }
+	, { KEY_T, 't', 'T' }, { KEY_Y, 'y', 'Y' }, { KEY_U, 'u', 'U' }, { KEY_I, 'i', 'I' }
+	, { KEY_O, 'o', 'O' }, { KEY_P, 'p', 'P' }, { KEY_LEFTBRACE, '[', '{' }, { KEY_RIGHTBRACE, ']', '}' }
+	, { KEY_A, 'a', 'A' }, { KEY_S, 's', 'S' }, { KEY_D, 'd', 'D' }, { KEY_F, 'f', 'F' }
+	, { KEY_G, 'g', 'G' }, { KEY_H, 'h', 'H' }, { KEY_J, 'j', 'J' }, { KEY_K, 'k', 'K' }
+	, { KEY_L, 'l', 'L' }, { KEY_SEMICOLON, ';', ':' }, { KEY_APOSTROPHE, '\'', '"' }, { KEY_GRAVE, '`', '~' }
+	, { KEY_BACKSLASH, '\\', '|' }, { KEY_Z, 'z', 'Z' }, { KEY_X, 'x', 'X' }, { KEY_C, 'c', 'C' }
+	, { KEY_V, 'v', 'V' }, { KEY_B, 'b', 'B' }, { KEY_N, 'n', 'N' }, { KEY_M, 'm', 'M' }
+	, { KEY_COMMA, ',', '<' }, { KEY_DOT, '.', '>' }, { KEY_SLASH, '/', '?' }, { KEY_SPACE, ' ', 0 }
+};
+
+// NOTE (brian): The rest of the virtual keys in sys.h, as the kernel's keys. The keypad's keys are
+// the same whether num lock's on or not, down here.
+static struct {
+	u32 vk;
+	u16 code;
+} evdev_vks[] = {
+	  { VK_BACK, KEY_BACKSPACE }, { VK_TAB, KEY_TAB }, { VK_RETURN, KEY_ENTER }, { VK_PAUSE, KEY_PAUSE }
+	, { VK_ESCAPE, KEY_ESC }, { VK_SPACE, KEY_SPACE }, { VK_PRIOR, KEY_PAGEUP }, { VK_NEXT, KEY_PAGEDOWN }
+	, { VK_END, KEY_END }, { VK_HOME, KEY_HOME }, { VK_LEFT, KEY_LEFT }, { VK_UP, EVDEV_KEY_UP }
+	, { VK_RIGHT, KEY_RIGHT }, { VK_DOWN, KEY_DOWN }, { VK_INSERT, KEY_INSERT }, { VK_DELETE, KEY_DELETE }
+	, { VK_NUMPAD0, KEY_KP0 }, { VK_NUMPAD1, KEY_KP1 }, { VK_NUMPAD2, KEY_KP2 }, { VK_NUMPAD3, KEY_KP3 }
+	, { VK_NUMPAD4, KEY_KP4 }, { VK_NUMPAD5, KEY_KP5 }, { VK_NUMPAD6, KEY_KP6 }, { VK_NUMPAD7, KEY_KP7 }
+	, { VK_NUMPAD8, KEY_KP8 }, { VK_NUMPAD9, KEY_KP9 }, { VK_MULTIPLY, KEY_KPASTERISK }
+	, { VK_ADD, KEY_KPPLUS }, { VK_SUBTRACT, KEY_KPMINUS }, { VK_DECIMAL, KEY_KPDOT }
+	, { VK_DIVIDE, KEY_KPSLASH }, { VK_F1 + 10, KEY_F11 }, { VK_F12, KEY_F12 }
+};
+
+// NOTE (brian): 'mods' is every modifier that's down, on any of the keyboards. 'swallowed' is the
+// hotkeys that went down while we had the keyboards grabbed, so their repeats and releases don't
+// get passed on either, even if the modifiers have changed since. 'plain' is when in= is a plain
+// file, which the loop can't wait on (see sys_loop_fd), so it's read without waiting, until it
+// runs out.
+static struct {
+	struct evdev_dev_t *dev;
+	char opts[BUFLARGE];
+	char *in_path;
+	char *out_path;
+	s32 grab;
+	s32 in[EVDEV_DEVICES];
+	s32 in_len;
+	s32 plain;
+	s32 out;
+	s32 wake[2];
+	struct evdev_bind_t binds[EVDEV_BINDS];
+	s32 binds_len;
+	u32 mods;
+	u8 swallowed[KEY_CNT];
+	u8 vks[KEY_CNT]; // the virtual key for each key, for the filter
+	hook_func filter;
+} evdev;
+
+/* evdev_open : opens the devices, "grab", "in=<path>" and "out=<path>" can be in 'opts' */
+static s32 evdev_open(char *opts);
+/* evdev_close : lets go of the devices */
+static void evdev_close();
+/* evdev_bind : turns the hotkey on (or off) */
+static s32 evdev_bind(s32 id, u32 mods, u32 vk, s32 on);
+/* evdev_hook : has every key go through the filter, instead of the binds */
+static s32 evdev_hook(hook_func filter);
+/* evdev_next : waits for the next hotkey or posted message, or until 'until' */
+static s32 evdev_next(s32 *id, f64 until);
+/* evdev_post : wakes up evdev_next with the message */
+static void evdev_post(s32 msg);
+/* evdev_layout : there's only the one */
+static u64 evdev_layout();
+/* evdev_keymap : fills in the keymap, which is always US */
+static void evdev_keymap(u64 layout, struct keymap_t *keymap);
+/* evdev_send : writes the keys to the virtual keyboard, returns how many of them went in */
+static u32 evdev_send(struct key_t *keys, u32 n);
+/* evdev_put : adds the key's events at events[len] (if we have a buffer), returns the new length */
+static u32 evdev_put(struct input_event *events, u32 len, struct key_t *key);
+/* evdev_push : adds a key and its SYN_REPORT at events[len] (if we have a buffer), returns the new length */
+static u32 evdev_push(struct input_event *events, u32 len, u16 code, s32 down);
+/* evdev_key : handles an event from a keyboard, returns the hotkey's id if it's one, -1 if it isn't */
+static s32 evdev_key(struct input_event *event);
+/* evdev_match : says what the key going down is, a hotkey's id, HOOK_PASS or HOOK_EAT (see hook_func) */
+static s32 evdev_match(u16 code, s32 repeat);
+/* evdev_code : returns the key for the virtual key, 0 if there isn't one */
+static u16 evdev_code(u32 vk);
+/* evdev_forward : passes the event on to the virtual keyboard, if we've got the keyboards grabbed */
+static void evdev_forward(struct input_event *event);
+
+/* evdev_kernel_open : makes the virtual keyboard, and opens (and maybe grabs) the real ones */
+static s32 evdev_kernel_open();
+/* evdev_kernel_close : destroys the virtual keyboard, and lets go of the real ones */
+static void evdev_kernel_close();
+/* evdev_keyboard : returns true if the device is a keyboard, and isn't ours */
+static s32 evdev_keyboard(s32 fd);
+/* evdev_settle : waits (for a bit) until none of the keyboards have a key down */
+static void evdev_settle();
+
+/* evdev_pipe_open : opens the files that stand in for the devices */
+static s32 evdev_pipe_open();
+/* evdev_pipe_close : closes them */
+static void evdev_pipe_close();
+
+static struct evdev_dev_t evdev_kernel = {
+	"kernel",
+	evdev_kernel_open,
+	evdev_kernel_close
+};
+
+static struct evdev_dev_t evdev_pipe = {
+	"pipe",
+	evdev_pipe_open,
+	evdev_pipe_close
+};
+
+struct backend_t backend_evdev = {
+	"evdev",
+	evdev_open,
+	evdev_close,
+	evdev_bind,
+	evdev_hook,
+	evdev_next,
+	evdev_post,
+	evdev_layout,
+	evdev_keymap,
+	evdev_send,
+	NULL,
+	NULL
+};
+
+/* evdev_open : opens the devices, "grab", "in=<path>" and "out=<path>" can be in 'opts' */
+static s32 evdev_open(char *opts)
+{
+	char *s, *save;
+	s32 i;
+
+	memset(&evdev, 0, sizeof evdev);
+
+	evdev.out = -1;
+	for (i = 0; i < ARRSIZE(evdev.in); i++)
+		evdev.in[i] = -1;
+
+	snprintf(evdev.opts, sizeof evdev.opts, "%s", opts ? opts : "");
+
+	for (s = strtok_r(evdev.opts, ",", &save); s; s = strtok_r(NULL, ",", &save)) {
+		if (streq(s, "grab")) {
+			evdev.grab = 1;
+		} else if (strncmp(s, "in=", 3) == 0) {
+			evdev.in_path = s + 3;
+		} else if (strncmp(s, "out=", 4) == 0) {
+			evdev.out_path = s + 4;
+		} else {
+			ERR("Unknown evdev option '%s' (there's grab, in=<path> and out=<path>)\n", s);
+			return -1;
+		}
+	}
+
+	evdev.dev = &evdev_kernel;
+
+	if (evdev.in_path || evdev.out_path) {
+		if (!evdev.in_path || !evdev.out_path) {
+			ERR("The evdev backend needs both of in=<path> and out=<path>, or neither\n");
+			return -1;
+		}
+		evdev.dev = &evdev_pipe;
+	}
+
+	if (pipe2(evdev.wake, O_NONBLOCK | O_CLOEXEC) < 0) {
+		sys_lasterror();
+		return -1;
+	}
+
+	if (evdev.dev->open() < 0) {
+		close(evdev.wake[0]);
+		close(evdev.wake[1]);
+		return -1;
+	}
+
+	if (sys_loop_fd(evdev.wake[0], EVDEV_TAG_WAKE) < 0) {
+		evdev_close();
+		return -1;
+	}
+
+	for (i = 0; i < evdev.in_len; i++) {
+		if (!evdev.plain && sys_loop_fd(evdev.in[i], EVDEV_TAG_IN(i)) < 0) {
+			evdev_close();
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* evdev_close : lets go of the devices */
+static void evdev_close()
+{
+	s32 i;
+
+	if (!evdev.dev)
+		return;
+
+	for (i = 0; i < evdev.in_len; i++) {
+		if (evdev.in[i] >= 0)
+			sys_loop_drop(evdev.in[i]);
+	}
+	sys_loop_drop(evdev.wake[0]);
+
+	evdev.dev->close();
+
+	close(evdev.wake[0]);
+	close(evdev.wake[1]);
+
+	memset(&evdev, 0, sizeof evdev);
+}
+
+/* evdev_bind : turns the hotkey on (or off) */
+static s32 evdev_bind(s32 id, u32 mods, u32 vk, s32 on)
+{
+	struct evdev_bind_t *bind;
+	u16 code;
+	s32 i;
+
+	// NOTE (brian): There's nothing to ask the OS for, the keyboards are ours to read either way,
+	// so a hotkey's just something evdev_key looks for.
+
+	if (!on) {
+		for (i = 0; i < evdev.binds_len && evdev.binds[i].id != id; i++)
+			;
+		if (i == evdev.binds_len)
+			return -1;
+
+		evdev.binds[i] = evdev.binds[--evdev.binds_len];
+
+		return 0;
+	}
+
+	if (evdev.binds_len == ARRSIZE(evdev.binds)) {
+		ERR("Only %d hotkeys can be on at once\n", EVDEV_BINDS);
+		return -1;
+	}
+
+	code = evdev_code(vk);
+	if (!code) {
+		ERR("There's no key for virtual key 0x%02x\n", vk);
+		return -1;
+	}
+
+	bind = evdev.binds + evdev.binds_len++;
+
+	bind->id = id;
+	bind->code = code;
+	bind->mods = mods & (MOD_ALT | MOD_CONTROL | MOD_SHIFT | MOD_WIN);
+	bind->norepeat = !!(mods & MOD_NOREPEAT);
+
+	return 0;
+}
+
+/* evdev_hook : has every key go through the filter, instead of the binds */
+static s32 evdev_hook(hook_func filter)
+{
+	u32 vk;
+	u16 code;
+
+	// the other way around from evdev_code, so the filter's asked with just a lookup
+	for (vk = 1; vk < 0x100; vk++) {
+		code = evdev_code(vk);
+		if (code && !evdev.vks[code])
+			evdev.vks[code] = vk;
+	}
+
+	evdev.filter = filter;
+
+	return 0;
+}
+
+/* evdev_code : returns the key for the virtual key, 0 if there isn't one */
+static u16 evdev_code(u32 vk)
+{
+	s32 i;
+
+	if (('0' <= vk && vk <= '9') || ('A' <= vk && vk <= 'Z')) {
+		for (i = 0; i < ARRSIZE(evdev_us); i++) {
+			if (evdev_us[i].lo == tolower(vk))
+				return evdev_us[i].code;
+		}
+	} else if (VK_F1 <= vk && vk < VK_F1 + 10) {
+		return KEY_F1 + (vk - VK_F1);
+	} else {
+		for (i = 0; i < ARRSIZE(evdev_vks); i++) {
+			if (evdev_vks[i].vk == vk)
+				return evdev_vks[i].code;
+		}
+	}
+
+	return 0;
+}
+
+/* evdev_next : waits for the next hotkey or posted message, or until 'until' */
+static s32 evdev_next(s32 *id, f64 until)
+{
+	struct input_event event;
+	ssize_t rc;
+	s32 msg, i, j, left, tag;
+
+	// NOTE (brian): Events get read one at a time, so when one's a hotkey, the rest are still
+	// sitting in the device for the next call. Keyboards don't make enough of them to matter.
+
+	for (;;) {
+		if (read(evdev.wake[0], &msg, sizeof msg) == sizeof msg)
+			return msg;
+
+		if (evdev.plain && evdev.in[0] >= 0) {
+			if (until != 0 && until <= sys_time())
+				return SYS_TIMEOUT;
+			i = 0;
+		} else {
+			rc = sys_loop_wait(until, &tag);
+			if (rc < 0)
+				return SYS_QUIT;
+			if (rc == 0)
+				return SYS_TIMEOUT;
+
+			if (0 <= tag) {
+				*id = tag;
+				return SYS_READY;
+			}
+
+			// the wake pipe gets read at the top
+			i = EVDEV_TAG_IN(0) - tag;
+			if (tag == EVDEV_TAG_WAKE || evdev.in[i] < 0)
+				continue;
+		}
+
+		while ((rc = read(evdev.in[i], &event, sizeof event)) == sizeof event) {
+			*id = evdev_key(&event);
+			if (*id >= 0)
+				return SYS_HOTKEY;
+		}
+
+		if (rc < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+
+		// it's been unplugged (ENODEV), or the file's run out, either way there's no more
+		sys_loop_drop(evdev.in[i]);
+		close(evdev.in[i]);
+		evdev.in[i] = -1;
+
+		for (j = 0, left = 0; j < evdev.in_len; j++)
+			left += evdev.in[j] >= 0;
+
+		WRN("Lost a keyboard, %d left\n", left);
+	}
+}
+
+/* evdev_key : handles an event from a keyboard, returns the hotkey's id if it's one, -1 if it isn't */
+static s32 evdev_key(struct input_event *event)
+{
+	u32 mod;
+	s32 rc;
+
+	if (event->type != EV_KEY || KEY_CNT <= event->code) {
+		evdev_forward(event);
+		return -1;
+	}
+
+	switch (event->code) {
+	case KEY_LEFTSHIFT: case KEY_RIGHTSHIFT: mod = MOD_SHIFT; break;
+	case KEY_LEFTCTRL: case KEY_RIGHTCTRL: mod = MOD_CONTROL; break;
+	case KEY_LEFTALT: case KEY_RIGHTALT: mod = MOD_ALT; break;
+	case KEY_LEFTMETA: case KEY_RIGHTMETA: mod = MOD_WIN; break;
+	default: mod = 0; break;
+	}
+
+	if (mod) {
+		evdev.mods = event->value ? evdev.mods | mod : evdev.mods & ~mod;
+		evdev_forward(event);
+		return -1;
+	}
+
+	// value's 0 for a release, 1 for a press, and 2 for a repeat
+	rc = event->value == 0 ? HOOK_PASS : evdev_match(event->code, event->value == 2);
+
+	if (evdev.swallowed[event->code]) {
+		if (event->value == 0)
+			evdev.swallowed[event->code] = 0;
+		return rc >= 0 ? rc : -1;
+	}
+
+	if (rc == HOOK_PASS) {
+		evdev_forward(event);
+		return -1;
+	}
+
+	evdev.swallowed[event->code] = evdev.grab;
+
+	return rc >= 0 ? rc : -1;
+}
+
+/* evdev_match : says what the key going down is, a hotkey's id, HOOK_PASS or HOOK_EAT (see hook_func) */
+static s32 evdev_match(u16 code, s32 repeat)
+{
+	struct evdev_bind_t *bind;
+	s32 i;
+
+	if (evdev.filter)
+		return evdev.vks[code] ? evdev.filter(evdev.mods, evdev.vks[code], repeat) : HOOK_PASS;
+
+	for (i = 0, bind = NULL; i < evdev.binds_len; i++) {
+		if (evdev.binds[i].code == code && evdev.binds[i].mods == evdev.mods)
+			bind = evdev.binds + i;
+	}
+
+	if (!bind)
+		return HOOK_PASS;
+
+	return repeat && bind->norepeat ? HOOK_EAT : bind->id;
+}
+
+/* evdev_forward : passes the event on to the virtual keyboard, if we've got the keyboards grabbed */
+static void evdev_forward(struct input_event *event)
+{
+	// the virtual keyboard only has keys, so that's all that's worth passing on
+	if (!evdev.grab || (event->type != EV_KEY && event->type != EV_SYN))
+		return;
+
+	if (write(evdev.out, event, sizeof *event) < 0)
+		sys_lasterror();
+}
+
+/* evdev_post : wakes up evdev_next with the message */
+static void evdev_post(s32 msg)
+{
+	// a write this small to a pipe is all or nothing, so messages never get mixed up
+	if (write(evdev.wake[1], &msg, sizeof msg) < 0)
+		sys_lasterror();
+}
+
+/* evdev_layout : there's only the one */
+static u64 evdev_layout()
+{
+	return EVDEV_LAYOUT;
+}
+
+/* evdev_keymap : fills in the keymap, which is always US */
+static void evdev_keymap(u64 layout, struct keymap_t *keymap)
+{
+	s32 i;
+
+	for (i = 0; i < ARRSIZE(keymap->keys); i++)
+		keymap->keys[i] = -1;
+
+	for (i = 0; i < ARRSIZE(evdev_us); i++) {
+		keymap->keys[(u8)evdev_us[i].lo] = evdev_us[i].code;
+		if (evdev_us[i].hi)
+			keymap->keys[(u8)evdev_us[i].hi] = 0x100 | evdev_us[i].code;
+	}
+
+	keymap->named.shift = KEY_LEFTSHIFT;
+	keymap->named.control = KEY_LEFTCTRL;
+	keymap->named.enter = KEY_ENTER;
+	keymap->named.chat = KEY_T;
+	keymap->named.paste = KEY_V;
+}
+
+/* evdev_send : writes the keys to the virtual keyboard, returns how many of them went in */
+static u32 evdev_send(struct key_t *keys, u32 n)
+{
+	struct input_event stack[SEND_STACK], *events;
+	ssize_t rc;
+	u32 len, done, need, i;
+
+	// NOTE (brian): Every key's followed by a SYN_REPORT, so whoever's reading sees them one at a
+	// time, the way a keyboard sends them, and they all go in with the one write. Code points
+	// without a key get typed as a whole run of keys (see evdev_put), so they all get counted up
+	// first.
+
+	for (i = 0, len = 0; i < n; i++)
+		len = evdev_put(NULL, len, keys + i);
+
+	events = len <= ARRSIZE(stack) ? stack : malloc(len * sizeof(*events));
+	if (!events) {
+		ERR("Couldn't allocate %u events to send\n", len);
+		return 0;
+	}
+
+	for (i = 0, len = 0; i < n; i++)
+		len = evdev_put(events, len, keys + i);
+
+	rc = len ? write(evdev.out, events, len * sizeof(*events)) : 0;
+	if (rc < 0) {
+		sys_lasterror();
+		rc = 0;
+	}
+
+	if (events != stack)
+		free(events);
+
+	// a key only went in if all of its events did
+	for (i = 0, done = rc / sizeof(*events); i < n; i++) {
+		need = evdev_put(NULL, 0, keys + i);
+		if (done < need)
+			break;
+		done -= need;
+	}
+
+	return i;
+}
+
+/* evdev_put : adds the key's events at events[len] (if we have a buffer), returns the new length */
+static u32 evdev_put(struct input_event *events, u32 len, struct key_t *key)
+{
+	static u16 hex[] = {
+		  KEY_0, KEY_1, KEY_2, KEY_3, KEY_4, KEY_5, KEY_6, KEY_7
+		, KEY_8, KEY_9, KEY_A, KEY_B, KEY_C, KEY_D, KEY_E, KEY_F
+	};
+	s32 shift;
+
+	if (!(key->flags & KEY_UNICODE))
+		return evdev_push(events, len, key->code, !(key->flags & KEY_UP));
+
+	// NOTE (brian): The kernel's only got keys, so a code point goes in the way you'd type it by
+	// hand: ctrl+shift+u, its hex digits, and space to finish it, which is what GTK, Qt and IBus
+	// all take. The plan's already let go of shift (see plan_char), so nothing's down before this.
+	// It all goes in with the key going down, and the key coming up is nothing.
+
+	if (key->flags & KEY_UP)
+		return len;
+
+	len = evdev_push(events, len, KEY_LEFTCTRL, 1);
+	len = evdev_push(events, len, KEY_LEFTSHIFT, 1);
+	len = evdev_push(events, len, KEY_U, 1);
+	len = evdev_push(events, len, KEY_U, 0);
+	len = evdev_push(events, len, KEY_LEFTSHIFT, 0);
+	len = evdev_push(events, len, KEY_LEFTCTRL, 0);
+
+	// the digits, without the leading zeros
+	for (shift = 28; shift > 0 && !(key->code >> shift); shift -= 4)
+		;
+
+	for (; shift >= 0; shift -= 4) {
+		len = evdev_push(events, len, hex[(key->code >> shift) & 0xf], 1);
+		len = evdev_push(events, len, hex[(key->code >> shift) & 0xf], 0);
+	}
+
+	len = evdev_push(events, len, KEY_SPACE, 1);
+	len = evdev_push(events, len, KEY_SPACE, 0);
+
+	return len;
+}
+
+/* evdev_push : adds a key and its SYN_REPORT at events[len] (if we have a buffer), returns the new length */
+static u32 evdev_push(struct input_event *events, u32 len, u16 code, s32 down)
+{
+	if (events) {
+		memset(events + len, 0, 2 * sizeof(*events));
+
+		events[len].type = EV_KEY;
+		events[len].code = code;
+		events[len].value = down;
+		events[len + 1].type = EV_SYN;
+		events[len + 1].code = SYN_REPORT;
+	}
+
+	return len + 2;
+}
+
+/* evdev_kernel_open : makes the virtual keyboard, and opens (and maybe grabs) the real ones */
+static s32 evdev_kernel_open()
+{
+	struct uinput_setup setup;
+	char path[BUFSMALL];
+	s32 fd, i;
+
+	evdev.out = open("/dev/uinput", O_WRONLY | O_CLOEXEC);
+	if (evdev.out < 0) {
+		ERR("Couldn't open /dev/uinput: %s\n", strerror(errno));
+		return -1;
+	}
+
+	// NOTE (brian): The virtual keyboard has every key a keyboard could, so anything that gets
+	// passed on through it goes in. Not the buttons, though, or it looks like a mouse or a joystick.
+
+	ioctl(evdev.out, UI_SET_EVBIT, EV_KEY);
+	for (i = 1; i < KEY_CNT; i++) {
+		if (i < BTN_MISC || KEY_OK <= i)
+			ioctl(evdev.out, UI_SET_KEYBIT, i);
+	}
+
+	memset(&setup, 0, sizeof setup);
+	setup.id.bustype = BUS_VIRTUAL;
+	snprintf(setup.name, sizeof setup.name, "%s", EVDEV_NAME);
+
+	if (ioctl(evdev.out, UI_DEV_SETUP, &setup) < 0 || ioctl(evdev.out, UI_DEV_CREATE) < 0) {
+		ERR("Couldn't make the virtual keyboard: %s\n", strerror(errno));
+		close(evdev.out);
+		return -1;
+	}
+
+	for (i = 0; i < EVDEV_SCAN && evdev.in_len < EVDEV_DEVICES; i++) {
+		snprintf(path, sizeof path, "/dev/input/event%d", i);
+
+		fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		if (!evdev_keyboard(fd)) {
+			close(fd);
+			continue;
+		}
+
+		evdev.in[evdev.in_len++] = fd;
+	}
+
+	if (!evdev.in_len) {
+		ERR("There aren't any keyboards in /dev/input we can read\n");
+		evdev_kernel_close();
+		return -1;
+	}
+
+	if (!evdev.grab)
+		return 0;
+
+	// NOTE (brian): Whatever's down when we grab never gets its release to anyone else, and
+	// stays stuck down for them, like the enter that started us.
+	evdev_settle();
+
+	for (i = 0; i < evdev.in_len; i++) {
+		if (ioctl(evdev.in[i], EVIOCGRAB, 1) < 0) {
+			ERR("Couldn't grab a keyboard, something else has it: %s\n", strerror(errno));
+			evdev_kernel_close();
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* evdev_kernel_close : destroys the virtual keyboard, and lets go of the real ones */
+static void evdev_kernel_close()
+{
+	s32 i;
+
+	// the grabs go with the files, and anything the virtual keyboard has down comes up when it's destroyed
+	for (i = 0; i < evdev.in_len; i++) {
+		if (evdev.in[i] >= 0)
+			close(evdev.in[i]);
+		evdev.in[i] = -1;
+	}
+
+	evdev.in_len = 0;
+
+	if (evdev.out >= 0) {
+		ioctl(evdev.out, UI_DEV_DESTROY);
+		close(evdev.out);
+		evdev.out = -1;
+	}
+}
+
+/* evdev_keyboard : returns true if the device is a keyboard, and isn't ours */
+static s32 evdev_keyboard(s32 fd)
+{
+	u8 bits[KEY_CNT / 8];
+	char name[BUFSMALL];
+
+	memset(name, 0, sizeof name);
+	if (ioctl(fd, EVIOCGNAME(sizeof name - 1), name) >= 0 && streq(name, EVDEV_NAME))
+		return 0;
+
+	memset(bits, 0, sizeof bits);
+	if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof bits), bits) < 0)
+		return 0;
+
+#define EVDEV_HAS(code) (bits[(code) / 8] & (1 << ((code) % 8)))
+
+	// a keyboard, or just a keypad, but not a mouse with a couple of extra buttons
+	return (EVDEV_HAS(KEY_A) && EVDEV_HAS(KEY_ENTER)) || EVDEV_HAS(KEY_KP0);
+
+#undef EVDEV_HAS
+}
+
+/* evdev_settle : waits (for a bit) until none of the keyboards have a key down */
+static void evdev_settle()
+{
+	u8 bits[KEY_CNT / 8];
+	f64 until;
+	s32 i, j, down;
+
+	until = sys_time() + EVDEV_SETTLE_MS / 1000.0;
+
+	do {
+		for (i = 0, down = 0; i < evdev.in_len && !down; i++) {
+			memset(bits, 0, sizeof bits);
+			if (ioctl(evdev.in[i], EVIOCGKEY(sizeof bits), bits) < 0)
+				continue;
+			for (j = 0; j < sizeof bits && !down; j++)
+				down = bits[j] != 0;
+		}
+
+		if (!down)
+			return;
+
+		sys_event_wait(NULL, sys_time() + 0.01);
+	} while (sys_time() < until);
+
+	WRN("Keys are still down, grabbing the keyboards anyway\n");
+}
+
+/* evdev_pipe_open : opens the files that stand in for the devices */
+static s32 evdev_pipe_open()
+{
+	struct stat st;
+
+	// NOTE (brian): A FIFO opened to read without blocking is fine without a writer yet, but one
+	// opened to write waits for a reader, so 'out' should be a plain file, or something has to be
+	// reading it already.
+
+	evdev.in[0] = open(evdev.in_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (evdev.in[0] < 0) {
+		ERR("Couldn't open '%s': %s\n", evdev.in_path, strerror(errno));
+		return -1;
+	}
+
+	evdev.in_len = 1;
+	evdev.plain = fstat(evdev.in[0], &st) == 0 && S_ISREG(st.st_mode);
+
+	evdev.out = open(evdev.out_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (evdev.out < 0) {
+		ERR("Couldn't open '%s': %s\n", evdev.out_path, strerror(errno));
+		close(evdev.in[0]);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* evdev_pipe_close : closes them */
+static void evdev_pipe_close()
+{
+	if (evdev.in[0] >= 0)
+		close(evdev.in[0]);
+	close(evdev.out);
+}
@@ -0,0 +1,707 @@
+/*
+ * POSIX Platform Layer
+ *
+ * The sys_* functions for Linux. The backends (sys_x11.c) are their own files, since which ones
+ * get built depends on what's installed.
+ *
+ * Commands come in over a datagram socket (see sys_ipc), one command a datagram, so there's no
+ * connections to keep track of, and anything can send one:
+ *
+ *   chatmacro --send say TrashTalk 2
+ *   echo "say TrashTalk 2" | socat - UNIX-SENDTO:$XDG_RUNTIME_DIR/chatmacro.sock
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "sys.h"
+
+struct sys_thread_t {
+	pthread_t handle;
+	s32 (*func)(void *arg);
+	void *arg;
+};
+
+// NOTE (brian): An event's an eventfd, so it can be polled along with anything else that's a file
+// (see sys_loop_wait). A manual event stays readable until it's reset. An automatic one gets
+// read by whoever's wait sees it, which resets it.
+struct sys_event_t {
+	s32 fd;
+	s32 manual;
+};
+
+struct sys_dirwatch_t {
+	s32 fd;
+	u64 buf[BUFLARGE / sizeof(u64)];
+};
+
+struct sys_ipc_t {
+	s32 fd;
+	struct sockaddr_un addr;
+};
+
+// NOTE (brian): What's in the loop, the epoll_events point at these. 'event' is so an event that
+// isn't manual can be reset when it's seen.
+struct sys_waiter_t {
+	s32 fd;
+	s32 tag;
+	struct sys_event_t *event;
+};
+
+static struct {
+	s32 epoll;
+	struct sys_waiter_t waiters[SYS_LOOP_MAX];
+	s32 len;
+} sys_loop;
+
+/* sys_thread_main : runs a sys_thread's function */
+static void *sys_thread_main(void *arg);
+/* sys_timespec : turns a number of seconds into a timespec */
+static struct timespec sys_timespec(f64 secs);
+/* sys_loop_open : makes the loop's epoll, the first time it's needed */
+static s32 sys_loop_open();
+/* sys_loop_add : puts the file in the loop, with the event it is, if it's one */
+static s32 sys_loop_add(s32 fd, s32 tag, struct sys_event_t *event);
+/* sys_ipc_addr : fills in the socket's address for the name, returns -1 if it's too long */
+static s32 sys_ipc_addr(char *name, struct sockaddr_un *addr);
+
+/* sys_lasterror : prints the last error the OS had for us */
+void sys_lasterror()
+{
+	ERR("%s\n", strerror(errno));
+}
+
+/* sys_mapfile : maps an entire file into memory, read only */
+char *sys_mapfile(char *path, size_t *len)
+{
+	struct stat st;
+	char *p;
+	s32 fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		sys_lasterror();
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		sys_lasterror();
+		close(fd);
+		return NULL;
+	}
+
+	// NOTE (brian): spans are 32 bit offsets into the mapping
+	if ((u64)st.st_size > UINT32_MAX) {
+		ERR("%s is too big to map (%lld bytes)\n", path, (s64)st.st_size);
+		close(fd);
+		return NULL;
+	}
+
+	// you can't map an empty file, but there's nothing in it to look at anyway
+	if (st.st_size == 0) {
+		close(fd);
+		*len = 0;
+		return "";
+	}
+
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		sys_lasterror();
+		p = NULL;
+	}
+
+	// the mapping keeps the file alive on its own
+	close(fd);
+
+	*len = p ? (size_t)st.st_size : 0;
+
+	return p;
+}
+
+/* sys_unmapfile : unmaps a file mapped with sys_mapfile */
+void sys_unmapfile(char *p, size_t len)
+{
+	if (p && len)
+		munmap(p, len);
+}
+
+/* sys_filestat : gets the file's size and last modified time, returns -1 if it isn't there */
+s32 sys_filestat(char *path, u64 *size, u64 *mtime)
+{
+	struct stat st;
+
+	if (stat(path, &st) < 0)
+		return -1;
+
+	*size = st.st_size;
+	*mtime = (u64)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+
+	return 0;
+}
+
+/* sys_replace : moves 'from' over the top of 'to', returns -1 if it couldn't */
+s32 sys_replace(char *from, char *to)
+{
+	if (rename(from, to) < 0) {
+		sys_lasterror();
+		return -1;
+	}
+
+	return 0;
+}
+
+/* sys_time : seconds since some point in the past, for timing things */
+f64 sys_time()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* sys_cores : returns how many cores we've got to work with */
+s32 sys_cores()
+{
+	long n;
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n > 0 ? n : 1;
+}
+
+/* sys_thread : runs func(arg) on a new thread, returns NULL if it couldn't */
+struct sys_thread_t *sys_thread(s32 (*func)(void *arg), void *arg)
+{
+	struct sys_thread_t *thread;
+	s32 rc;
+
+	thread = malloc(sizeof(*thread));
+	if (!thread)
+		return NULL;
+
+	thread->func = func;
+	thread->arg = arg;
+
+	rc = pthread_create(&thread->handle, NULL, sys_thread_main, thread);
+	if (rc) {
+		errno = rc;
+		sys_lasterror();
+		free(thread);
+		return NULL;
+	}
+
+	return thread;
+}
+
+/* sys_thread_main : runs a sys_thread's function */
+static void *sys_thread_main(void *arg)
+{
+	struct sys_thread_t *thread;
+
+	thread = arg;
+	thread->func(thread->arg);
+
+	return NULL;
+}
+
+/* sys_join : waits for the thread to finish, and frees it */
+void sys_join(struct sys_thread_t *thread)
+{
+	if (!thread)
+		return;
+
+	pthread_join(thread->handle, NULL);
+
+	free(thread);
+}
+
+/* sys_event : makes an event, that stays set until it's reset if 'manual', or until it's waited on */
+struct sys_event_t *sys_event(s32 manual)
+{
+	struct sys_event_t *event;
+
+	event = malloc(sizeof(*event));
+	if (!event)
+		return NULL;
+
+	event->manual = manual;
+
+	event->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (event->fd < 0) {
+		sys_lasterror();
+		free(event);
+		return NULL;
+	}
+
+	return event;
+}
+
+/* sys_event_free : frees an event */
+void sys_event_free(struct sys_event_t *event)
+{
+	if (!event)
+		return;
+
+	sys_loop_drop(event->fd);
+	close(event->fd);
+	free(event);
+}
+
+/* sys_event_set : sets the event */
+void sys_event_set(struct sys_event_t *event)
+{
+	u64 one;
+
+	one = 1;
+
+	// it only ever fails if the count's about to overflow, and it's set either way
+	if (write(event->fd, &one, sizeof one) < 0)
+		;
+}
+
+/* sys_event_reset : resets the event */
+void sys_event_reset(struct sys_event_t *event)
+{
+	u64 count;
+
+	// reading the count zeroes it, and it's nonblocking, so this is fine if it wasn't set
+	if (read(event->fd, &count, sizeof count) < 0)
+		;
+}
+
+/* sys_event_wait : waits for the event until sys_time() gets to 'until' (0 forever), returns 1 if it was set */
+s32 sys_event_wait(struct sys_event_t *event, f64 until)
+{
+	struct pollfd pfd;
+	struct timespec ts;
+	u64 count;
+	f64 left;
+	s32 rc;
+
+	// NOTE (brian): ppoll's timeout is in nanoseconds, and goes through the kernel's high
+	// resolution timers, so unlike Windows, there's no timer to set up to get the waits short.
+	// Waiting without an event is just a sleep.
+
+	for (;;) {
+		left = 0;
+		if (until != 0) {
+			left = until - sys_time();
+			if (left < 0)
+				left = 0;
+		}
+
+		ts = sys_timespec(left);
+
+		if (!event) {
+			if (left <= 0)
+				return 0;
+			nanosleep(&ts, NULL);
+			continue;
+		}
+
+		pfd.fd = event->fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		rc = ppoll(&pfd, 1, until != 0 ? &ts : NULL, NULL);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			return 0;
+
+		if (event->manual)
+			return 1;
+
+		// somebody else could've been waiting on it too, and gotten to it first
+		if (read(event->fd, &count, sizeof count) == sizeof count)
+			return 1;
+	}
+}
+
+/* sys_timespec : turns a number of seconds into a timespec */
+static struct timespec sys_timespec(f64 secs)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)secs;
+	ts.tv_nsec = (long)((secs - ts.tv_sec) * 1e9);
+
+	return ts;
+}
+
+/* sys_dirwatch : starts watching the directory for changes to the files in it */
+struct sys_dirwatch_t *sys_dirwatch(char *dname)
+{
+	struct sys_dirwatch_t *watch;
+
+	watch = malloc(sizeof(*watch));
+	if (!watch)
+		return NULL;
+
+	watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watch->fd < 0) {
+		sys_lasterror();
+		free(watch);
+		return NULL;
+	}
+
+	// editors either write the file where it is, or write another and move it over the top
+	if (inotify_add_watch(watch->fd, dname, IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO | IN_CREATE) < 0) {
+		sys_lasterror();
+		close(watch->fd);
+		free(watch);
+		return NULL;
+	}
+
+	return watch;
+}
+
+/* sys_dirwatch_read : returns 1 if the directory's changed since it was last read, without waiting, -1 on errors */
+s32 sys_dirwatch_read(struct sys_dirwatch_t *watch)
+{
+	ssize_t n;
+	s32 changed;
+
+	// we only care that something happened, not what, so the notifications just get thrown away
+	changed = 0;
+	while ((n = read(watch->fd, watch->buf, sizeof watch->buf)) > 0)
+		changed = 1;
+
+	// it'd stay readable, and the loop would never get to sleep
+	if (n < 0 && errno != EAGAIN && errno != EINTR) {
+		sys_lasterror();
+		sys_loop_drop(watch->fd);
+		return -1;
+	}
+
+	return changed;
+}
+
+/* sys_dirwatch_free : stops watching the directory */
+void sys_dirwatch_free(struct sys_dirwatch_t *watch)
+{
+	if (!watch)
+		return;
+
+	sys_loop_drop(watch->fd);
+	close(watch->fd);
+	free(watch);
+}
+
+/* sys_ipc : listens for commands at 'name' (see sys_ipc_read), returns NULL if it couldn't */
+struct sys_ipc_t *sys_ipc(char *name)
+{
+	struct sys_ipc_t *ipc;
+	mode_t mask;
+	s32 fd, rc;
+
+	// NOTE (brian): The socket's only ours to write to (see sys_ipc_addr), since whatever gets
+	// sent to it gets typed. If it's already there, it's either another of us that's still
+	// running, or one that didn't get to clean up, and only the second one refuses a connect.
+
+	ipc = calloc(1, sizeof(*ipc));
+	if (!ipc)
+		return NULL;
+
+	if (sys_ipc_addr(name, &ipc->addr) < 0) {
+		free(ipc);
+		return NULL;
+	}
+
+	ipc->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (ipc->fd < 0) {
+		sys_lasterror();
+		free(ipc);
+		return NULL;
+	}
+
+	mask = umask(077);
+
+	rc = bind(ipc->fd, (struct sockaddr *)&ipc->addr, sizeof ipc->addr);
+	if (rc < 0 && errno == EADDRINUSE) {
+		fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if (0 <= fd && connect(fd, (struct sockaddr *)&ipc->addr, sizeof ipc->addr) < 0 && errno == ECONNREFUSED) {
+			unlink(ipc->addr.sun_path);
+			rc = bind(ipc->fd, (struct sockaddr *)&ipc->addr, sizeof ipc->addr);
+		} else {
+			errno = EADDRINUSE;
+		}
+		if (0 <= fd)
+			close(fd);
+	}
+
+	umask(mask);
+
+	if (rc < 0) {
+		if (errno == EADDRINUSE) {
+			ERR("Something's already listening at '%s'\n", ipc->addr.sun_path);
+		} else {
+			sys_lasterror();
+		}
+		close(ipc->fd);
+		free(ipc);
+		return NULL;
+	}
+
+	return ipc;
+}
+
+/* sys_ipc_read : reads the next command that's come in, without waiting, returns its length, 0 if there isn't one */
+s32 sys_ipc_read(struct sys_ipc_t *ipc, char *buf, s32 len)
+{
+	ssize_t n;
+
+	for (;;) {
+		// MSG_TRUNC has it say how long the datagram really was, so one that's too long is noticed
+		n = recv(ipc->fd, buf, len, MSG_TRUNC);
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				sys_lasterror();
+			return 0;
+		}
+
+		if (n <= len)
+			return n;
+
+		WRN("A command was too long (%zd bytes), and got thrown away\n", n);
+	}
+}
+
+/* sys_ipc_send : sends the command to whoever's listening at 'name', returns -1 if it couldn't */
+s32 sys_ipc_send(char *name, char *buf, s32 len)
+{
+	struct sockaddr_un addr;
+	s32 fd, rc;
+
+	if (sys_ipc_addr(name, &addr) < 0)
+		return -1;
+
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		sys_lasterror();
+		return -1;
+	}
+
+	rc = sendto(fd, buf, len, 0, (struct sockaddr *)&addr, sizeof addr);
+	if (rc < 0) {
+		if (errno == ENOENT || errno == ECONNREFUSED) {
+			ERR("Nothing's listening at '%s'\n", addr.sun_path);
+		} else {
+			sys_lasterror();
+		}
+	}
+
+	close(fd);
+
+	return rc < 0 ? -1 : 0;
+}
+
+/* sys_ipc_free : stops listening */
+void sys_ipc_free(struct sys_ipc_t *ipc)
+{
+	if (!ipc)
+		return;
+
+	sys_loop_drop(ipc->fd);
+	close(ipc->fd);
+	unlink(ipc->addr.sun_path);
+	free(ipc);
+}
+
+/* sys_ipc_addr : fills in the socket's address for the name, returns -1 if it's too long */
+static s32 sys_ipc_addr(char *name, struct sockaddr_un *addr)
+{
+	char *dir;
+	s32 n;
+
+	// NOTE (brian): A name with a slash in it is already a path. Otherwise, it goes in the user's
+	// runtime directory, which only they can get into, or /tmp, with their uid on it.
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+
+	dir = getenv("XDG_RUNTIME_DIR");
+
+	if (strchr(name, '/')) {
+		n = snprintf(addr->sun_path, sizeof addr->sun_path, "%s", name);
+	} else if (dir && *dir) {
+		n = snprintf(addr->sun_path, sizeof addr->sun_path, "%s/%s.sock", dir, name);
+	} else {
+		n = snprintf(addr->sun_path, sizeof addr->sun_path, "/tmp/%s-%d.sock", name, (s32)getuid());
+	}
+
+	if (n < 0 || sizeof addr->sun_path <= (size_t)n) {
+		ERR("The socket's path for '%s' is too long\n", name);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* sys_loop_event : has the loop wake up with 'tag' when the event's set */
+s32 sys_loop_event(struct sys_event_t *event, s32 tag)
+{
+	return sys_loop_add(event->fd, tag, event);
+}
+
+/* sys_loop_dirwatch : has the loop wake up with 'tag' when the directory changes (see sys_dirwatch_read) */
+s32 sys_loop_dirwatch(struct sys_dirwatch_t *watch, s32 tag)
+{
+	return sys_loop_add(watch->fd, tag, NULL);
+}
+
+/* sys_loop_ipc : has the loop wake up with 'tag' when a command comes in (see sys_ipc_read) */
+s32 sys_loop_ipc(struct sys_ipc_t *ipc, s32 tag)
+{
+	return sys_loop_add(ipc->fd, tag, NULL);
+}
+
+/* sys_loop_fd : has the loop wake up with 'tag' when the file's readable, for the backends, returns -1 for plain files, which can't be waited on */
+s32 sys_loop_fd(s32 fd, s32 tag)
+{
+	return sys_loop_add(fd, tag, NULL);
+}
+
+/* sys_loop_open : makes the loop's epoll, the first time it's needed */
+static s32 sys_loop_open()
+{
+	if (sys_loop.epoll)
+		return 0;
+
+	sys_loop.epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (sys_loop.epoll < 0) {
+		sys_lasterror();
+		sys_loop.epoll = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* sys_loop_add : puts the file in the loop, with the event it is, if it's one */
+static s32 sys_loop_add(s32 fd, s32 tag, struct sys_event_t *event)
+{
+	struct sys_waiter_t *waiter;
+	struct epoll_event ev;
+	s32 i, free_i;
+
+	if (sys_loop_open() < 0)
+		return -1;
+
+	// the same file again just changes its tag
+	for (i = 0, free_i = -1; i < sys_loop.len && sys_loop.waiters[i].fd != fd; i++) {
+		if (free_i < 0 && sys_loop.waiters[i].fd < 0)
+			free_i = i;
+	}
+
+	if (i == sys_loop.len && 0 <= free_i)
+		i = free_i;
+
+	if (i == SYS_LOOP_MAX) {
+		ERR("There's already %d things in the loop\n", SYS_LOOP_MAX);
+		return -1;
+	}
+
+	waiter = sys_loop.waiters + i;
+
+	memset(&ev, 0, sizeof ev);
+	ev.events = EPOLLIN;
+	ev.data.u32 = i;
+
+	// NOTE (brian): epoll won't take plain files (EPERM), they're always readable, so there'd be
+	// no waiting on anything else while one's in here. Whoever has one reads it without the loop.
+
+	if (epoll_ctl(sys_loop.epoll, i < sys_loop.len && waiter->fd == fd ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) < 0) {
+		if (errno == EPERM) {
+			ERR("Can't wait on a plain file\n");
+		} else {
+			sys_lasterror();
+		}
+		return -1;
+	}
+
+	waiter->fd = fd;
+	waiter->tag = tag;
+	waiter->event = event;
+
+	if (i == sys_loop.len)
+		sys_loop.len++;
+
+	return 0;
+}
+
+/* sys_loop_drop : takes the file out of the loop, before it's closed */
+void sys_loop_drop(s32 fd)
+{
+	struct sys_waiter_t *waiter;
+	s32 i;
+
+	for (i = 0; i < sys_loop.len; i++) {
+		waiter = sys_loop.waiters + i;
+		if (waiter->fd != fd)
+			continue;
+
+		epoll_ctl(sys_loop.epoll, EPOLL_CTL_DEL, fd, NULL);
+
+		memset(waiter, 0, sizeof(*waiter));
+		waiter->fd = -1;
+	}
+}
+
+/* sys_loop_wait : waits for something in the loop until sys_time() gets to 'until' (0 forever), returns 1 and its tag, 0 if it's 'until', -1 on errors */
+s32 sys_loop_wait(f64 until, s32 *tag)
+{
+	struct sys_waiter_t *waiter;
+	struct epoll_event ev;
+	s32 rc, timeout;
+	f64 left;
+
+	// NOTE (brian): One at a time is plenty, and fair, epoll puts whatever it just handed back at
+	// the end of the line, and anything that's still ready comes back on the next wait.
+
+	if (sys_loop_open() < 0)
+		return -1;
+
+	for (;;) {
+		timeout = -1;
+		if (until != 0) {
+			left = until - sys_time();
+			if (left <= 0)
+				return 0;
+			timeout = (s32)(left * 1000) + 1;
+		}
+
+		rc = epoll_wait(sys_loop.epoll, &ev, 1, timeout);
+		if (rc < 0 && errno == EINTR)
+			continue;
+
+		if (rc < 0) {
+			sys_lasterror();
+			return -1;
+		}
+
+		if (rc == 0)
+			continue;
+
+		waiter = sys_loop.waiters + ev.data.u32;
+		if (waiter->event && !waiter->event->manual)
+			sys_event_reset(waiter->event);
+
+		*tag = waiter->tag;
+
+		return 1;
+	}
+}
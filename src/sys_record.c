@@ -0,0 +1,468 @@
+/*
+ * Recording Backend
+ *
+ * Nothing goes to the OS. Hotkeys get pressed by a script, and every key that would've been typed
+ * gets written down instead, with when it was typed, so the whole program (the hotkeys, the
+ * typing thread, the profiles' pacing) runs as it always does, in a plain process, with no desktop
+ * at all. It builds everywhere, and it's the same on every platform.
+ *
+ *   chatmacro --backend record:in=script.txt,trace=out.cmtr,keys=out.txt macros.txt
+ *
+ * The options are all optional:
+ *
+ *   in=<path>     the script, without one there's nothing to press, and we quit right away
+ *   trace=<path>  every hotkey and key, timestamped, as RECORD_MAGIC and then record_t's
+ *   keys=<path>   the same, as text, without the times, to be diffed against a golden file
+ *
+ * The script's one command a line, and '#' starts a comment:
+ *
+ *   press <vk> [mods]  presses the hotkey (see sys.h), does nothing if it isn't one that's on
+ *   wait <ms>          waits, while everything else in the loop (see sys_loop_wait) carries on
+ *   idle <ms>          waits until nothing's been typed for that long, which wants to be longer
+ *                      than the profile waits for the chat box, or it stops in the middle of one
+ *
+ * and when it runs out, we quit. The typing thread throws away anything that hasn't been typed
+ * when we quit, so a script that wants everything it said written down ends with an idle.
+ *
+ * How fast the keys went out, and how long it was from a hotkey being pressed to the first key it
+ * typed, gets printed when it's closed. The keymap's a US layout, in Win32's virtual keys, so a
+ * recording reads the same as what Windows would've been sent.
+ *
+ * test/ has a script, and the keys it should type, that "./build.sh test" diffs against.
+ */
+
+#include "sys.h"
+
+#define RECORD_MAGIC   ("CMTR")
+#define RECORD_VERSION (1)
+#define RECORD_LAYOUT  (0x524543ULL << 32) // "REC", or'd into the layout ids, so they're never anyone else's
+#define RECORD_BINDS   (1024)
+#define RECORD_TAG     (-1) // the wake event's tag in the loop (see sys_loop_wait)
+
+#define RECORD_HOTKEY (0x100) // in record_t::flags, a hotkey was pressed, 'code' is its virtual key
+
+// NOTE (brian): one of these for each hotkey or key in the trace, the hotkey's modifiers are in the
+// top half of the flags
+struct record_t {
+	u64 ns; // since the backend was opened
+	u32 code;
+	u32 flags;
+};
+
+struct record_bind_t {
+	s32 id;
+	u32 vk;
+	u32 mods; // without MOD_NOREPEAT
+};
+
+// NOTE (brian): The US layout, in virtual keys, without and with shift. Letters and digits are
+// their own virtual keys, and aren't in here.
+static struct {
+	u8 vk;
+	char lo, hi;
+} record_us[] = {
+	  { 0xBA, ';', ':' }, { 0xBB, '=', '+' }, { 0xBC, ',', '<' }, { 0xBD, '-', '_' }
+	, { 0xBE, '.', '>' }, { 0xBF, '/', '?' }, { 0xC0, '`', '~' }, { 0xDB, '[', '{' }
+	, { 0xDC, '\\', '|' }, { 0xDD, ']', '}' }, { 0xDE, '\'', '"' }, { VK_SPACE, ' ', 0 }
+};
+
+// NOTE (brian): The main thread runs the script, and the typing thread sends, so the times they
+// hand each other are atomic. 'posted' is a bit for each message that's been posted, and 'wake'
+// gets set with it, to cut a wait short. 'until' is when the current wait ends, and 'idle' is how
+// long the current idle is, and when it started.
+static struct {
+	FILE *script;
+	FILE *trace;
+	FILE *keys;
+	s32 line;
+	f64 start;
+	f64 until;
+	f64 idle;
+	f64 idle_start;
+	u32 posted;
+	struct sys_event_t *wake;
+	struct record_bind_t binds[RECORD_BINDS];
+	s32 binds_len;
+	hook_func filter;
+	u64 press_ns; // the last hotkey press that hasn't typed anything yet, 0 if there isn't one
+	u64 sent_ns; // the last time anything was sent
+	u64 first_ns; // the first
+	u64 events;
+	u64 hotkeys;
+	u64 latency_n;
+	u64 latency_sum;
+	u64 latency_max;
+} record;
+
+/* record_open : opens the script and the outputs, "in=", "trace=" and "keys=" can be in 'opts' */
+static s32 record_open(char *opts);
+/* record_close : says how it went, and closes everything */
+static void record_close();
+/* record_bind : turns the hotkey on (or off) */
+static s32 record_bind(s32 id, u32 mods, u32 vk, s32 on);
+/* record_hook : has the script's presses go through the filter, instead of the binds */
+static s32 record_hook(hook_func filter);
+/* record_press : says what the press is, a hotkey's id, HOOK_PASS or HOOK_EAT (see hook_func) */
+static s32 record_press(u32 vk, u32 mods);
+/* record_next : runs the script until it presses a hotkey, something's posted, or it's 'until' */
+static s32 record_next(s32 *id, f64 until);
+/* record_post : wakes up record_next with the message */
+static void record_post(s32 msg);
+/* record_layout : there's only the one */
+static u64 record_layout();
+/* record_keymap : fills in the keymap, which is always US */
+static void record_keymap(u64 layout, struct keymap_t *keymap);
+/* record_send : writes the keys down, returns how many of them went in (all of them) */
+static u32 record_send(struct key_t *keys, u32 n);
+/* record_write : writes one hotkey or key to the outputs */
+static void record_write(u64 ns, u32 code, u32 flags);
+/* record_now : nanoseconds since the backend was opened, never 0 */
+static u64 record_now();
+
+struct backend_t backend_record = {
+	"record",
+	record_open,
+	record_close,
+	record_bind,
+	record_hook,
+	record_next,
+	record_post,
+	record_layout,
+	record_keymap,
+	record_send,
+	NULL,
+	NULL
+};
+
+/* record_open : opens the script and the outputs, "in=", "trace=" and "keys=" can be in 'opts' */
+static s32 record_open(char *opts)
+{
+	char buf[BUFLARGE];
+	char *s, *e, *path;
+	u32 header[3];
+	FILE **fp;
+
+	memset(&record, 0, sizeof record);
+
+	record.start = sys_time();
+
+	snprintf(buf, sizeof buf, "%s", opts ? opts : "");
+
+	for (s = buf; *s; s = e) {
+		for (e = s; *e && *e != ','; e++)
+			;
+		if (*e)
+			*e++ = 0;
+
+		if (strncmp(s, "in=", 3) == 0) {
+			fp = &record.script, path = s + 3;
+		} else if (strncmp(s, "trace=", 6) == 0) {
+			fp = &record.trace, path = s + 6;
+		} else if (strncmp(s, "keys=", 5) == 0) {
+			fp = &record.keys, path = s + 5;
+		} else {
+			ERR("Unknown record option '%s' (there's in=<path>, trace=<path> and keys=<path>)\n", s);
+			record_close();
+			return -1;
+		}
+
+		*fp = fopen(path, fp == &record.script ? "r" : fp == &record.trace ? "wb" : "w");
+		if (!*fp) {
+			ERR("Couldn't open '%s'\n", path);
+			record_close();
+			return -1;
+		}
+	}
+
+	if (record.trace) {
+		header[0] = RECORD_VERSION;
+		header[1] = sizeof(struct record_t);
+		header[2] = 0;
+		fwrite(RECORD_MAGIC, 1, 4, record.trace);
+		fwrite(header, sizeof header, 1, record.trace);
+	}
+
+	record.wake = sys_event(0);
+	if (!record.wake || sys_loop_event(record.wake, RECORD_TAG) < 0) {
+		record_close();
+		return -1;
+	}
+
+	return 0;
+}
+
+/* record_close : says how it went, and closes everything */
+static void record_close()
+{
+	f64 secs;
+
+	if (record.events) {
+		secs = (record.sent_ns - record.first_ns) / 1e9;
+		MSG("record : %llu events, %.0f events/s, %llu hotkeys\n", record.events,
+			secs > 0 ? record.events / secs : 0.0, record.hotkeys);
+	}
+
+	if (record.latency_n) {
+		MSG("record : press to first key, %.1f us average, %.1f us worst (%llu presses)\n",
+			record.latency_sum / 1e3 / record.latency_n, record.latency_max / 1e3, record.latency_n);
+	}
+
+	if (record.script)
+		fclose(record.script);
+	if (record.trace)
+		fclose(record.trace);
+	if (record.keys)
+		fclose(record.keys);
+
+	sys_event_free(record.wake);
+
+	memset(&record, 0, sizeof record);
+}
+
+/* record_bind : turns the hotkey on (or off) */
+static s32 record_bind(s32 id, u32 mods, u32 vk, s32 on)
+{
+	struct record_bind_t *bind;
+	s32 i;
+
+	if (!on) {
+		for (i = 0; i < record.binds_len && record.binds[i].id != id; i++)
+			;
+		if (i == record.binds_len)
+			return -1;
+
+		record.binds[i] = record.binds[--record.binds_len];
+
+		return 0;
+	}
+
+	if (record.binds_len == ARRSIZE(record.binds)) {
+		ERR("Only %d hotkeys can be on at once\n", RECORD_BINDS);
+		return -1;
+	}
+
+	bind = record.binds + record.binds_len++;
+
+	bind->id = id;
+	bind->vk = vk;
+	bind->mods = mods & ~MOD_NOREPEAT;
+
+	return 0;
+}
+
+/* record_hook : has the script's presses go through the filter, instead of the binds */
+static s32 record_hook(hook_func filter)
+{
+	record.filter = filter;
+	return 0;
+}
+
+/* record_press : says what the press is, a hotkey's id, HOOK_PASS or HOOK_EAT (see hook_func) */
+static s32 record_press(u32 vk, u32 mods)
+{
+	s32 i;
+
+	if (record.filter)
+		return record.filter(mods, vk, 0);
+
+	for (i = 0; i < record.binds_len; i++) {
+		if (record.binds[i].vk == vk && record.binds[i].mods == mods)
+			return record.binds[i].id;
+	}
+
+	return HOOK_PASS;
+}
+
+/* record_next : runs the script until it presses a hotkey, something's posted, or it's 'until' */
+static s32 record_next(s32 *id, f64 until)
+{
+	char line[BUFSMALL], cmd[BUFSMALL];
+	u32 posted, vk, mods;
+	f64 last;
+	s32 msg, n, rc, tag;
+
+	for (;;) {
+		// the lowest message first, so a quit always beats anything else
+		posted = __atomic_load_n(&record.posted, __ATOMIC_ACQUIRE);
+		if (posted) {
+			for (msg = 0; !(posted & (1 << msg)); msg++)
+				;
+			__atomic_fetch_and(&record.posted, ~(1u << msg), __ATOMIC_ACQ_REL);
+			return msg;
+		}
+
+		// the script's own waits only count for how long they are, it's not asking to be woken
+		if (until != 0 && until <= sys_time())
+			return SYS_TIMEOUT;
+
+		if (record.until) {
+			rc = sys_loop_wait(until != 0 && until < record.until ? until : record.until, &tag);
+			if (rc < 0)
+				return SYS_QUIT;
+			if (rc && tag != RECORD_TAG) {
+				*id = tag;
+				return SYS_READY;
+			}
+			if (rc || sys_time() < record.until)
+				continue;
+			record.until = 0;
+		}
+
+		if (record.idle) {
+			last = __atomic_load_n(&record.sent_ns, __ATOMIC_ACQUIRE) / 1e9 + record.start;
+			if (last < record.idle_start)
+				last = record.idle_start;
+
+			if (sys_time() < last + record.idle) {
+				record.until = last + record.idle;
+				continue;
+			}
+
+			record.idle = 0;
+		}
+
+		if (!record.script || !fgets(line, sizeof line, record.script))
+			return SYS_QUIT;
+
+		record.line++;
+
+		if (strchr(line, '#'))
+			*strchr(line, '#') = 0;
+
+		vk = mods = 0;
+		n = sscanf(line, "%s %i %i", cmd, (s32 *)&vk, (s32 *)&mods);
+		if (n <= 0)
+			continue;
+
+		if (streq(cmd, "wait") && n == 2) {
+			record.until = sys_time() + vk / 1000.0;
+		} else if (streq(cmd, "idle") && n == 2) {
+			record.idle = vk / 1000.0;
+			record.idle_start = sys_time();
+		} else if (streq(cmd, "press") && 2 <= n) {
+			rc = record_press(vk, mods);
+			if (rc < 0)
+				continue;
+
+			record.hotkeys++;
+			record_write(record_now(), vk, RECORD_HOTKEY | (mods << 16));
+
+			__atomic_store_n(&record.press_ns, record_now(), __ATOMIC_RELEASE);
+
+			*id = rc;
+
+			return SYS_HOTKEY;
+		} else {
+			WRN("The script's line %d doesn't make sense, skipping it\n", record.line);
+		}
+	}
+}
+
+/* record_post : wakes up record_next with the message */
+static void record_post(s32 msg)
+{
+	__atomic_fetch_or(&record.posted, 1u << msg, __ATOMIC_ACQ_REL);
+	sys_event_set(record.wake);
+}
+
+/* record_layout : there's only the one */
+static u64 record_layout()
+{
+	return RECORD_LAYOUT;
+}
+
+/* record_keymap : fills in the keymap, which is always US */
+static void record_keymap(u64 layout, struct keymap_t *keymap)
+{
+	char *shifted;
+	s32 i;
+
+	for (i = 0; i < ARRSIZE(keymap->keys); i++)
+		keymap->keys[i] = -1;
+
+	shifted = ")!@#$%^&*(";
+
+	for (i = 0; i < 10; i++) {
+		keymap->keys['0' + i] = '0' + i;
+		keymap->keys[(u8)shifted[i]] = 0x100 | ('0' + i);
+	}
+
+	for (i = 0; i < 26; i++) {
+		keymap->keys['a' + i] = 'A' + i;
+		keymap->keys['A' + i] = 0x100 | ('A' + i);
+	}
+
+	for (i = 0; i < ARRSIZE(record_us); i++) {
+		keymap->keys[(u8)record_us[i].lo] = record_us[i].vk;
+		if (record_us[i].hi)
+			keymap->keys[(u8)record_us[i].hi] = 0x100 | record_us[i].vk;
+	}
+
+	keymap->named.shift = 0xA0; // VK_LSHIFT
+	keymap->named.control = 0xA2; // VK_LCONTROL
+	keymap->named.enter = VK_RETURN;
+	keymap->named.chat = 'T';
+	keymap->named.paste = 'V';
+}
+
+/* record_send : writes the keys down, returns how many of them went in (all of them) */
+static u32 record_send(struct key_t *keys, u32 n)
+{
+	u64 now, press, latency;
+	u32 i;
+
+	// NOTE (brian): the time's taken once for the whole send, since that's when they'd have all
+	// gone to the OS together
+
+	now = record_now();
+
+	press = __atomic_exchange_n(&record.press_ns, 0, __ATOMIC_ACQ_REL);
+	if (press && n) {
+		latency = now - press;
+		record.latency_n++;
+		record.latency_sum += latency;
+		if (record.latency_max < latency)
+			record.latency_max = latency;
+	}
+
+	for (i = 0; i < n; i++)
+		record_write(now, keys[i].code, keys[i].flags);
+
+	if (!record.first_ns)
+		record.first_ns = now;
+	record.events += n;
+
+	__atomic_store_n(&record.sent_ns, now, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+/* record_write : writes one hotkey or key to the outputs */
+static void record_write(u64 ns, u32 code, u32 flags)
+{
+	struct record_t rec;
+
+	if (record.trace) {
+		rec.ns = ns;
+		rec.code = code;
+		rec.flags = flags;
+		fwrite(&rec, sizeof rec, 1, record.trace);
+	}
+
+	if (!record.keys)
+		return;
+
+	if (flags & RECORD_HOTKEY) {
+		fprintf(record.keys, "press 0x%02x 0x%04x\n", code, flags >> 16);
+	} else if (flags & KEY_UNICODE) {
+		fprintf(record.keys, "%-4s U+%04X\n", (flags & KEY_UP) ? "up" : "down", code);
+	} else {
+		fprintf(record.keys, "%-4s 0x%02x\n", (flags & KEY_UP) ? "up" : "down", code);
+	}
+}
+
+/* record_now : nanoseconds since the backend was opened, never 0 */
+static u64 record_now()
+{
+	return (u64)((sys_time() - record.start) * 1e9) + 1;
+}
@@ -0,0 +1,1321 @@
+/*
+ * Win32 Platform Layer
+ *
+ * The sys_* functions for Windows, and the Win32 backend: RegisterHotKey and GetMessage for the
+ * hotkeys (or a low level keyboard hook, see win32_hook), SendInput for the keys, and the
+ * clipboard for pasting.
+ *
+ * Commands come in over a named pipe (see sys_ipc), in message mode, so each write's one command:
+ *
+ *   chatmacro --send say TrashTalk 2
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include "sys.h"
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION (0x00000002)
+#endif
+
+#ifndef PIPE_REJECT_REMOTE_CLIENTS
+#define PIPE_REJECT_REMOTE_CLIENTS (0x00000008)
+#endif
+
+#define WM_SYS (WM_USER + 1) // what backend_t::post posts, wParam is the message
+
+#define SEND_STACK (256) // how many INPUTs a send can make without allocating
+
+#define PASTE_OPEN_TRIES (10) // something else could have the clipboard open, for a moment
+#define PASTE_FORMATS    (32) // how many of the clipboard's formats we'll hold on to
+
+#define IPC_WAIT_MS (1000) // how long sys_ipc_send waits for the pipe, if someone else is on it
+
+struct sys_thread_t {
+	HANDLE handle;
+	s32 (*func)(void *arg);
+	void *arg;
+};
+
+struct sys_dirwatch_t {
+	HANDLE dir;
+	OVERLAPPED ov;
+	u64 buf[BUFLARGE / sizeof(u64)];
+};
+
+// NOTE (brian): The pipe only has the one instance, which is plenty, since whoever's sending just
+// connects, writes the one command and hangs up. Everything's overlapped, and 'ov' is always either
+// waiting for someone to connect, or for them to write, so its event is what goes in the loop.
+enum {
+	IPC_BROKEN,
+	IPC_CONNECTING,
+	IPC_CONNECTED,
+	IPC_READING
+};
+
+struct sys_ipc_t {
+	HANDLE pipe;
+	OVERLAPPED ov;
+	s32 state;
+	s32 skip; // the command's too long, the rest of it's being thrown away
+	char buf[BUFLARGE];
+};
+
+// NOTE (brian): what was on the clipboard before clip_swap put the line there, one copy for each
+// format that's plain memory. The formats that are GDI handles (bitmaps and such) can't be copied
+// like that, and aren't kept.
+struct paste_t {
+	struct {
+		UINT format;
+		void *data;
+		size_t len;
+	} items[PASTE_FORMATS];
+	s32 len;
+};
+
+/* sys_timer : makes a waitable timer, high resolution if we can get one */
+static HANDLE sys_timer();
+/* sys_dirwatch_arm : starts reading the directory's changes, for the loop to wait on */
+static s32 sys_dirwatch_arm(struct sys_dirwatch_t *watch);
+/* sys_ipc_connect : waits (overlapped) for the next one to connect to the pipe */
+static s32 sys_ipc_connect(struct sys_ipc_t *ipc);
+/* sys_loop_add : has the loop wait on the handle too */
+static s32 sys_loop_add(HANDLE handle, s32 tag);
+/* sys_loop_drop : takes the handle out of the loop */
+static void sys_loop_drop(HANDLE handle);
+/* sys_thread_main : runs a sys_thread's function */
+static DWORD WINAPI sys_thread_main(LPVOID arg);
+
+/* win32_open : remembers which thread the hotkeys come in on */
+static s32 win32_open(char *opts);
+/* win32_close : takes the hook off, if there's one, the hotkeys are unregistered by whoever registered them */
+static void win32_close();
+/* win32_bind : registers (or unregisters) the hotkey */
+static s32 win32_bind(s32 id, u32 mods, u32 vk, s32 on);
+/* win32_hook : hooks the keyboard, on a thread of its own */
+static s32 win32_hook(hook_func filter);
+/* win32_hook_thread : puts the hook on, and pumps messages so it gets called, until it's told to quit */
+static s32 win32_hook_thread(void *arg);
+/* win32_hook_proc : the hook, asks the filter about every key that's going down */
+static LRESULT CALLBACK win32_hook_proc(int code, WPARAM wparam, LPARAM lparam);
+/* win32_next : waits for the next hotkey or posted message, or until 'until' */
+static s32 win32_next(s32 *id, f64 until);
+/* win32_post : wakes up win32_next with the message */
+static void win32_post(s32 msg);
+/* win32_layout : returns the keyboard layout of the window that has focus */
+static u64 win32_layout();
+/* win32_keymap : fills in the keymap for the given keyboard layout */
+static void win32_keymap(u64 layout, struct keymap_t *keymap);
+/* win32_send : types the keys with SendInput, returns how many of them went in */
+static u32 win32_send(struct key_t *keys, u32 n);
+/* win32_input : writes the INPUTs for the key at inputs[len], returns the new length */
+static u32 win32_input(INPUT *inputs, u32 len, struct key_t *key);
+/* win32_unicode : writes a KEYEVENTF_UNICODE INPUT for the UTF-16 code unit, returns the new length */
+static u32 win32_unicode(INPUT *inputs, u32 len, u16 unit, s32 key_up);
+/* win32_clip_swap : puts the text on the clipboard, returning what was there, or NULL if it couldn't */
+static void *win32_clip_swap(char *text, size_t len);
+/* win32_clip_restore : puts back what win32_clip_swap took off the clipboard */
+static void win32_clip_restore(void *saved);
+
+/* paste_open : opens the clipboard, trying a few times if something else has it */
+static s32 paste_open(HWND owner);
+/* paste_save : copies what's on the (open) clipboard */
+static void paste_save(struct paste_t *paste);
+/* paste_restore : puts what paste_save copied back on the (open) clipboard, and frees it */
+static void paste_restore(struct paste_t *paste);
+/* paste_set : puts the text on the (open) clipboard */
+static s32 paste_set(WCHAR *text, s32 len);
+
+/* mk_kbdinput : helper function to fill in an INPUT structure for a keyboard */
+static void mk_kbdinput(INPUT *input, s16 vk, s16 sk, s32 key_up);
+
+struct backend_t backend_win32 = {
+	"win32",
+	win32_open,
+	win32_close,
+	win32_bind,
+	win32_hook,
+	win32_next,
+	win32_post,
+	win32_layout,
+	win32_keymap,
+	win32_send,
+	win32_clip_swap,
+	win32_clip_restore
+};
+
+static DWORD win32_tid;
+static HWND win32_owner;
+
+// NOTE (brian): what's in the loop, besides the message queue, which is always in it
+static struct {
+	HANDLE handles[SYS_LOOP_MAX];
+	s32 tags[SYS_LOOP_MAX];
+	s32 len;
+} sys_loop;
+
+// NOTE (brian): The hook runs on its own thread, so nothing the main thread's busy with ever
+// holds up the keyboard, Windows takes away hooks that are too slow. 'mods' are the modifiers
+// that are down, and 'down' is 1 for a key that's down, or 2 if it got eaten going down, so its
+// release gets eaten too.
+static struct {
+	hook_func filter;
+	HHOOK hook;
+	DWORD tid;
+	struct sys_thread_t *thread;
+	struct sys_event_t *ready;
+	u32 mods;
+	u8 down[256];
+} win32_hooked;
+
+/* win32_open : remembers which thread the hotkeys come in on */
+static s32 win32_open(char *opts)
+{
+	// NOTE (brian): hotkeys registered without a window go to the thread that registered them
+	win32_tid = GetCurrentThreadId();
+	return 0;
+}
+
+/* win32_close : takes the hook off, if there's one, the hotkeys are unregistered by whoever registered them */
+static void win32_close()
+{
+	if (!win32_hooked.thread)
+		return;
+
+	PostThreadMessage(win32_hooked.tid, WM_QUIT, 0, 0);
+	sys_join(win32_hooked.thread);
+
+	memset(&win32_hooked, 0, sizeof win32_hooked);
+}
+
+/* win32_bind : registers (or unregisters) the hotkey */
+static s32 win32_bind(s32 id, u32 mods, u32 vk, s32 on)
+{
+	BOOL rc;
+
+	if (on) {
+		rc = RegisterHotKey(NULL, id, mods, vk);
+	} else {
+		rc = UnregisterHotKey(NULL, id);
+	}
+
+	if (!rc) {
+		sys_lasterror();
+		return -1;
+	}
+
+	return 0;
+}
+
+/* win32_hook : hooks the keyboard, on a thread of its own */
+static s32 win32_hook(hook_func filter)
+{
+	win32_hooked.filter = filter;
+
+	win32_hooked.ready = sys_event(0);
+	if (!win32_hooked.ready)
+		return -1;
+
+	win32_hooked.thread = sys_thread(win32_hook_thread, NULL);
+	if (!win32_hooked.thread) {
+		sys_event_free(win32_hooked.ready);
+		return -1;
+	}
+
+	sys_event_wait(win32_hooked.ready, 0);
+	sys_event_free(win32_hooked.ready);
+	win32_hooked.ready = NULL;
+
+	if (!win32_hooked.hook) {
+		sys_join(win32_hooked.thread);
+		win32_hooked.thread = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* win32_hook_thread : puts the hook on, and pumps messages so it gets called, until it's told to quit */
+static s32 win32_hook_thread(void *arg)
+{
+	MSG msg;
+
+	// every key everyone types waits on us, so we go ahead of everything else that's waiting
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+
+	win32_hooked.tid = GetCurrentThreadId();
+	win32_hooked.hook = SetWindowsHookExW(WH_KEYBOARD_LL, win32_hook_proc, GetModuleHandleW(NULL), 0);
+	if (!win32_hooked.hook)
+		sys_lasterror();
+
+	sys_event_set(win32_hooked.ready);
+
+	if (!win32_hooked.hook)
+		return -1;
+
+	while (GetMessage(&msg, NULL, 0, 0) > 0)
+		;
+
+	UnhookWindowsHookEx(win32_hooked.hook);
+
+	return 0;
+}
+
+/* win32_hook_proc : the hook, asks the filter about every key that's going down */
+static LRESULT CALLBACK win32_hook_proc(int code, WPARAM wparam, LPARAM lparam)
+{
+	KBDLLHOOKSTRUCT *key;
+	u32 vk, mod;
+	s32 rc, eaten;
+
+	key = (KBDLLHOOKSTRUCT *)lparam;
+
+	// what we type ourselves is never a hotkey, and mustn't count as a modifier being down either
+	if (code != HC_ACTION || (key->flags & LLKHF_INJECTED))
+		return CallNextHookEx(NULL, code, wparam, lparam);
+
+	vk = key->vkCode & 0xff;
+
+	switch (vk) {
+	case VK_SHIFT: case VK_LSHIFT: case VK_RSHIFT: mod = MOD_SHIFT; break;
+	case VK_CONTROL: case VK_LCONTROL: case VK_RCONTROL: mod = MOD_CONTROL; break;
+	case VK_MENU: case VK_LMENU: case VK_RMENU: mod = MOD_ALT; break;
+	case VK_LWIN: case VK_RWIN: mod = MOD_WIN; break;
+	default: mod = 0; break;
+	}
+
+	if (mod) {
+		win32_hooked.mods = (key->flags & LLKHF_UP) ? win32_hooked.mods & ~mod : win32_hooked.mods | mod;
+		return CallNextHookEx(NULL, code, wparam, lparam);
+	}
+
+	if (key->flags & LLKHF_UP) {
+		eaten = win32_hooked.down[vk] == 2;
+		win32_hooked.down[vk] = 0;
+		return eaten ? 1 : CallNextHookEx(NULL, code, wparam, lparam);
+	}
+
+	// NOTE (brian): there's no flag for a repeat down here, it's just a key going down that's down
+	rc = win32_hooked.filter(win32_hooked.mods, vk, win32_hooked.down[vk] != 0);
+
+	if (rc == HOOK_PASS) {
+		if (!win32_hooked.down[vk])
+			win32_hooked.down[vk] = 1;
+		return CallNextHookEx(NULL, code, wparam, lparam);
+	}
+
+	win32_hooked.down[vk] = 2;
+
+	// it comes in just like one from RegisterHotKey would
+	if (rc >= 0)
+		PostThreadMessage(win32_tid, WM_HOTKEY, (WPARAM)rc, 0);
+
+	return 1;
+}
+
+/* win32_next : waits for the next hotkey or posted message, or until 'until' */
+static s32 win32_next(s32 *id, f64 until)
+{
+	MSG msg;
+	s32 rc, tag;
+
+	memset(&msg, 0, sizeof msg);
+
+	for (;;) {
+		while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
+			switch (msg.message) {
+			case WM_HOTKEY:
+				*id = (s32)msg.wParam;
+				return SYS_HOTKEY;
+
+			case WM_SYS:
+				return (s32)msg.wParam;
+
+			case WM_QUIT:
+				return SYS_QUIT;
+			}
+		}
+
+		// NOTE (brian): GetMessage, but with a timeout, and everything else in the loop
+		rc = sys_loop_wait(until, &tag);
+		if (rc < 0)
+			return SYS_QUIT;
+		if (rc == 0)
+			return SYS_TIMEOUT;
+
+		if (tag != SYS_LOOP_MESSAGES) {
+			*id = tag;
+			return SYS_READY;
+		}
+	}
+}
+
+/* win32_post : wakes up win32_next with the message */
+static void win32_post(s32 msg)
+{
+	PostThreadMessage(win32_tid, WM_SYS, (WPARAM)msg, 0);
+}
+
+/* win32_layout : returns the keyboard layout of the window that has focus */
+static u64 win32_layout()
+{
+	HWND wnd;
+
+	// NOTE (brian): We don't have a window, so there's no WM_INPUTLANGCHANGE for us, and our own
+	// thread's layout isn't the one that matters anyway. It's the game's, since that's who we're
+	// typing into, so this gets polled whenever we're about to type.
+
+	wnd = GetForegroundWindow();
+
+	return (u64)(uintptr_t)GetKeyboardLayout(wnd ? GetWindowThreadProcessId(wnd, NULL) : 0);
+}
+
+/* win32_keymap : fills in the keymap for the given keyboard layout */
+static void win32_keymap(u64 layout, struct keymap_t *keymap)
+{
+	s32 i;
+
+	// NOTE (brian): VkKeyScanExW is a trip through user32 for every char, and plan_compile wants
+	// one for every char of every line, so it gets asked about each of the 256 once instead.
+
+	for (i = 0; i < ARRSIZE(keymap->keys); i++)
+		keymap->keys[i] = VkKeyScanExW((WCHAR)i, (HKL)(uintptr_t)layout);
+
+	keymap->named.shift = VK_LSHIFT;
+	keymap->named.control = VK_LCONTROL;
+	keymap->named.enter = VK_RETURN;
+	keymap->named.chat = 'T';
+	keymap->named.paste = 'V';
+}
+
+/* win32_send : types the keys with SendInput, returns how many of them went in */
+static u32 win32_send(struct key_t *keys, u32 n)
+{
+	INPUT stack[SEND_STACK], *inputs;
+	u32 i, len, rc;
+
+	// NOTE (brian): Every key's one INPUT, except for a unicode down outside of the BMP, which is
+	// three (see win32_input). All of them go in the one SendInput, so nothing else's input can end up
+	// in the middle of them. If they didn't all go in, it's how many whole keys did that counts,
+	// so the caller can try the rest again.
+
+	inputs = n * 3 <= ARRSIZE(stack) ? stack : malloc(n * 3 * sizeof(*inputs));
+	if (!inputs)
+		return 0;
+
+	for (i = 0, len = 0; i < n; i++)
+		len = win32_input(inputs, len, keys + i);
+
+	rc = SendInput(len, inputs, sizeof(INPUT));
+
+	if (rc < len) {
+		for (i = 0, len = 0; i < n && (len = win32_input(NULL, len, keys + i)) <= rc; i++)
+			;
+		n = i;
+	}
+
+	if (inputs != stack)
+		free(inputs);
+
+	return n;
+}
+
+/* win32_input : writes the INPUTs for the key at inputs[len], returns the new length */
+static u32 win32_input(INPUT *inputs, u32 len, struct key_t *key)
+{
+	u32 cp;
+
+	if (!(key->flags & KEY_UNICODE)) {
+		if (inputs)
+			mk_kbdinput(inputs + len, key->code, 0, key->flags & KEY_UP);
+		return len + 1;
+	}
+
+	cp = key->code;
+
+	if (cp < 0x10000)
+		return win32_unicode(inputs, len, cp, key->flags & KEY_UP);
+
+	// NOTE (brian): Outside of the BMP, it's the two halves of a surrogate pair, each typed on its
+	// own (down, up). The key's down does the high half, and the low half's down, and its up does
+	// the low half's up, so the pair's still just a down and an up as far as plans are concerned.
+
+	cp -= 0x10000;
+
+	if (key->flags & KEY_UP)
+		return win32_unicode(inputs, len, 0xdc00 + (cp & 0x3ff), 1);
+
+	len = win32_unicode(inputs, len, 0xd800 + (cp >> 10), 0);
+	len = win32_unicode(inputs, len, 0xd800 + (cp >> 10), 1);
+
+	return win32_unicode(inputs, len, 0xdc00 + (cp & 0x3ff), 0);
+}
+
+/* win32_unicode : writes a KEYEVENTF_UNICODE INPUT for the UTF-16 code unit, returns the new length */
+static u32 win32_unicode(INPUT *inputs, u32 len, u16 unit, s32 key_up)
+{
+	if (inputs) {
+		mk_kbdinput(inputs + len, 0, unit, key_up);
+		inputs[len].ki.dwFlags |= KEYEVENTF_UNICODE;
+	}
+
+	return len + 1;
+}
+
+/* win32_clip_swap : puts the text on the clipboard, returning what was there, or NULL if it couldn't */
+static void *win32_clip_swap(char *text, size_t len)
+{
+	struct paste_t *saved;
+	WCHAR *wide;
+	s32 wlen, rc;
+
+	// NOTE (brian): The clipboard needs a window to own it, or SetClipboardData doesn't work, so
+	// the thread gets a message-only one the first time it pastes. Only the typing thread ever
+	// pastes, so it's always that thread's.
+
+	if (!win32_owner) {
+		win32_owner = CreateWindowExA(0, "STATIC", NULL, 0, 0, 0, 0, 0, HWND_MESSAGE, NULL, NULL, NULL);
+		if (!win32_owner) {
+			sys_lasterror();
+			return NULL;
+		}
+	}
+
+	wlen = MultiByteToWideChar(CP_UTF8, 0, text, len, NULL, 0);
+	if (wlen <= 0 && len)
+		return NULL;
+
+	wide = malloc((wlen + 1) * sizeof(*wide));
+	saved = malloc(sizeof(*saved));
+	if (!wide || !saved) {
+		free(wide);
+		free(saved);
+		return NULL;
+	}
+
+	MultiByteToWideChar(CP_UTF8, 0, text, len, wide, wlen);
+	wide[wlen] = 0;
+
+	if (paste_open(win32_owner) < 0) {
+		free(wide);
+		free(saved);
+		return NULL;
+	}
+
+	paste_save(saved);
+
+	rc = paste_set(wide, wlen);
+
+	CloseClipboard();
+	free(wide);
+
+	if (rc < 0) {
+		win32_clip_restore(saved);
+		return NULL;
+	}
+
+	return saved;
+}
+
+/* win32_clip_restore : puts back what win32_clip_swap took off the clipboard */
+static void win32_clip_restore(void *saved)
+{
+	if (paste_open(win32_owner) < 0) {
+		WRN("Couldn't put the clipboard back\n");
+		paste_restore(saved); // just to free it
+		free(saved);
+		return;
+	}
+
+	paste_restore(saved);
+	CloseClipboard();
+
+	free(saved);
+}
+
+/* paste_open : opens the clipboard, trying a few times if something else has it */
+static s32 paste_open(HWND owner)
+{
+	s32 i;
+
+	for (i = 0; i < PASTE_OPEN_TRIES; i++) {
+		if (OpenClipboard(owner))
+			return 0;
+		Sleep(5);
+	}
+
+	sys_lasterror();
+
+	return -1;
+}
+
+/* paste_save : copies what's on the (open) clipboard */
+static void paste_save(struct paste_t *paste)
+{
+	HANDLE h;
+	UINT format;
+	void *p;
+	size_t len;
+
+	paste->len = 0;
+
+	for (format = 0; paste->len < ARRSIZE(paste->items) && (format = EnumClipboardFormats(format));) {
+		switch (format) {
+		case CF_BITMAP: case CF_DSPBITMAP: case CF_METAFILEPICT: case CF_DSPMETAFILEPICT:
+		case CF_ENHMETAFILE: case CF_DSPENHMETAFILE: case CF_PALETTE: case CF_OWNERDISPLAY:
+			continue;
+		}
+
+		h = GetClipboardData(format);
+		if (!h)
+			continue;
+
+		len = GlobalSize(h);
+		p = GlobalLock(h);
+		if (!p)
+			continue;
+
+		paste->items[paste->len].data = malloc(len ? len : 1);
+		if (paste->items[paste->len].data) {
+			memcpy(paste->items[paste->len].data, p, len);
+			paste->items[paste->len].format = format;
+			paste->items[paste->len].len = len;
+			paste->len++;
+		}
+
+		GlobalUnlock(h);
+	}
+}
+
+/* paste_restore : puts what paste_save copied back on the (open) clipboard, and frees it */
+static void paste_restore(struct paste_t *paste)
+{
+	HGLOBAL h;
+	void *p;
+	s32 i;
+
+	EmptyClipboard();
+
+	for (i = 0; i < paste->len; i++) {
+		h = GlobalAlloc(GMEM_MOVEABLE, paste->items[i].len);
+		if (h && (p = GlobalLock(h))) {
+			memcpy(p, paste->items[i].data, paste->items[i].len);
+			GlobalUnlock(h);
+			if (!SetClipboardData(paste->items[i].format, h))
+				GlobalFree(h);
+		} else if (h) {
+			GlobalFree(h);
+		}
+
+		free(paste->items[i].data);
+	}
+
+	paste->len = 0;
+}
+
+/* paste_set : puts the text on the (open) clipboard */
+static s32 paste_set(WCHAR *text, s32 len)
+{
+	HGLOBAL h;
+	void *p;
+
+	EmptyClipboard();
+
+	h = GlobalAlloc(GMEM_MOVEABLE, (len + 1) * sizeof(*text));
+	if (!h)
+		return -1;
+
+	p = GlobalLock(h);
+	if (!p) {
+		GlobalFree(h);
+		return -1;
+	}
+
+	memcpy(p, text, (len + 1) * sizeof(*text));
+	GlobalUnlock(h);
+
+	if (!SetClipboardData(CF_UNICODETEXT, h)) {
+		sys_lasterror();
+		GlobalFree(h);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* mk_kbdinput : helper function to fill in an INPUT structure for a keyboard */
+static void mk_kbdinput(INPUT *input, s16 vk, s16 sk, s32 key_up)
+{
+	if (!input)
+		return;
+
+	memset(input, 0, sizeof(*input));
+
+	input->type = INPUT_KEYBOARD;
+	input->ki.wVk = vk;
+	input->ki.wScan = sk;
+	input->ki.dwFlags = key_up ? KEYEVENTF_KEYUP : 0;
+	input->ki.time = 0;
+	input->ki.dwExtraInfo = 0;
+}
+
+/* sys_lasterror : prints the last error the OS had for us */
+void sys_lasterror()
+{
+	DWORD error;
+	char *errmsg;
+
+	error = GetLastError();
+
+	FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER|FORMAT_MESSAGE_FROM_SYSTEM|FORMAT_MESSAGE_IGNORE_INSERTS,
+			NULL, error, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR)&errmsg, 0, NULL);
+
+	ERR("%s", errmsg);
+
+	LocalFree(errmsg);
+}
+
+/* sys_mapfile : maps an entire file into memory, read only */
+char *sys_mapfile(char *path, size_t *len)
+{
+	HANDLE file, mapping;
+	LARGE_INTEGER size;
+	char *p;
+
+	file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+			NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		sys_lasterror();
+		return NULL;
+	}
+
+	if (!GetFileSizeEx(file, &size)) {
+		sys_lasterror();
+		CloseHandle(file);
+		return NULL;
+	}
+
+	// NOTE (brian): spans are 32 bit offsets into the mapping
+	if (size.QuadPart > UINT32_MAX) {
+		ERR("%s is too big to map (%lld bytes)\n", path, (s64)size.QuadPart);
+		CloseHandle(file);
+		return NULL;
+	}
+
+	// you can't map an empty file, but there's nothing in it to look at anyway
+	if (size.QuadPart == 0) {
+		CloseHandle(file);
+		*len = 0;
+		return "";
+	}
+
+	mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!mapping) {
+		sys_lasterror();
+		CloseHandle(file);
+		return NULL;
+	}
+
+	p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!p)
+		sys_lasterror();
+
+	// the view keeps the mapping (and the file) alive on its own
+	CloseHandle(mapping);
+	CloseHandle(file);
+
+	*len = p ? (size_t)size.QuadPart : 0;
+
+	return p;
+}
+
+/* sys_unmapfile : unmaps a file mapped with sys_mapfile */
+void sys_unmapfile(char *p, size_t len)
+{
+	if (p && len)
+		UnmapViewOfFile(p);
+}
+
+/* sys_filestat : gets the file's size and last modified time, returns -1 if it isn't there */
+s32 sys_filestat(char *path, u64 *size, u64 *mtime)
+{
+	WIN32_FILE_ATTRIBUTE_DATA attr;
+
+	if (!GetFileAttributesExA(path, GetFileExInfoStandard, &attr))
+		return -1;
+
+	*size = ((u64)attr.nFileSizeHigh << 32) | attr.nFileSizeLow;
+	*mtime = ((u64)attr.ftLastWriteTime.dwHighDateTime << 32) | attr.ftLastWriteTime.dwLowDateTime;
+
+	return 0;
+}
+
+/* sys_replace : moves 'from' over the top of 'to', returns -1 if it couldn't */
+s32 sys_replace(char *from, char *to)
+{
+	if (!MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING)) {
+		sys_lasterror();
+		return -1;
+	}
+
+	return 0;
+}
+
+/* sys_time : seconds since some point in the past, for timing things */
+f64 sys_time()
+{
+	LARGE_INTEGER freq, now;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+
+	return (f64)now.QuadPart / (f64)freq.QuadPart;
+}
+
+/* sys_cores : returns how many cores we've got to work with */
+s32 sys_cores()
+{
+	SYSTEM_INFO info;
+
+	GetSystemInfo(&info);
+
+	return info.dwNumberOfProcessors ? info.dwNumberOfProcessors : 1;
+}
+
+/* sys_thread : runs func(arg) on a new thread, returns NULL if it couldn't */
+struct sys_thread_t *sys_thread(s32 (*func)(void *arg), void *arg)
+{
+	struct sys_thread_t *thread;
+
+	thread = malloc(sizeof(*thread));
+	if (!thread)
+		return NULL;
+
+	thread->func = func;
+	thread->arg = arg;
+
+	thread->handle = CreateThread(NULL, 0, sys_thread_main, thread, 0, NULL);
+	if (!thread->handle) {
+		sys_lasterror();
+		free(thread);
+		return NULL;
+	}
+
+	return thread;
+}
+
+/* sys_thread_main : runs a sys_thread's function */
+static DWORD WINAPI sys_thread_main(LPVOID arg)
+{
+	struct sys_thread_t *thread;
+
+	thread = arg;
+
+	return (DWORD)thread->func(thread->arg);
+}
+
+/* sys_join : waits for the thread to finish, and frees it */
+void sys_join(struct sys_thread_t *thread)
+{
+	if (!thread)
+		return;
+
+	WaitForSingleObject(thread->handle, INFINITE);
+	CloseHandle(thread->handle);
+
+	free(thread);
+}
+
+// NOTE (brian): an event's just the HANDLE, there's nothing else to keep track of
+
+/* sys_event : makes an event, that stays set until it's reset if 'manual', or until it's waited on */
+struct sys_event_t *sys_event(s32 manual)
+{
+	HANDLE event;
+
+	event = CreateEventA(NULL, manual ? TRUE : FALSE, FALSE, NULL);
+	if (!event)
+		sys_lasterror();
+
+	return (struct sys_event_t *)event;
+}
+
+/* sys_event_free : frees an event */
+void sys_event_free(struct sys_event_t *event)
+{
+	if (!event)
+		return;
+
+	sys_loop_drop((HANDLE)event);
+	CloseHandle((HANDLE)event);
+}
+
+/* sys_event_set : sets the event */
+void sys_event_set(struct sys_event_t *event)
+{
+	SetEvent((HANDLE)event);
+}
+
+/* sys_event_reset : resets the event */
+void sys_event_reset(struct sys_event_t *event)
+{
+	ResetEvent((HANDLE)event);
+}
+
+/* sys_event_wait : waits for the event until sys_time() gets to 'until' (0 forever), returns 1 if it was set */
+s32 sys_event_wait(struct sys_event_t *event, f64 until)
+{
+	static __thread HANDLE timer;
+	static __thread s32 tried;
+	LARGE_INTEGER due;
+	HANDLE handles[2];
+	f64 left;
+	DWORD rc;
+
+	// NOTE (brian): A plain timeout only wakes up on the system's timer tick, so anything that
+	// waits until a time uses a high resolution timer instead (see sys_timer). Every thread gets
+	// its own, the first time it waits on one.
+
+	if (until == 0)
+		return WaitForSingleObject((HANDLE)event, INFINITE) == WAIT_OBJECT_0;
+
+	if (!tried) {
+		tried = 1;
+		timer = sys_timer();
+	}
+
+	left = until - sys_time();
+	if (left <= 0)
+		return event ? WaitForSingleObject((HANDLE)event, 0) == WAIT_OBJECT_0 : 0;
+
+	// relative times are negative, in 100 ns units
+	due.QuadPart = -(LONGLONG)(left * 1e7);
+
+	if (!timer || !SetWaitableTimer(timer, &due, 0, NULL, NULL, FALSE)) {
+		if (!event) {
+			Sleep((DWORD)(left * 1000));
+			return 0;
+		}
+		return WaitForSingleObject((HANDLE)event, (DWORD)(left * 1000)) == WAIT_OBJECT_0;
+	}
+
+	handles[0] = timer;
+	handles[1] = (HANDLE)event;
+
+	rc = WaitForMultipleObjects(event ? 2 : 1, handles, FALSE, INFINITE);
+	if (rc == WAIT_OBJECT_0 + 1) {
+		CancelWaitableTimer(timer);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* sys_timer : makes a waitable timer, high resolution if we can get one */
+static HANDLE sys_timer()
+{
+	HANDLE timer;
+
+	// NOTE (brian): Sleep, and ordinary timers, only wake up on the system's timer tick (15.6 ms,
+	// usually), which is longer than most of the gaps a profile asks for. A high resolution timer
+	// (Windows 10 1803 and up) doesn't have that problem. Either way it resets itself when a wait
+	// on it finishes.
+
+	timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+	if (timer)
+		return timer;
+
+	WRN("No high resolution timer, pacing will be rough\n");
+
+	timer = CreateWaitableTimerA(NULL, FALSE, NULL);
+	if (!timer)
+		sys_lasterror();
+
+	return timer;
+}
+
+/* sys_dirwatch : starts watching the directory for changes to the files in it */
+struct sys_dirwatch_t *sys_dirwatch(char *dname)
+{
+	struct sys_dirwatch_t *watch;
+
+	watch = calloc(1, sizeof(*watch));
+	if (!watch)
+		return NULL;
+
+	watch->dir = CreateFileA(dname, FILE_LIST_DIRECTORY,
+			FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+			FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+	if (watch->dir == INVALID_HANDLE_VALUE) {
+		sys_lasterror();
+		free(watch);
+		return NULL;
+	}
+
+	watch->ov.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+	if (!watch->ov.hEvent) {
+		sys_lasterror();
+		CloseHandle(watch->dir);
+		free(watch);
+		return NULL;
+	}
+
+	if (sys_dirwatch_arm(watch) < 0) {
+		CloseHandle(watch->ov.hEvent);
+		CloseHandle(watch->dir);
+		free(watch);
+		return NULL;
+	}
+
+	return watch;
+}
+
+/* sys_dirwatch_arm : starts reading the directory's changes, for the loop to wait on */
+static s32 sys_dirwatch_arm(struct sys_dirwatch_t *watch)
+{
+	ResetEvent(watch->ov.hEvent);
+
+	if (!ReadDirectoryChangesW(watch->dir, watch->buf, sizeof watch->buf, FALSE,
+			FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE,
+			NULL, &watch->ov, NULL)) {
+		sys_lasterror();
+		return -1;
+	}
+
+	return 0;
+}
+
+/* sys_dirwatch_read : returns 1 if the directory's changed since it was last read, without waiting, -1 on errors */
+s32 sys_dirwatch_read(struct sys_dirwatch_t *watch)
+{
+	DWORD n;
+
+	// NOTE (brian): We only care that something happened, not what. A read that ran out of room
+	// (ERROR_NOTIFY_ENUM_DIR) is still a change, there were just too many of them to say.
+	if (!GetOverlappedResult(watch->dir, &watch->ov, &n, FALSE)) {
+		if (GetLastError() == ERROR_IO_INCOMPLETE)
+			return 0;
+		if (GetLastError() != ERROR_NOTIFY_ENUM_DIR) {
+			sys_lasterror();
+			sys_loop_drop(watch->ov.hEvent);
+			return -1;
+		}
+	}
+
+	// if it can't be started again, the event's left set, and the loop would never get to sleep
+	if (sys_dirwatch_arm(watch) < 0) {
+		sys_loop_drop(watch->ov.hEvent);
+		return -1;
+	}
+
+	return 1;
+}
+
+/* sys_dirwatch_free : stops watching the directory */
+void sys_dirwatch_free(struct sys_dirwatch_t *watch)
+{
+	DWORD n;
+
+	if (!watch)
+		return;
+
+	sys_loop_drop(watch->ov.hEvent);
+
+	CancelIo(watch->dir);
+	GetOverlappedResult(watch->dir, &watch->ov, &n, TRUE);
+
+	CloseHandle(watch->ov.hEvent);
+	CloseHandle(watch->dir);
+
+	free(watch);
+}
+
+/* sys_ipc : listens for commands at 'name' (see sys_ipc_read), returns NULL if it couldn't */
+struct sys_ipc_t *sys_ipc(char *name)
+{
+	struct sys_ipc_t *ipc;
+	char path[BUFLARGE];
+
+	// NOTE (brian): A pipe's default security only lets whoever made it (and the admins) write
+	// to it, which is what we want, since whatever gets sent to it gets typed.
+
+	ipc = calloc(1, sizeof(*ipc));
+	if (!ipc)
+		return NULL;
+
+	snprintf(path, sizeof path, "\\\\.\\pipe\\%s", name);
+
+	ipc->pipe = CreateNamedPipeA(path, PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+			PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+			1, 0, sizeof ipc->buf, 0, NULL);
+	if (ipc->pipe == INVALID_HANDLE_VALUE) {
+		if (GetLastError() == ERROR_ACCESS_DENIED) {
+			ERR("Something's already listening at '%s'\n", path);
+		} else {
+			sys_lasterror();
+		}
+		free(ipc);
+		return NULL;
+	}
+
+	ipc->ov.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+	if (!ipc->ov.hEvent) {
+		sys_lasterror();
+		CloseHandle(ipc->pipe);
+		free(ipc);
+		return NULL;
+	}
+
+	if (sys_ipc_connect(ipc) < 0) {
+		CloseHandle(ipc->ov.hEvent);
+		CloseHandle(ipc->pipe);
+		free(ipc);
+		return NULL;
+	}
+
+	return ipc;
+}
+
+/* sys_ipc_connect : waits (overlapped) for the next one to connect to the pipe */
+static s32 sys_ipc_connect(struct sys_ipc_t *ipc)
+{
+	// whoever was on it's hung up, and it's fine if there wasn't anyone
+	DisconnectNamedPipe(ipc->pipe);
+
+	ipc->skip = 0;
+
+	// an overlapped connect always says it "failed", the error's what happened
+	ConnectNamedPipe(ipc->pipe, &ipc->ov);
+
+	switch (GetLastError()) {
+	case ERROR_IO_PENDING:
+		ipc->state = IPC_CONNECTING;
+		return 0;
+
+	case ERROR_PIPE_CONNECTED:
+		// they got in between the disconnect and the connect, so there's no wait to set the event
+		ipc->state = IPC_CONNECTED;
+		SetEvent(ipc->ov.hEvent);
+		return 0;
+	}
+
+	// the event could be left set, and then the loop would never get to sleep
+	sys_lasterror();
+	sys_loop_drop(ipc->ov.hEvent);
+	ipc->state = IPC_BROKEN;
+
+	return -1;
+}
+
+/* sys_ipc_read : reads the next command that's come in, without waiting, returns its length, 0 if there isn't one */
+s32 sys_ipc_read(struct sys_ipc_t *ipc, char *buf, s32 len)
+{
+	DWORD n, err;
+
+	for (;;) {
+		switch (ipc->state) {
+		case IPC_BROKEN:
+			return 0;
+
+		case IPC_CONNECTING:
+			if (!GetOverlappedResult(ipc->pipe, &ipc->ov, &n, FALSE)) {
+				if (GetLastError() == ERROR_IO_INCOMPLETE)
+					return 0;
+				sys_ipc_connect(ipc);
+				break;
+			}
+			ipc->state = IPC_CONNECTED;
+			break;
+
+		case IPC_CONNECTED:
+			// starting the read resets the event, and it's set again once there's a message
+			ipc->state = IPC_READING;
+			if (!ReadFile(ipc->pipe, ipc->buf, sizeof ipc->buf, NULL, &ipc->ov)) {
+				err = GetLastError();
+				if (err != ERROR_IO_PENDING && err != ERROR_MORE_DATA)
+					sys_ipc_connect(ipc);
+			}
+			break;
+
+		case IPC_READING:
+			if (!GetOverlappedResult(ipc->pipe, &ipc->ov, &n, FALSE)) {
+				err = GetLastError();
+				if (err == ERROR_IO_INCOMPLETE)
+					return 0;
+				if (err == ERROR_MORE_DATA) {
+					ipc->skip = 1;
+					ipc->state = IPC_CONNECTED;
+					break;
+				}
+				// they've hung up (ERROR_BROKEN_PIPE), on to the next one
+				sys_ipc_connect(ipc);
+				break;
+			}
+
+			ipc->state = IPC_CONNECTED;
+
+			if (ipc->skip) {
+				ipc->skip = 0;
+				WRN("A command was too long, and got thrown away\n");
+				break;
+			}
+
+			if ((DWORD)len < n) {
+				WRN("A command was too long (%lu bytes), and got thrown away\n", n);
+				break;
+			}
+
+			memcpy(buf, ipc->buf, n);
+
+			return (s32)n;
+		}
+	}
+}
+
+/* sys_ipc_send : sends the command to whoever's listening at 'name', returns -1 if it couldn't */
+s32 sys_ipc_send(char *name, char *buf, s32 len)
+{
+	char path[BUFLARGE];
+	HANDLE pipe;
+	DWORD n;
+	BOOL rc;
+
+	snprintf(path, sizeof path, "\\\\.\\pipe\\%s", name);
+
+	for (;;) {
+		pipe = CreateFileA(path, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+		if (pipe != INVALID_HANDLE_VALUE)
+			break;
+
+		// someone else is sending, they won't be long
+		if (GetLastError() != ERROR_PIPE_BUSY || !WaitNamedPipeA(path, IPC_WAIT_MS)) {
+			ERR("Nothing's listening at '%s'\n", path);
+			return -1;
+		}
+	}
+
+	rc = WriteFile(pipe, buf, len, &n, NULL);
+	if (!rc)
+		sys_lasterror();
+
+	CloseHandle(pipe);
+
+	return rc ? 0 : -1;
+}
+
+/* sys_ipc_free : stops listening */
+void sys_ipc_free(struct sys_ipc_t *ipc)
+{
+	DWORD n;
+
+	if (!ipc)
+		return;
+
+	sys_loop_drop(ipc->ov.hEvent);
+
+	if (ipc->state == IPC_CONNECTING || ipc->state == IPC_READING) {
+		CancelIo(ipc->pipe);
+		GetOverlappedResult(ipc->pipe, &ipc->ov, &n, TRUE);
+	}
+
+	CloseHandle(ipc->ov.hEvent);
+	CloseHandle(ipc->pipe);
+
+	free(ipc);
+}
+
+/* sys_loop_event : has the loop wake up with 'tag' when the event's set */
+s32 sys_loop_event(struct sys_event_t *event, s32 tag)
+{
+	return sys_loop_add((HANDLE)event, tag);
+}
+
+/* sys_loop_dirwatch : has the loop wake up with 'tag' when the directory changes (see sys_dirwatch_read) */
+s32 sys_loop_dirwatch(struct sys_dirwatch_t *watch, s32 tag)
+{
+	return sys_loop_add(watch->ov.hEvent, tag);
+}
+
+/* sys_loop_ipc : has the loop wake up with 'tag' when a command comes in (see sys_ipc_read) */
+s32 sys_loop_ipc(struct sys_ipc_t *ipc, s32 tag)
+{
+	return sys_loop_add(ipc->ov.hEvent, tag);
+}
+
+/* sys_loop_add : has the loop wait on the handle too */
+static s32 sys_loop_add(HANDLE handle, s32 tag)
+{
+	s32 i;
+
+	// the same handle again just changes its tag
+	for (i = 0; i < sys_loop.len && sys_loop.handles[i] != handle; i++)
+		;
+
+	if (i == SYS_LOOP_MAX) {
+		ERR("There's already %d things in the loop\n", SYS_LOOP_MAX);
+		return -1;
+	}
+
+	sys_loop.handles[i] = handle;
+	sys_loop.tags[i] = tag;
+
+	if (i == sys_loop.len)
+		sys_loop.len++;
+
+	return 0;
+}
+
+/* sys_loop_drop : takes the handle out of the loop */
+static void sys_loop_drop(HANDLE handle)
+{
+	s32 i;
+
+	for (i = 0; i < sys_loop.len && sys_loop.handles[i] != handle; i++)
+		;
+
+	if (i == sys_loop.len)
+		return;
+
+	sys_loop.len--;
+	memmove(sys_loop.handles + i, sys_loop.handles + i + 1, (sys_loop.len - i) * sizeof(HANDLE));
+	memmove(sys_loop.tags + i, sys_loop.tags + i + 1, (sys_loop.len - i) * sizeof(s32));
+}
+
+/* sys_loop_wait : waits for something in the loop until sys_time() gets to 'until' (0 forever), returns 1 and its tag, 0 if it's 'until', -1 on errors */
+s32 sys_loop_wait(f64 until, s32 *tag)
+{
+	DWORD rc, timeout;
+	f64 left;
+
+	// NOTE (brian): MWMO_INPUTAVAILABLE has it come back for messages that are already in the
+	// queue, and not just new ones, since whoever's waiting might not have taken them all out.
+	// Whatever's first in the list wins when there's a few, and everything in it gets dealt with
+	// as soon as it's seen, so nothing gets stuck behind anything else.
+
+	for (;;) {
+		timeout = INFINITE;
+		if (until != 0) {
+			left = until - sys_time();
+			if (left <= 0)
+				return 0;
+			timeout = (DWORD)(left * 1000) + 1;
+		}
+
+		rc = MsgWaitForMultipleObjectsEx(sys_loop.len, sys_loop.handles, timeout, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+		if (rc == WAIT_FAILED) {
+			sys_lasterror();
+			return -1;
+		}
+
+		if (rc == WAIT_OBJECT_0 + sys_loop.len) {
+			*tag = SYS_LOOP_MESSAGES;
+			return 1;
+		}
+
+		if (WAIT_OBJECT_0 <= rc && rc < WAIT_OBJECT_0 + sys_loop.len) {
+			*tag = sys_loop.tags[rc - WAIT_OBJECT_0];
+			return 1;
+		}
+	}
+}
@@ -0,0 +1,841 @@
+/*
+ * X11 Backend
+ *
+ * Hotkeys are passive grabs on the root window (XGrabKey), and keys go out through the XTEST
+ * extension (XTestFakeKeyEvent), which is the same thing xdotool does. Neither needs a window, or
+ * a window manager, so all of this works just the same under Xvfb as on a desktop, which is what
+ * makes it good for timing things on a build box:
+ *
+ *   Xvfb :99 & DISPLAY=:99 ./chatmacro --profile fast macros.txt
+ *   Xvfb :99 & ./chatmacro --backend x11::99 --profile fast macros.txt
+ *
+ * Pasting owns the CLIPBOARD selection with a window of our own, that nobody ever sees. X11 has
+ * no clipboard to put things on, the owner has to answer for it whenever someone pastes, so the
+ * main thread does that, along with the hotkeys (see x11_serve). Whatever was on it before gets
+ * copied off the last owner first, every target it has, and we answer with that afterwards, the
+ * way a clipboard manager would (see x11_clip_swap).
+ *
+ * There's no hook, X11 only lets us see the keys we've grabbed, or every key with none of them
+ * getting eaten, so hotkeys always get grabbed one at a time.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/Xutil.h>
+#include <X11/XKBlib.h>
+#include <X11/keysym.h>
+#include <X11/extensions/XTest.h>
+
+#include "sys.h"
+
+#define X11_LAYOUT (0x583131ULL << 32) // "X11", or'd into the layout ids, so they're never an HKL
+#define X11_BINDS  (1024)
+#define X11_SPARES (8) // how many unused keycodes we'll borrow to type what the layout hasn't got
+#define X11_TAG    (-1) // the display and the wake pipe's tag in the loop (see sys_loop_wait)
+#define X11_LOOK   (-1) // posted to have x11_next look at the display, that isn't anyone's message
+
+#define CLIP_TARGETS (16) // the most targets we'll copy off whoever had the clipboard
+#define CLIP_WAIT_MS (250) // how long they get to answer for each of them
+#define CLIP_MAX     (1 << 22) // the biggest a target can be, in 32 bit units, or it's left behind
+
+// NOTE (brian): X11 has no idea about the Win32 virtual keys hotkeys are written in, so this is
+// what each of the ones in sys.h are, as keysyms. Letters and digits are the same in both, and
+// aren't in here.
+static struct {
+	u32 vk;
+	KeySym sym;
+} x11_vks[] = {
+	  { VK_BACK, XK_BackSpace }, { VK_TAB, XK_Tab }, { VK_RETURN, XK_Return }, { VK_PAUSE, XK_Pause }
+	, { VK_ESCAPE, XK_Escape }, { VK_SPACE, XK_space }, { VK_PRIOR, XK_Prior }, { VK_NEXT, XK_Next }
+	, { VK_END, XK_End }, { VK_HOME, XK_Home }, { VK_LEFT, XK_Left }, { VK_UP, XK_Up }
+	, { VK_RIGHT, XK_Right }, { VK_DOWN, XK_Down }, { VK_INSERT, XK_Insert }, { VK_DELETE, XK_Delete }
+	, { VK_NUMPAD0, XK_KP_0 }, { VK_NUMPAD1, XK_KP_1 }, { VK_NUMPAD2, XK_KP_2 }, { VK_NUMPAD3, XK_KP_3 }
+	, { VK_NUMPAD4, XK_KP_4 }, { VK_NUMPAD5, XK_KP_5 }, { VK_NUMPAD6, XK_KP_6 }, { VK_NUMPAD7, XK_KP_7 }
+	, { VK_NUMPAD8, XK_KP_8 }, { VK_NUMPAD9, XK_KP_9 }, { VK_MULTIPLY, XK_KP_Multiply }
+	, { VK_ADD, XK_KP_Add }, { VK_SUBTRACT, XK_KP_Subtract }, { VK_DECIMAL, XK_KP_Decimal }
+	, { VK_DIVIDE, XK_KP_Divide }
+};
+
+// the locks shouldn't get in the way of a hotkey, so every key's grabbed with each of them too
+static u32 x11_locks[] = { 0, LockMask, Mod2Mask, LockMask | Mod2Mask };
+
+struct x11_bind_t {
+	s32 id;
+	KeyCode code;
+	u32 mods; // X11's, not Win32's
+	s32 norepeat;
+	s32 down;
+};
+
+// NOTE (brian): What we answer with while we own the clipboard, a target at a time, each just the
+// way XGetWindowProperty handed it to us (so format 32 is an array of longs), or the text we're
+// pasting, as UTF8_STRING.
+struct x11_clip_t {
+	struct {
+		Atom target;
+		Atom type;
+		s32 format;
+		u8 *data;
+		unsigned long n;
+	} items[CLIP_TARGETS];
+	s32 len;
+};
+
+// NOTE (brian): The main thread has 'display', for the grabs and the keymap, and the typing thread
+// has 'typing', so neither ever has to wait on the other's requests. The spare keycodes are ones
+// with nothing on them, that x11_send puts code points on when the layout hasn't got a key for
+// them, round robin, so a key can still be going up on one while the next one goes down.
+//
+// 'owner' is the window on 'display' that owns the clipboard, and 'fetch' is the one on 'typing'
+// that the last owner's targets get copied to. 'clip' is what we're answering with, and it's only
+// ever non-NULL while we own the clipboard. The typing thread swaps it, and the main thread reads
+// it, so it's only touched with 'display' locked (XLockDisplay).
+static struct {
+	Display *display;
+	Display *typing;
+	Window root;
+	Window owner;
+	Window fetch;
+	Atom clipboard, targets, utf8, incr, property;
+	struct x11_clip_t *clip;
+	s32 wake[2];
+	struct x11_bind_t binds[X11_BINDS];
+	s32 binds_len;
+	KeyCode spares[X11_SPARES];
+	u32 spares_cp[X11_SPARES];
+	s32 spares_len;
+	s32 spares_next;
+	s32 error;
+} x11;
+
+/* x11_open : connects to the display ('opts', or $DISPLAY), and checks it has XTEST */
+static s32 x11_open(char *opts);
+/* x11_close : lets go of everything, and disconnects */
+static void x11_close();
+/* x11_bind : grabs (or ungrabs) the hotkey */
+static s32 x11_bind(s32 id, u32 mods, u32 vk, s32 on);
+/* x11_next : waits for the next hotkey or posted message, or until 'until' */
+static s32 x11_next(s32 *id, f64 until);
+/* x11_post : wakes up x11_next with the message */
+static void x11_post(s32 msg);
+/* x11_layout : returns the keyboard group that's in use */
+static u64 x11_layout();
+/* x11_keymap : fills in the keymap for the given group */
+static void x11_keymap(u64 layout, struct keymap_t *keymap);
+/* x11_send : types the keys with XTEST, returns how many of them went in */
+static u32 x11_send(struct key_t *keys, u32 n);
+/* x11_spare : puts the code point on a spare keycode, returns the keycode, or 0 if there aren't any */
+static KeyCode x11_spare(u32 cp, s32 up);
+/* x11_clip_swap : takes the clipboard with the text on it, returning what was there, or NULL if it couldn't */
+static void *x11_clip_swap(char *text, size_t len);
+/* x11_clip_restore : puts back what x11_clip_swap took off the clipboard */
+static void x11_clip_restore(void *saved);
+/* x11_serve : answers someone that's pasting, or lets go of the clipboard when someone else takes it */
+static void x11_serve(XEvent *event);
+/* clip_save : copies every target off the clipboard's owner, on the typing thread's connection */
+static void clip_save(struct x11_clip_t *clip);
+/* clip_get : asks the clipboard's owner for the target, and waits for it, returns -1 if it didn't come */
+static s32 clip_get(Atom target, Atom *type, s32 *format, u8 **data, unsigned long *n);
+/* clip_free : frees what's in the clip, and the clip */
+static void clip_free(struct x11_clip_t *clip);
+/* x11_onerror : remembers the error, instead of Xlib's default of quitting */
+static int x11_onerror(Display *display, XErrorEvent *event);
+
+struct backend_t backend_x11 = {
+	"x11",
+	x11_open,
+	x11_close,
+	x11_bind,
+	NULL,
+	x11_next,
+	x11_post,
+	x11_layout,
+	x11_keymap,
+	x11_send,
+	x11_clip_swap,
+	x11_clip_restore
+};
+
+/* x11_open : connects to the display ('opts', or $DISPLAY), and checks it has XTEST */
+static s32 x11_open(char *opts)
+{
+	KeySym *syms;
+	s32 ev, err, major, minor, min, max, per, i, j;
+
+	// the main thread and the typing thread each get their own connection, this is just in case
+	XInitThreads();
+
+	x11.display = XOpenDisplay(opts);
+	if (!x11.display) {
+		ERR("Couldn't open the display '%s'\n", XDisplayName(opts));
+		return -1;
+	}
+
+	if (!XTestQueryExtension(x11.display, &ev, &err, &major, &minor)) {
+		ERR("The display doesn't have the XTEST extension\n");
+		XCloseDisplay(x11.display);
+		return -1;
+	}
+
+	x11.typing = XOpenDisplay(opts);
+	if (!x11.typing) {
+		ERR("Couldn't open a second connection to the display\n");
+		XCloseDisplay(x11.display);
+		return -1;
+	}
+
+	if (pipe2(x11.wake, O_NONBLOCK | O_CLOEXEC) < 0) {
+		sys_lasterror();
+		XCloseDisplay(x11.typing);
+		XCloseDisplay(x11.display);
+		return -1;
+	}
+
+	if (sys_loop_fd(ConnectionNumber(x11.display), X11_TAG) < 0 || sys_loop_fd(x11.wake[0], X11_TAG) < 0) {
+		close(x11.wake[0]);
+		close(x11.wake[1]);
+		XCloseDisplay(x11.typing);
+		XCloseDisplay(x11.display);
+		return -1;
+	}
+
+	XSetErrorHandler(x11_onerror);
+
+	x11.root = DefaultRootWindow(x11.display);
+
+	// NOTE (brian): Atoms are the server's, so these are the same on both connections. The windows
+	// are never mapped, they're just somewhere for the selection's events to go.
+	x11.clipboard = XInternAtom(x11.display, "CLIPBOARD", False);
+	x11.targets = XInternAtom(x11.display, "TARGETS", False);
+	x11.utf8 = XInternAtom(x11.display, "UTF8_STRING", False);
+	x11.incr = XInternAtom(x11.display, "INCR", False);
+	x11.property = XInternAtom(x11.display, "CHATMACRO_CLIP", False);
+
+	x11.owner = XCreateSimpleWindow(x11.display, x11.root, 0, 0, 1, 1, 0, 0, 0);
+	x11.fetch = XCreateSimpleWindow(x11.typing, x11.root, 0, 0, 1, 1, 0, 0, 0);
+
+	// NOTE (brian): Without this, a held key repeats as a release and a press, so there'd be no
+	// telling a repeat from the key being pressed again (see MOD_NOREPEAT in x11_next).
+	XkbSetDetectableAutoRepeat(x11.display, True, NULL);
+
+	// the spares are keycodes the layout doesn't use at all, from the top down
+	XDisplayKeycodes(x11.display, &min, &max);
+
+	syms = XGetKeyboardMapping(x11.display, min, max - min + 1, &per);
+	if (syms) {
+		for (i = max; min <= i && x11.spares_len < X11_SPARES; i--) {
+			for (j = 0; j < per && syms[(i - min) * per + j] == NoSymbol; j++)
+				;
+			if (j == per)
+				x11.spares[x11.spares_len++] = i;
+		}
+		XFree(syms);
+	}
+
+	return 0;
+}
+
+/* x11_close : lets go of everything, and disconnects */
+static void x11_close()
+{
+	KeySym none;
+	s32 i;
+
+	if (!x11.display)
+		return;
+
+	for (i = x11.binds_len - 1; 0 <= i; i--)
+		x11_bind(x11.binds[i].id, 0, 0, 0);
+
+	// put the spares back the way we found them
+	for (i = 0, none = NoSymbol; i < x11.spares_len; i++) {
+		if (x11.spares_cp[i])
+			XChangeKeyboardMapping(x11.typing, x11.spares[i], 1, &none, 1);
+	}
+
+	XDestroyWindow(x11.typing, x11.fetch);
+	XSync(x11.typing, False);
+
+	// the clipboard goes with the window, and whatever was on it goes with it
+	XDestroyWindow(x11.display, x11.owner);
+	clip_free(x11.clip);
+
+	sys_loop_drop(ConnectionNumber(x11.display));
+	sys_loop_drop(x11.wake[0]);
+
+	XCloseDisplay(x11.typing);
+	XCloseDisplay(x11.display);
+
+	close(x11.wake[0]);
+	close(x11.wake[1]);
+
+	memset(&x11, 0, sizeof x11);
+}
+
+/* x11_bind : grabs (or ungrabs) the hotkey */
+static s32 x11_bind(s32 id, u32 mods, u32 vk, s32 on)
+{
+	struct x11_bind_t *bind;
+	KeySym sym;
+	s32 i;
+
+	if (!on) {
+		for (i = 0; i < x11.binds_len && x11.binds[i].id != id; i++)
+			;
+		if (i == x11.binds_len)
+			return -1;
+
+		bind = x11.binds + i;
+
+		for (i = 0; i < ARRSIZE(x11_locks); i++)
+			XUngrabKey(x11.display, bind->code, bind->mods | x11_locks[i], x11.root);
+		XFlush(x11.display);
+
+		*bind = x11.binds[--x11.binds_len];
+
+		return 0;
+	}
+
+	if (x11.binds_len == ARRSIZE(x11.binds)) {
+		ERR("Only %d hotkeys can be on at once\n", X11_BINDS);
+		return -1;
+	}
+
+	sym = NoSymbol;
+
+	if (('0' <= vk && vk <= '9') || ('A' <= vk && vk <= 'Z')) {
+		sym = tolower(vk);
+	} else if (VK_F1 <= vk && vk <= VK_F12) {
+		sym = XK_F1 + (vk - VK_F1);
+	} else {
+		for (i = 0; i < ARRSIZE(x11_vks); i++) {
+			if (x11_vks[i].vk == vk)
+				sym = x11_vks[i].sym;
+		}
+	}
+
+	bind = x11.binds + x11.binds_len;
+
+	bind->id = id;
+	bind->norepeat = !!(mods & MOD_NOREPEAT);
+	bind->down = 0;
+	bind->code = sym != NoSymbol ? XKeysymToKeycode(x11.display, sym) : 0;
+	bind->mods = ((mods & MOD_ALT) ? Mod1Mask : 0) | ((mods & MOD_CONTROL) ? ControlMask : 0) |
+		((mods & MOD_SHIFT) ? ShiftMask : 0) | ((mods & MOD_WIN) ? Mod4Mask : 0);
+
+	if (!bind->code) {
+		ERR("There's no key for virtual key 0x%02x\n", vk);
+		return -1;
+	}
+
+	// NOTE (brian): A key somebody else already grabbed is a BadAccess, which only shows up once
+	// the server's gotten to it, so this has to sync to find out.
+
+	x11.error = 0;
+
+	for (i = 0; i < ARRSIZE(x11_locks); i++)
+		XGrabKey(x11.display, bind->code, bind->mods | x11_locks[i], x11.root, False, GrabModeAsync, GrabModeAsync);
+
+	XSync(x11.display, False);
+
+	if (x11.error) {
+		ERR("Couldn't grab virtual key 0x%02x, something else has it\n", vk);
+		for (i = 0; i < ARRSIZE(x11_locks); i++)
+			XUngrabKey(x11.display, bind->code, bind->mods | x11_locks[i], x11.root);
+		XSync(x11.display, False);
+		return -1;
+	}
+
+	x11.binds_len++;
+
+	return 0;
+}
+
+/* x11_next : waits for the next hotkey or posted message, or until 'until' */
+static s32 x11_next(s32 *id, f64 until)
+{
+	struct x11_bind_t *bind;
+	XEvent event;
+	u32 mods;
+	s32 msg, i, rc, tag;
+
+	for (;;) {
+		if (read(x11.wake[0], &msg, sizeof msg) == sizeof msg && msg != X11_LOOK)
+			return msg;
+
+		while (XPending(x11.display)) {
+			XNextEvent(x11.display, &event);
+
+			if (event.type == MappingNotify) {
+				XRefreshKeyboardMapping(&event.xmapping);
+				continue;
+			}
+
+			if (event.type == SelectionRequest || event.type == SelectionClear) {
+				x11_serve(&event);
+				continue;
+			}
+
+			if (event.type != KeyPress && event.type != KeyRelease)
+				continue;
+
+			mods = event.xkey.state & (Mod1Mask | ControlMask | ShiftMask | Mod4Mask);
+
+			for (i = 0, bind = NULL; i < x11.binds_len; i++) {
+				if (x11.binds[i].code == event.xkey.keycode && x11.binds[i].mods == mods)
+					bind = x11.binds + i;
+			}
+
+			if (!bind)
+				continue;
+
+			// with detectable auto repeat on, a held key's just presses, with no releases between
+			if (event.type == KeyRelease) {
+				bind->down = 0;
+				continue;
+			}
+
+			if (bind->down && bind->norepeat)
+				continue;
+
+			bind->down = 1;
+			*id = bind->id;
+
+			return SYS_HOTKEY;
+		}
+
+		// Xlib might've read more than it handed out, so the display's only waited on once it's empty
+		rc = sys_loop_wait(until, &tag);
+		if (rc < 0)
+			return SYS_QUIT;
+		if (rc == 0)
+			return SYS_TIMEOUT;
+
+		if (tag != X11_TAG) {
+			*id = tag;
+			return SYS_READY;
+		}
+	}
+}
+
+/* x11_post : wakes up x11_next with the message */
+static void x11_post(s32 msg)
+{
+	// a write this small to a pipe is all or nothing, so messages never get mixed up
+	if (write(x11.wake[1], &msg, sizeof msg) < 0)
+		sys_lasterror();
+}
+
+/* x11_layout : returns the keyboard group that's in use */
+static u64 x11_layout()
+{
+	XkbStateRec state;
+
+	// NOTE (brian): X11 has one keyboard for everyone, and the layouts are the "groups" of it,
+	// so whichever group's locked is the layout the game's seeing too.
+
+	if (XkbGetState(x11.display, XkbUseCoreKbd, &state) != Success)
+		return X11_LAYOUT;
+
+	return X11_LAYOUT | state.group;
+}
+
+/* x11_keymap : fills in the keymap for the given group */
+static void x11_keymap(u64 layout, struct keymap_t *keymap)
+{
+	KeySym sym;
+	s32 min, max, code, level, i;
+	s16 mods;
+
+	// NOTE (brian): The first two levels of a key are without and with shift, and anything past
+	// that is AltGr, which plan_char types as unicode. Latin-1 keysyms are the same numbers as
+	// their code points, so the keymap's just every key's keysyms, turned around. Keys that have
+	// a char on more than one level get the lowest.
+
+	for (i = 0; i < ARRSIZE(keymap->keys); i++)
+		keymap->keys[i] = -1;
+
+	XDisplayKeycodes(x11.display, &min, &max);
+
+	for (level = 0; level < 4; level++) {
+		mods = level == 0 ? 0 : level == 1 ? 0x01 : 0x06;
+
+		for (code = min; code <= max && code <= 0xff; code++) {
+			for (i = 0; i < x11.spares_len && x11.spares[i] != code; i++)
+				;
+			if (i < x11.spares_len)
+				continue;
+
+			sym = XkbKeycodeToKeysym(x11.display, code, layout & 0xff, level);
+			if (sym < 0x20 || 0xff < sym || (0x7f <= sym && sym < 0xa0))
+				continue;
+
+			if (keymap->keys[sym] == -1)
+				keymap->keys[sym] = (mods << 8) | code;
+		}
+	}
+
+	keymap->named.shift = XKeysymToKeycode(x11.display, XK_Shift_L);
+	keymap->named.control = XKeysymToKeycode(x11.display, XK_Control_L);
+	keymap->named.enter = XKeysymToKeycode(x11.display, XK_Return);
+	keymap->named.chat = XKeysymToKeycode(x11.display, XK_t);
+	keymap->named.paste = XKeysymToKeycode(x11.display, XK_v);
+}
+
+/* x11_send : types the keys with XTEST, returns how many of them went in */
+static u32 x11_send(struct key_t *keys, u32 n)
+{
+	KeyCode code;
+	u32 i;
+
+	// NOTE (brian): XTEST doesn't say whether anything went in, the requests just go out on the
+	// connection, and the flush at the end sends them all at once. Unicode goes through a spare
+	// keycode, that gets the code point put on it first (see x11_spare).
+
+	for (i = 0; i < n; i++) {
+		code = keys[i].code;
+
+		if (keys[i].flags & KEY_UNICODE) {
+			code = x11_spare(keys[i].code, keys[i].flags & KEY_UP);
+			if (!code)
+				continue;
+		}
+
+		XTestFakeKeyEvent(x11.typing, code, !(keys[i].flags & KEY_UP), CurrentTime);
+	}
+
+	XFlush(x11.typing);
+
+	return n;
+}
+
+/* x11_spare : puts the code point on a spare keycode, returns the keycode, or 0 if there aren't any */
+static KeyCode x11_spare(u32 cp, s32 up)
+{
+	KeySym sym;
+	s32 i;
+
+	if (!x11.spares_len) {
+		WRN("No spare keycodes, can't type U+%04X\n", cp);
+		return 0;
+	}
+
+	// NOTE (brian): A code point's only ever on the one spare, so the up goes to whichever spare
+	// the down went to, and typing it again just uses that one again, without a new mapping.
+	for (i = 0; i < x11.spares_len && x11.spares_cp[i] != cp; i++)
+		;
+	if (i < x11.spares_len || up)
+		return i < x11.spares_len ? x11.spares[i] : 0;
+
+	i = x11.spares_next;
+	x11.spares_next = (x11.spares_next + 1) % x11.spares_len;
+
+	// NOTE (brian): Whoever's reading the keys gets a MappingNotify, and has to see it before the
+	// key goes down, so the mapping has to be in before the key event goes out. Both are on the
+	// same connection, so the server does them in order, and the client sees them in order.
+
+	sym = cp < 0x100 ? cp : 0x01000000 | cp;
+	XChangeKeyboardMapping(x11.typing, x11.spares[i], 1, &sym, 1);
+	x11.spares_cp[i] = cp;
+
+	return x11.spares[i];
+}
+
+/* x11_clip_swap : takes the clipboard with the text on it, returning what was there, or NULL if it couldn't */
+static void *x11_clip_swap(char *text, size_t len)
+{
+	struct x11_clip_t *clip, *saved;
+	Window owner;
+
+	// NOTE (brian): This is on the typing thread. What the last owner had gets copied off them
+	// before we take it, since they can't be asked once they've lost it. If it was us, we've
+	// already got it, and that just gets handed back.
+
+	clip = calloc(1, sizeof(*clip));
+	saved = calloc(1, sizeof(*saved));
+	if (!clip || !saved || !(clip->items[0].data = malloc(len ? len : 1))) {
+		clip_free(clip);
+		free(saved);
+		return NULL;
+	}
+
+	memcpy(clip->items[0].data, text, len);
+	clip->items[0].target = x11.utf8;
+	clip->items[0].type = x11.utf8;
+	clip->items[0].format = 8;
+	clip->items[0].n = len;
+	clip->len = 1;
+
+	owner = XGetSelectionOwner(x11.typing, x11.clipboard);
+	if (owner != None && owner != x11.owner)
+		clip_save(saved);
+
+	XLockDisplay(x11.display);
+
+	if (owner == x11.owner && x11.clip) {
+		clip_free(saved);
+		saved = x11.clip;
+	} else {
+		clip_free(x11.clip);
+	}
+
+	x11.clip = clip;
+
+	XSetSelectionOwner(x11.display, x11.clipboard, x11.owner, CurrentTime);
+	XFlush(x11.display);
+
+	XUnlockDisplay(x11.display);
+
+	// Xlib might've read events while it was at it, so the main thread has to go and look
+	x11_post(X11_LOOK);
+
+	// this is on the other connection, so it also makes sure the server's seen the one above
+	if (XGetSelectionOwner(x11.typing, x11.clipboard) != x11.owner) {
+		WRN("Couldn't take the clipboard\n");
+		XLockDisplay(x11.display);
+		if (x11.clip == clip) {
+			clip_free(clip);
+			x11.clip = NULL;
+		}
+		XUnlockDisplay(x11.display);
+		clip_free(saved);
+		return NULL;
+	}
+
+	return saved;
+}
+
+/* x11_clip_restore : puts back what x11_clip_swap took off the clipboard */
+static void x11_clip_restore(void *saved)
+{
+	struct x11_clip_t *clip;
+	s32 ours;
+
+	clip = saved;
+
+	// NOTE (brian): If somebody else took the clipboard since, it's theirs, and what we saved is
+	// left behind. Otherwise, we go on answering with what they had, or give it up if they had
+	// nothing. Giving it up when it isn't ours would take it off whoever does have it, so the
+	// server gets asked first, and not just our SelectionClear, which might not be in yet.
+
+	ours = XGetSelectionOwner(x11.typing, x11.clipboard) == x11.owner;
+
+	XLockDisplay(x11.display);
+
+	if (!ours || !x11.clip) {
+		clip_free(clip);
+	} else if (!clip->len) {
+		clip_free(x11.clip);
+		clip_free(clip);
+		x11.clip = NULL;
+		XSetSelectionOwner(x11.display, x11.clipboard, None, CurrentTime);
+	} else {
+		clip_free(x11.clip);
+		x11.clip = clip;
+	}
+
+	XFlush(x11.display);
+	XUnlockDisplay(x11.display);
+
+	x11_post(X11_LOOK);
+}
+
+/* x11_serve : answers someone that's pasting, or lets go of the clipboard when someone else takes it */
+static void x11_serve(XEvent *event)
+{
+	XSelectionRequestEvent *req;
+	XSelectionEvent reply;
+	Atom atoms[CLIP_TARGETS + 1];
+	s32 i;
+
+	XLockDisplay(x11.display);
+
+	if (event->type == SelectionClear) {
+		if (event->xselectionclear.selection == x11.clipboard) {
+			clip_free(x11.clip);
+			x11.clip = NULL;
+		}
+		XUnlockDisplay(x11.display);
+		return;
+	}
+
+	// NOTE (brian): Whoever's pasting says what target they want the clipboard as, and where to
+	// put it. TARGETS is the list of what we've got. Anything else we haven't got (or MULTIPLE,
+	// which nobody asks for anymore) gets a reply with no property, which means no. Old clients
+	// don't say where, and then it goes in the property named after the target.
+
+	req = &event->xselectionrequest;
+
+	memset(&reply, 0, sizeof reply);
+	reply.type = SelectionNotify;
+	reply.requestor = req->requestor;
+	reply.selection = req->selection;
+	reply.target = req->target;
+	reply.property = None;
+	reply.time = req->time;
+
+	if (req->selection == x11.clipboard && x11.clip) {
+		if (req->target == x11.targets) {
+			atoms[0] = x11.targets;
+			for (i = 0; i < x11.clip->len; i++)
+				atoms[i + 1] = x11.clip->items[i].target;
+
+			reply.property = req->property != None ? req->property : req->target;
+			XChangeProperty(x11.display, req->requestor, reply.property, XA_ATOM, 32, PropModeReplace,
+				(u8 *)atoms, x11.clip->len + 1);
+		} else {
+			for (i = 0; i < x11.clip->len && x11.clip->items[i].target != req->target; i++)
+				;
+			if (i < x11.clip->len) {
+				reply.property = req->property != None ? req->property : req->target;
+				XChangeProperty(x11.display, req->requestor, reply.property, x11.clip->items[i].type,
+					x11.clip->items[i].format, PropModeReplace, x11.clip->items[i].data, x11.clip->items[i].n);
+			}
+		}
+	}
+
+	// the requestor might be gone already, which is just an error x11_onerror eats
+	XSendEvent(x11.display, req->requestor, False, NoEventMask, (XEvent *)&reply);
+	XFlush(x11.display);
+
+	XUnlockDisplay(x11.display);
+}
+
+/* clip_save : copies every target off the clipboard's owner, on the typing thread's connection */
+static void clip_save(struct x11_clip_t *clip)
+{
+	// NOTE (brian): These are the ones that are about the selection, and not what's on it, so
+	// there's nothing to keep.
+	static char *skip[] = { "TARGETS", "MULTIPLE", "TIMESTAMP", "SAVE_TARGETS", "DELETE" };
+	Atom skips[ARRSIZE(skip)];
+	Atom *targets, type;
+	unsigned long n, i;
+	s32 format, j;
+
+	XInternAtoms(x11.typing, skip, ARRSIZE(skip), False, skips);
+
+	if (clip_get(x11.targets, &type, &format, (u8 **)&targets, &n) == 0 && (type != XA_ATOM || format != 32)) {
+		free(targets);
+		targets = NULL;
+	}
+
+	// an owner that won't tell us what it's got might still have text
+	if (!targets) {
+		if (clip_get(x11.utf8, &type, &format, &clip->items[0].data, &clip->items[0].n) == 0) {
+			clip->items[0].target = x11.utf8;
+			clip->items[0].type = type;
+			clip->items[0].format = format;
+			clip->len = 1;
+		}
+		return;
+	}
+
+	for (i = 0; i < n && clip->len < CLIP_TARGETS; i++) {
+		for (j = 0; j < ARRSIZE(skips) && skips[j] != targets[i]; j++)
+			;
+		if (j < ARRSIZE(skips))
+			continue;
+
+		if (clip_get(targets[i], &type, &format, &clip->items[clip->len].data, &clip->items[clip->len].n) < 0)
+			continue;
+
+		clip->items[clip->len].target = targets[i];
+		clip->items[clip->len].type = type;
+		clip->items[clip->len].format = format;
+		clip->len++;
+	}
+
+	free(targets);
+}
+
+/* clip_get : asks the clipboard's owner for the target, and waits for it, returns -1 if it didn't come */
+static s32 clip_get(Atom target, Atom *type, s32 *format, u8 **data, unsigned long *n)
+{
+	struct pollfd pfd;
+	XEvent event;
+	unsigned long after;
+	u8 *prop;
+	size_t size;
+	f64 left, until;
+	s32 got;
+
+	*data = NULL;
+
+	XConvertSelection(x11.typing, x11.clipboard, target, x11.property, x11.fetch, CurrentTime);
+	XFlush(x11.typing);
+
+	// NOTE (brian): Nothing else on this connection wants any events, so anything that isn't the
+	// answer just gets thrown away.
+
+	until = sys_time() + CLIP_WAIT_MS / 1e3;
+
+	for (got = 0; !got;) {
+		while (!got && XPending(x11.typing)) {
+			XNextEvent(x11.typing, &event);
+			got = event.type == SelectionNotify && event.xselection.requestor == x11.fetch &&
+				event.xselection.target == target;
+		}
+		if (got)
+			break;
+
+		left = until - sys_time();
+		if (left <= 0)
+			return -1;
+
+		pfd.fd = ConnectionNumber(x11.typing);
+		pfd.events = POLLIN;
+		poll(&pfd, 1, (s32)(left * 1e3) + 1);
+	}
+
+	if (event.xselection.property == None)
+		return -1;
+
+	// anything big enough that it comes in pieces (INCR) gets left behind
+	prop = NULL;
+	if (XGetWindowProperty(x11.typing, x11.fetch, x11.property, 0, CLIP_MAX, True, AnyPropertyType,
+			type, format, n, &after, &prop) != Success || !prop || *type == x11.incr || after) {
+		if (prop)
+			XFree(prop);
+		return -1;
+	}
+
+	// NOTE (brian): Format 32 comes back as longs, whatever size those are, and that's what
+	// XChangeProperty wants back too. It's copied so everything in a clip gets freed the same way.
+	size = *n * (*format == 32 ? sizeof(long) : *format / 8);
+
+	*data = malloc(size ? size : 1);
+	if (*data)
+		memcpy(*data, prop, size);
+
+	XFree(prop);
+
+	return *data ? 0 : -1;
+}
+
+/* clip_free : frees what's in the clip, and the clip */
+static void clip_free(struct x11_clip_t *clip)
+{
+	s32 i;
+
+	if (!clip)
+		return;
+
+	for (i = 0; i < clip->len; i++)
+		free(clip->items[i].data);
+
+	free(clip);
+}
+
+/* x11_onerror : remembers the error, instead of Xlib's default of quitting */
+static int x11_onerror(Display *display, XErrorEvent *event)
+{
+	x11.error = event->error_code;
+	return 0;
+}
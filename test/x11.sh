@@ -0,0 +1,40 @@
+#!/bin/sh
+# X11 smoke test: run by "./build.sh x11", under xvfb-run if there isn't a display already, and it
+# needs xdotool, to press the hotkeys.
+#
+# It runs --bench on the x11 backend, then starts chatmacro with the hotkeys in hotkeys.txt, turns
+# them on, says and swaps and goes to a few things, and quits with them, and fails if chatmacro
+# doesn't quit by itself, or doesn't quit cleanly. Nothing checks what got typed (there's nothing
+# with focus to type into), that's what the golden test's for, this is for the backend itself.
+
+if [ -z "$DISPLAY" ]; then
+	exec xvfb-run -a "$0" "$@"
+fi
+
+set -e
+
+./chatmacro --backend x11 --bench test/macros.txt
+
+./chatmacro --backend x11 --keys test/hotkeys.txt test/macros.txt &
+pid=$!
+sleep 1
+
+# NOTE (brian): The hotkeys are grabbed by keycode, and xdotool holds shift for KP_0 and friends
+# with num lock off, which isn't the hotkey any more, so these are the keypad's other names, that
+# are on the same keys without shift.
+for key in KP_Insert KP_Up KP_Begin KP_Up KP_Down KP_Up F1 F2 F3 KP_Up; do
+	xdotool key $key
+	sleep 0.5
+done
+xdotool key KP_Delete
+
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	kill -0 $pid 2>/dev/null || break
+	sleep 0.5
+done
+if kill -0 $pid 2>/dev/null; then
+	echo "chatmacro didn't quit" >&2
+	kill $pid
+	exit 1
+fi
+wait $pid